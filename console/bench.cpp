@@ -0,0 +1,2429 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+Host-only benchmarks for the virtio device side.
+
+Nothing here touches a card: the "L2CPU DRAM" is a chunk of anonymous host memory,
+the virtio-mmio reg region and the PLIC interrupt register are plain host buffers,
+and a guest thread plays the part of the X280 virtio driver on split virtqueues.
+This lets us measure the host-side request path on its own.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "disk.hpp"
+#include "network.hpp"
+
+static constexpr uint64_t FAKE_STARTING_ADDRESS = 0x4000'3000'0000ULL;
+static constexpr uint64_t FAKE_MEMORY_SIZE = 64ULL * 1024 * 1024;
+static constexpr uint64_t FAKE_IMAGE_SIZE = 64ULL * 1024 * 1024;
+
+/*
+Host memory standing in for an L2CPU: its DRAM, one virtio-mmio reg region and
+the interrupt register
+*/
+struct FakeL2CPU {
+    uint8_t* memory;
+    uint8_t mmio[0x200];
+    uint32_t interrupt_register = 0;
+
+    FakeL2CPU(){
+        memory = reinterpret_cast<uint8_t*>(mmap(nullptr, FAKE_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        assert(memory != MAP_FAILED);
+        memset(mmio, 0, sizeof(mmio));
+    }
+
+    ~FakeL2CPU(){
+        munmap(memory, FAKE_MEMORY_SIZE);
+    }
+
+    VirtioTransport transport(){
+        VirtioTransport t;
+        t.starting_address = FAKE_STARTING_ADDRESS;
+        t.memory = memory;
+        t.mmio_base = mmio;
+        return t;
+    }
+
+    // Guest physical address of an offset into the fake DRAM
+    uint64_t gpa(uint64_t offset){
+        return FAKE_STARTING_ADDRESS + offset;
+    }
+};
+
+// One guest buffer in a descriptor chain
+struct FakeSeg {
+    uint64_t offset;
+    uint32_t len;
+    bool device_writes;
+};
+
+// Most segments a fake guest puts in one chain
+static constexpr int FAKE_MAX_SEGS = 128;
+
+/*
+Guest side of one virtqueue laid out in fake DRAM starting at `base`:
+descriptors, then the driver area, then the device area, then (with
+VIRTIO_RING_F_INDIRECT_DESC) one indirect table per buffer id, then request buffers
+*/
+struct FakeQueue {
+    FakeL2CPU& l2cpu;
+    uint16_t size;
+    uint64_t desc_offset, driver_offset, device_offset, buffer_offset;
+    // Multi-segment chains go in an indirect table instead of the ring
+    bool indirect = false;
+    uint64_t indirect_offset = 0;
+
+    FakeQueue(FakeL2CPU& l2cpu_, uint16_t size_) : l2cpu(l2cpu_), size(size_) {}
+
+    // Carve the indirect tables out of the start of the buffer area
+    void use_indirect(size_t entry_size){
+        indirect = true;
+        indirect_offset = buffer_offset;
+        buffer_offset += ((uint64_t)(size / FAKE_MAX_SEGS) * FAKE_MAX_SEGS * entry_size + 4095) & ~4095ULL;
+    }
+
+    uint64_t indirect_table(uint16_t id, size_t entry_size){
+        return indirect_offset + (uint64_t)id * FAKE_MAX_SEGS * entry_size;
+    }
+    virtual ~FakeQueue() = default;
+
+    // Make a chain of n segments available as buffer `id` (id < size / FAKE_MAX_SEGS)
+    virtual void add(uint16_t id, const FakeSeg* segs, int n) = 0;
+    // Returns the buffer id of the next completed chain, or -1 if there is none
+    virtual int pop_used() = 0;
+    // Bytes the device wrote into the chain pop_used last returned
+    uint32_t last_len = 0;
+    // With VIRTIO_RING_F_EVENT_IDX: only interrupt once another n chains have completed
+    virtual void delay_interrupt(uint16_t n) = 0;
+};
+
+struct FakeSplitQueue : public FakeQueue {
+    struct vring_desc* desc;
+    struct vring_avail* avail;
+    struct vring_used* used;
+    uint16_t last_used = 0;
+
+    FakeSplitQueue(FakeL2CPU& l2cpu_, uint16_t size_, uint64_t base = 0) : FakeQueue(l2cpu_, size_) {
+        desc_offset = base;
+        driver_offset = desc_offset + sizeof(struct vring_desc) * size;
+        device_offset = (driver_offset + sizeof(uint16_t) * (3 + size) + 4095) & ~4095ULL;
+        buffer_offset = (device_offset + sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * size + 4095) & ~4095ULL;
+        desc = reinterpret_cast<struct vring_desc*>(l2cpu.memory + desc_offset);
+        avail = reinterpret_cast<struct vring_avail*>(l2cpu.memory + driver_offset);
+        used = reinterpret_cast<struct vring_used*>(l2cpu.memory + device_offset);
+    }
+
+    // Buffer id maps to a fixed run of FAKE_MAX_SEGS descriptors (or indirect table entries)
+    void add(uint16_t id, const FakeSeg* segs, int n) override {
+        uint16_t head = id * FAKE_MAX_SEGS;
+        if (indirect && n > 1) {
+            uint64_t table_offset = indirect_table(id, sizeof(struct vring_desc));
+            struct vring_desc* table = reinterpret_cast<struct vring_desc*>(l2cpu.memory + table_offset);
+            for (int i = 0; i < n; i++) {
+                table[i].addr = l2cpu.gpa(segs[i].offset);
+                table[i].len = segs[i].len;
+                table[i].flags = (i + 1 < n ? VRING_DESC_F_NEXT : 0) | (segs[i].device_writes ? VRING_DESC_F_WRITE : 0);
+                table[i].next = i + 1;
+            }
+            desc[head].addr = l2cpu.gpa(table_offset);
+            desc[head].len = n * sizeof(struct vring_desc);
+            desc[head].flags = VRING_DESC_F_INDIRECT;
+            n = 0;
+        }
+        for (int i = 0; i < n; i++) {
+            desc[head + i].addr = l2cpu.gpa(segs[i].offset);
+            desc[head + i].len = segs[i].len;
+            desc[head + i].flags = (i + 1 < n ? VRING_DESC_F_NEXT : 0) | (segs[i].device_writes ? VRING_DESC_F_WRITE : 0);
+            desc[head + i].next = head + i + 1;
+        }
+        avail->ring[avail->idx % size] = head;
+        __sync_synchronize();
+        avail->idx = avail->idx + 1;
+    }
+
+    int pop_used() override {
+        __sync_synchronize();
+        if (last_used == used->idx) {
+            return -1;
+        }
+        int head = used->ring[last_used % size].id;
+        last_len = used->ring[last_used % size].len;
+        last_used++;
+        return head / FAKE_MAX_SEGS;
+    }
+
+    void delay_interrupt(uint16_t n) override {
+        *reinterpret_cast<volatile uint16_t*>(reinterpret_cast<uint8_t*>(avail->ring) + sizeof(uint16_t) * size) = last_used + n;
+    }
+};
+
+struct FakePackedQueue : public FakeQueue {
+    struct vring_packed_desc* ring;
+    struct vring_packed_desc_event* driver_event;
+    uint16_t next_avail = 0, last_used = 0;
+    bool avail_wrap = true, used_wrap = true;
+    std::vector<uint16_t> chain_len;
+    uint16_t last_chain_len = 1;
+
+    FakePackedQueue(FakeL2CPU& l2cpu_, uint16_t size_, uint64_t base = 0) : FakeQueue(l2cpu_, size_), chain_len(size_) {
+        desc_offset = base;
+        driver_offset = desc_offset + sizeof(struct vring_packed_desc) * size;
+        device_offset = driver_offset + sizeof(struct vring_packed_desc_event);
+        buffer_offset = (device_offset + sizeof(struct vring_packed_desc_event) + 4095) & ~4095ULL;
+        ring = reinterpret_cast<struct vring_packed_desc*>(l2cpu.memory + desc_offset);
+        driver_event = reinterpret_cast<struct vring_packed_desc_event*>(l2cpu.memory + driver_offset);
+    }
+
+    static uint16_t avail_flags(bool wrap){
+        return wrap ? (1 << VRING_PACKED_DESC_F_AVAIL) : (1 << VRING_PACKED_DESC_F_USED);
+    }
+
+    // Descriptors go in consecutive slots, the head's flags are written last
+    void add(uint16_t id, const FakeSeg* segs, int n) override {
+        uint16_t head = next_avail;
+        uint16_t head_flags = 0;
+        if (indirect && n > 1) {
+            uint64_t table_offset = indirect_table(id, sizeof(struct vring_packed_desc));
+            struct vring_packed_desc* table = reinterpret_cast<struct vring_packed_desc*>(l2cpu.memory + table_offset);
+            for (int i = 0; i < n; i++) {
+                table[i].addr = l2cpu.gpa(segs[i].offset);
+                table[i].len = segs[i].len;
+                table[i].id = 0;
+                table[i].flags = segs[i].device_writes ? VRING_DESC_F_WRITE : 0;
+            }
+            struct vring_packed_desc* d = &ring[next_avail];
+            d->addr = l2cpu.gpa(table_offset);
+            d->len = n * sizeof(struct vring_packed_desc);
+            d->id = id;
+            head_flags = avail_flags(avail_wrap) | VRING_DESC_F_INDIRECT;
+            if (++next_avail == size) {
+                next_avail = 0;
+                avail_wrap = !avail_wrap;
+            }
+            chain_len[id] = 1;
+            last_chain_len = 1;
+            __sync_synchronize();
+            ring[head].flags = head_flags;
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            struct vring_packed_desc* d = &ring[next_avail];
+            d->addr = l2cpu.gpa(segs[i].offset);
+            d->len = segs[i].len;
+            d->id = id;
+            uint16_t flags = avail_flags(avail_wrap) | (i + 1 < n ? VRING_DESC_F_NEXT : 0) | (segs[i].device_writes ? VRING_DESC_F_WRITE : 0);
+            if (i == 0) {
+                head_flags = flags;
+            } else {
+                d->flags = flags;
+            }
+            if (++next_avail == size) {
+                next_avail = 0;
+                avail_wrap = !avail_wrap;
+            }
+        }
+        chain_len[id] = n;
+        last_chain_len = n;
+        __sync_synchronize();
+        ring[head].flags = head_flags;
+    }
+
+    int pop_used() override {
+        __sync_synchronize();
+        uint16_t flags = ring[last_used].flags;
+        bool avail_bit = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+        bool used_bit = flags & (1 << VRING_PACKED_DESC_F_USED);
+        if (avail_bit != used_wrap || used_bit != used_wrap) {
+            return -1;
+        }
+        __sync_synchronize();
+        int id = ring[last_used].id;
+        last_len = ring[last_used].len;
+        last_used += chain_len[id];
+        if (last_used >= size) {
+            last_used -= size;
+            used_wrap = !used_wrap;
+        }
+        return id;
+    }
+
+    void delay_interrupt(uint16_t n) override {
+        uint32_t off = last_used + (uint32_t)n * last_chain_len;
+        bool wrap = used_wrap;
+        if (off >= size) {
+            off -= size;
+            wrap = !wrap;
+        }
+        driver_event->off_wrap = off | (wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+        __sync_synchronize();
+        driver_event->flags = VRING_PACKED_EVENT_FLAG_DESC;
+    }
+};
+
+// Whether a fake guest accepting driver_features would set up packed rings
+static bool uses_packed(uint64_t driver_features){
+    return driver_features & (1ULL << VIRTIO_F_RING_PACKED);
+}
+
+static std::unique_ptr<FakeQueue> make_queue(FakeL2CPU& l2cpu, uint64_t driver_features, uint64_t base = 0){
+    std::unique_ptr<FakeQueue> q;
+    if (uses_packed(driver_features)) {
+        q = std::make_unique<FakePackedQueue>(l2cpu, 16384, base);
+    } else {
+        q = std::make_unique<FakeSplitQueue>(l2cpu, 16384, base);
+    }
+    if (driver_features & (1ULL << VIRTIO_RING_F_INDIRECT_DESC)) {
+        q->use_indirect(uses_packed(driver_features) ? sizeof(struct vring_packed_desc) : sizeof(struct vring_desc));
+    }
+    return q;
+}
+
+// Point a device's virtqueues at fake guest queues instead of negotiating them with a driver
+template <typename Device>
+class Bench : public Device {
+public:
+    using Device::Device;
+
+    // driver_features: what the fake driver accepts, as in VIRTIO_MMIO_DRIVER_FEATURES
+    void attach(std::vector<FakeQueue*> queues, uint64_t driver_features){
+        this->offer_ring_features();
+        this->driver_features_list[0] = driver_features;
+        this->driver_features_list[1] = (driver_features >> 32) | (1<<(VIRTIO_F_VERSION_1-32));
+        this->negotiate();
+        this->descriptor_table_address.clear();
+        this->available_ring_address.clear();
+        this->used_ring_address.clear();
+        this->queue_nums.clear();
+        for (FakeQueue* q : queues) {
+            this->descriptor_table_address.push_back(q->l2cpu.gpa(q->desc_offset));
+            this->available_ring_address.push_back(q->l2cpu.gpa(q->driver_offset));
+            this->used_ring_address.push_back(q->l2cpu.gpa(q->device_offset));
+            this->queue_nums.push_back(q->size);
+        }
+        this->map_queues();
+    }
+};
+
+using BenchBlk = Bench<VirtioBlk>;
+
+std::string make_image(){
+    char path[] = "/tmp/tt-bh-bench-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    int r = ftruncate(fd, FAKE_IMAGE_SIZE);
+    assert(r == 0);
+    // Write it out for real so reads hit the disk and not a hole once the cache is dropped
+    std::vector<uint8_t> chunk(1 << 20, 0x5a);
+    for (uint64_t off = 0; off < FAKE_IMAGE_SIZE; off += chunk.size()) {
+        ssize_t written = pwrite(fd, chunk.data(), chunk.size(), off);
+        assert(written == (ssize_t)chunk.size());
+    }
+    close(fd);
+    return path;
+}
+
+const char* blk_engine_name(BlkEngine engine){
+    switch (engine) {
+    case BlkEngine::MMAP: return "mmap";
+    case BlkEngine::PREAD: return "pread";
+    default: return "io_uring";
+    }
+}
+
+/*
+Guest side load for run_blk
+*/
+struct BlkLoad {
+    uint32_t type = VIRTIO_BLK_T_OUT;
+    uint32_t request_size = 4096;
+    // Number of guest buffers the data of each request is scattered over
+    uint16_t data_segments = 1;
+    // Closed loop: requests kept outstanding. Bursts: requests submitted per burst. 0 leaves the device idle
+    uint16_t inflight = 128;
+    // 0 for a closed loop (resubmit as soon as a request completes), otherwise the time between bursts
+    uint32_t burst_interval_us = 0;
+    uint64_t driver_features = 0;
+    double seconds = 1.0;
+    // Random request aligned offsets instead of walking the image front to back
+    bool random = false;
+    // Drop the image from the page cache first, so the backend has to go to disk
+    bool cold_cache = false;
+    // Make every nth request a VIRTIO_BLK_T_FLUSH (0: never)
+    uint32_t flush_every = 0;
+    // Print the stats of the image's backend (overlay, zstd...) when done
+    bool report_backend = false;
+    // Print merge and readahead stats when done
+    bool report_io = false;
+};
+
+struct BlkResult {
+    double requests_per_second;
+    double interrupts_per_second;
+    // Submit to used ring, as seen by the guest
+    double avg_latency_us;
+    double max_latency_us;
+    VirtioStats stats;
+    PollStats poll;
+    // The interrupt dispatcher thread's
+    PollStats dispatcher;
+};
+
+/*
+Runs a VirtioBlk device thread against a fake guest generating `load` on each of
+the device's blk.num_queues queues. Every request is a 3 descriptor chain: outhdr, data, status byte.
+With EVENT_IDX on, the guest re-arms used_event the way Linux's
+virtqueue_enable_cb_delayed() does: only after 3/4 of what is outstanding completes
+*/
+BlkResult run_blk(const std::string& image, const VirtioOptions& options, const BlkLoad& load, const BlkOptions& blk = BlkOptions()){
+    using clock = std::chrono::steady_clock;
+    // Every member of a striped image
+    for (size_t start = 0; load.cold_cache && start < image.size(); ) {
+        size_t end = std::min(image.find(StripeImage::SEPARATOR, start), image.size());
+        int fd = open(image.substr(start, end - start).c_str(), O_RDWR);
+        assert(fd >= 0);
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        start = end + 1;
+    }
+    FakeL2CPU l2cpu;
+    std::atomic<bool> exit_flag{false};
+    InterruptDispatcher interrupts(&l2cpu.interrupt_register);
+    BenchBlk device(l2cpu.transport(), exit_flag, interrupts, 33, image, blk);
+    device.options = options;
+
+    // Split the fake DRAM between the queues
+    uint16_t num_queues = std::max<uint16_t>(blk.num_queues, 1);
+    std::vector<std::unique_ptr<FakeQueue>> queues;
+    std::vector<FakeQueue*> attached;
+    for (uint16_t i = 0; i < num_queues; i++) {
+        queues.push_back(make_queue(l2cpu, load.driver_features, FAKE_MEMORY_SIZE / num_queues * i));
+        attached.push_back(queues.back().get());
+    }
+    device.attach(attached, load.driver_features);
+
+    uint64_t sectors_per_request = load.request_size / 512;
+    uint64_t sectors = FAKE_IMAGE_SIZE / 512;
+    uint64_t next_sector = 0;
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    uint64_t submissions = 0;
+    std::vector<clock::time_point> submitted((size_t)num_queues * load.inflight);
+    auto submit = [&](uint16_t queue_idx, uint16_t slot){
+        FakeQueue& q = *queues[queue_idx];
+        uint64_t buf = q.buffer_offset + (uint64_t)slot * (load.request_size + 4096);
+        struct virtio_blk_outhdr* hdr = reinterpret_cast<struct virtio_blk_outhdr*>(l2cpu.memory + buf);
+        bool flush = load.flush_every && ++submissions % load.flush_every == 0;
+        hdr->type = flush ? VIRTIO_BLK_T_FLUSH : load.type;
+        hdr->ioprio = 0;
+        if (load.random) {
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            next_sector = rng % (sectors / sectors_per_request) * sectors_per_request;
+        }
+        hdr->sector = next_sector;
+        next_sector += sectors_per_request;
+        // Start over rather than run off the end when the request size doesn't divide the image
+        if (next_sector + sectors_per_request > sectors) {
+            next_sector = 0;
+        }
+        FakeSeg segs[FAKE_MAX_SEGS];
+        int n = 0;
+        segs[n++] = {buf, sizeof(struct virtio_blk_outhdr), false};
+        if (!flush && (load.type == VIRTIO_BLK_T_DISCARD || load.type == VIRTIO_BLK_T_WRITE_ZEROES)) {
+            // One range covering request_size instead of data
+            struct virtio_blk_discard_write_zeroes* range = reinterpret_cast<struct virtio_blk_discard_write_zeroes*>(l2cpu.memory + buf + 512);
+            range->sector = hdr->sector;
+            range->num_sectors = sectors_per_request;
+            range->flags = 0;
+            segs[n++] = {buf + 512, sizeof(*range), false};
+            segs[n++] = {buf + 512 + load.request_size, 1, true};
+            l2cpu.memory[buf + 512 + load.request_size] = 0xff;
+            submitted[(size_t)queue_idx * load.inflight + slot] = clock::now();
+            q.add(slot, segs, n);
+            return;
+        }
+        uint32_t segment_size = load.request_size / load.data_segments;
+        for (uint16_t i = 0; i < (flush ? 0 : load.data_segments); i++) {
+            segs[n++] = {buf + 512 + (uint64_t)i * segment_size, segment_size, load.type == VIRTIO_BLK_T_IN};
+        }
+        segs[n++] = {buf + 512 + load.request_size, 1, true};
+        l2cpu.memory[buf + 512 + load.request_size] = 0xff;
+        submitted[(size_t)queue_idx * load.inflight + slot] = clock::now();
+        q.add(slot, segs, n);
+    };
+
+    std::thread interrupt_thread([&]{ interrupts.run(exit_flag, options.poll); });
+    std::thread device_thread([&]{ device.device_loop(); });
+
+    uint64_t completed = 0;
+    double latency_total_us = 0, latency_max_us = 0;
+    uint32_t outstanding = 0;
+    auto start = clock::now();
+    auto end = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(load.seconds));
+    auto next_burst = start;
+    while (clock::now() < end) {
+        if (load.burst_interval_us == 0 ? outstanding == 0 : (outstanding == 0 && clock::now() >= next_burst)) {
+            for (uint16_t queue_idx = 0; queue_idx < num_queues; queue_idx++) {
+                for (uint16_t slot = 0; slot < load.inflight; slot++) {
+                    submit(queue_idx, slot);
+                }
+            }
+            outstanding = (uint32_t)num_queues * load.inflight;
+            next_burst += std::chrono::microseconds(load.burst_interval_us);
+        }
+        for (uint16_t queue_idx = 0; queue_idx < num_queues; queue_idx++) {
+            FakeQueue& q = *queues[queue_idx];
+            int slot;
+            bool reaped = false;
+            while ((slot = q.pop_used()) >= 0) {
+                auto now = clock::now();
+                uint64_t buf = q.buffer_offset + (uint64_t)slot * (load.request_size + 4096);
+                assert(l2cpu.memory[buf + 512 + load.request_size] == VIRTIO_BLK_S_OK);
+                double latency_us = std::chrono::duration<double, std::micro>(now - submitted[(size_t)queue_idx * load.inflight + slot]).count();
+                latency_total_us += latency_us;
+                latency_max_us = std::max(latency_max_us, latency_us);
+                completed++;
+                reaped = true;
+                if (load.burst_interval_us == 0) {
+                    submit(queue_idx, slot);
+                } else {
+                    outstanding--;
+                }
+            }
+            if (reaped) {
+                q.delay_interrupt(load.inflight * 3 / 4);
+            }
+        }
+        if (load.burst_interval_us != 0 && outstanding == 0) {
+            std::this_thread::sleep_until(std::min(next_burst, end));
+        } else {
+            // The real guest has its own cores, don't take the device thread's
+            std::this_thread::yield();
+        }
+    }
+    double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    exit_flag = true;
+    device_thread.join();
+    interrupt_thread.join();
+    if (load.report_backend) {
+        device.report_backend("    backend");
+    }
+    if (load.report_io) {
+        device.report_io("   ");
+    }
+    // The device is the dispatcher's only source
+    return BlkResult{completed / elapsed, interrupts.interrupts(0) / elapsed,
+        completed ? latency_total_us / completed : 0.0, latency_max_us, device.stats, device.poller.get_stats(), interrupts.poller.get_stats()};
+}
+
+/*
+Guest side of a data check: a VirtioBlk on image answering one request at a time, with
+the data of each request scattered over segments guest buffers that don't start on a
+sector (or even an 8 byte) boundary. The benches above only look at the status byte
+*/
+class BlkChecker {
+    FakeL2CPU l2cpu;
+    std::atomic<bool> exit_flag{false};
+    InterruptDispatcher interrupts;
+    BenchBlk device;
+    std::unique_ptr<FakeQueue> queue;
+    std::thread interrupt_thread, device_thread;
+
+    // Send one request off and wait for it, false if it didn't come back VIRTIO_BLK_S_OK
+    bool run(uint32_t type, uint64_t sector, uint8_t* data, uint32_t len, uint16_t segments){
+        uint64_t buf = queue->buffer_offset;
+        struct virtio_blk_outhdr* hdr = reinterpret_cast<struct virtio_blk_outhdr*>(l2cpu.memory + buf);
+        hdr->type = type;
+        hdr->ioprio = 0;
+        hdr->sector = sector;
+        FakeSeg segs[FAKE_MAX_SEGS];
+        int n = 0;
+        segs[n++] = {buf, sizeof(struct virtio_blk_outhdr), false};
+        // Segment i starts i * 4K + 3 bytes past the end of the previous one
+        uint64_t at = buf + 4096 + 3;
+        uint32_t done = 0;
+        for (uint16_t i = 0; i < segments; i++) {
+            uint32_t seg_len = i + 1 == segments ? len - done : len / segments;
+            if (type == VIRTIO_BLK_T_OUT) {
+                memcpy(l2cpu.memory + at, data + done, seg_len);
+            }
+            segs[n++] = {at, seg_len, type == VIRTIO_BLK_T_IN};
+            done += seg_len;
+            at += seg_len + (uint64_t)i * 4096 + 3;
+        }
+        uint64_t status = at;
+        segs[n++] = {status, 1, true};
+        l2cpu.memory[status] = 0xff;
+        queue->add(0, segs, n);
+        while (queue->pop_used() < 0) {
+            std::this_thread::yield();
+        }
+        at = buf + 4096 + 3;
+        done = 0;
+        for (uint16_t i = 0; type == VIRTIO_BLK_T_IN && i < segments; i++) {
+            uint32_t seg_len = i + 1 == segments ? len - done : len / segments;
+            memcpy(data + done, l2cpu.memory + at, seg_len);
+            done += seg_len;
+            at += seg_len + (uint64_t)i * 4096 + 3;
+        }
+        return l2cpu.memory[status] == VIRTIO_BLK_S_OK;
+    }
+
+public:
+    BlkChecker(const std::string& image, const BlkOptions& blk = BlkOptions())
+        : interrupts(&l2cpu.interrupt_register), device(l2cpu.transport(), exit_flag, interrupts, 33, image, blk) {
+        queue = make_queue(l2cpu, 0);
+        device.attach({queue.get()}, 0);
+        interrupt_thread = std::thread([this]{ interrupts.run(exit_flag, PollOptions()); });
+        device_thread = std::thread([this]{ device.device_loop(); });
+    }
+
+    ~BlkChecker(){
+        exit_flag = true;
+        device_thread.join();
+        interrupt_thread.join();
+    }
+
+    std::vector<uint8_t> read(uint64_t offset, uint32_t len, uint16_t segments = 1){
+        std::vector<uint8_t> data(len);
+        bool ok = run(VIRTIO_BLK_T_IN, offset / 512, data.data(), len, segments);
+        assert(ok);
+        return data;
+    }
+
+    void write(uint64_t offset, std::vector<uint8_t> data, uint16_t segments = 1){
+        bool ok = run(VIRTIO_BLK_T_OUT, offset / 512, data.data(), data.size(), segments);
+        assert(ok);
+    }
+
+    // Whether the device turns down a read/write of len bytes at sector
+    bool refused(uint32_t type, uint64_t sector, uint32_t len){
+        std::vector<uint8_t> data(len, 0xa5);
+        return !run(type, sector, data.data(), len, 1);
+    }
+};
+
+// Bytes of a file, what a check compares the guest's reads against
+std::vector<uint8_t> file_bytes(const std::string& path, uint64_t offset, size_t len){
+    std::vector<uint8_t> data(len);
+    int fd = open(path.c_str(), O_RDONLY);
+    assert(fd >= 0);
+    ssize_t n = pread(fd, data.data(), len, offset);
+    assert(n == (ssize_t)len);
+    close(fd);
+    return data;
+}
+
+// Bytes that are different for every offset (and seed), so data that lands in the wrong place shows
+std::vector<uint8_t> pattern(size_t len, uint64_t seed){
+    std::vector<uint8_t> data(len);
+    uint64_t x = seed * 0x9e3779b97f4a7c15ULL | 1;
+    for (uint8_t& b : data) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        b = x;
+    }
+    return data;
+}
+
+// Say where two buffers first differ and fail, or that they're the same
+void check_same(const char* what, const std::vector<uint8_t>& got, const std::vector<uint8_t>& want){
+    assert(got.size() == want.size());
+    if (memcmp(got.data(), want.data(), got.size()) != 0) {
+        size_t i = 0;
+        while (got[i] == want[i]) {
+            i++;
+        }
+        printf("  data check %s: FAILED, byte %zu is %02x instead of %02x\n", what, i, got[i], want[i]);
+        fflush(stdout);
+        abort();
+    }
+    printf("  data check %s: ok\n", what);
+}
+
+// Fail with what was wrong unless ok
+void check_field(const char* what, bool ok, const char* field, size_t got, size_t want){
+    if (!ok) {
+        printf("  data check %s: FAILED, %s is %zu instead of %zu\n", what, field, got, want);
+        fflush(stdout);
+        abort();
+    }
+}
+
+/*
+Sustained 4K writes, one chain per queue per pass (batch budget 1) against batched draining
+*/
+void BenchBlkBatchDrain(const std::string& image, double seconds){
+    printf("virtio-blk 4K writes, 128 in flight\n");
+    for (uint16_t budget : {1, 16, 256}) {
+        VirtioOptions options;
+        options.batch_budget = budget;
+        BlkLoad load;
+        load.seconds = seconds;
+        BlkResult r = run_blk(image, options, load);
+        printf("  batch budget %5u: %12.0f req/s\n", budget, r.requests_per_second);
+    }
+}
+
+/*
+Interrupts raised with and without VIRTIO_RING_F_EVENT_IDX for the same write load
+*/
+void BenchBlkEventIdx(const std::string& image, double seconds){
+    printf("virtio-blk 4K writes, 128 in flight, interrupt suppression\n");
+    for (uint16_t budget : {16, 256}) {
+        for (bool event_idx : {false, true}) {
+            VirtioOptions options;
+            options.batch_budget = budget;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.driver_features = event_idx ? 1ULL<<VIRTIO_RING_F_EVENT_IDX : 0;
+            BlkResult r = run_blk(image, options, load);
+            printf("  batch budget %5u event_idx %-3s: %12.0f req/s %10.0f irq/s %10lu suppressed\n", budget, event_idx ? "on" : "off",
+                r.requests_per_second, r.interrupts_per_second, r.stats.interrupts_suppressed);
+        }
+    }
+}
+
+/*
+Device thread CPU use against request latency for a busy, an idle and a bursty guest,
+with the old fixed 1us sleep between passes and with the adaptive poller.
+
+The bursty guest is where the adaptive poller costs latency: between bursts it backs
+off to max_sleep_us sleeps, and a burst waits for the one it lands in (printed as
+"wake"), so does everything queued behind it. --poll-max-sleep-us trades that back
+for CPU, shown with a 100us cap. Max latencies here are what the fake guest sees on
+a host shared with the device and dispatcher threads, with fewer cores than threads
+they are mostly scheduler time slices rather than anything the poller does
+*/
+void BenchPolling(const std::string& image, double seconds){
+    printf("polling: device thread CPU vs latency\n");
+    PollOptions fixed;
+    fixed.spin_us = 0;
+    fixed.min_sleep_us = 1;
+    fixed.max_sleep_us = 1;
+    PollOptions adaptive;
+    PollOptions capped;
+    capped.max_sleep_us = 100;
+
+    struct { const char* name; uint16_t inflight; uint32_t burst_interval_us; } loads[] = {
+        {"busy", 128, 0},
+        {"idle", 0, 0},
+        {"mixed", 32, 5000},
+    };
+    struct { const char* name; PollOptions& poll; } pollers[] = {
+        {"fixed", fixed},
+        {"adaptive", adaptive},
+        {"max 100", capped},
+    };
+    for (auto& l : loads) {
+        for (auto& p : pollers) {
+            VirtioOptions options;
+            options.poll = p.poll;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.inflight = l.inflight;
+            load.burst_interval_us = l.burst_interval_us;
+            BlkResult r = run_blk(image, options, load);
+            printf("  %-5s %-8s: %5.1f%% cpu %12.0f req/s latency avg %8.1fus max %8.1fus wake max %6.1fus\n", l.name, p.name,
+                r.poll.wall_ns ? 100.0 * r.poll.cpu_ns / r.poll.wall_ns : 0.0, r.requests_per_second, r.avg_latency_us, r.max_latency_us,
+                r.poll.wake_latency_ns_max / 1e3);
+        }
+    }
+}
+
+/*
+Split against packed virtqueues for the same load, reads and writes
+*/
+void BenchRingLayout(const std::string& image, double seconds){
+    printf("virtio-blk split vs packed rings, 128 in flight\n");
+    for (uint32_t type : {VIRTIO_BLK_T_IN, VIRTIO_BLK_T_OUT}) {
+        for (bool packed : {false, true}) {
+            VirtioOptions options;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.type = type;
+            load.driver_features = (1ULL<<VIRTIO_RING_F_EVENT_IDX) | (packed ? 1ULL<<VIRTIO_F_RING_PACKED : 0);
+            BlkResult r = run_blk(image, options, load);
+            printf("  4K %-5s %-6s: %12.0f req/s %10.0f irq/s\n", type == VIRTIO_BLK_T_IN ? "read" : "write", packed ? "packed" : "split",
+                r.requests_per_second, r.interrupts_per_second);
+        }
+    }
+}
+
+/*
+64K requests scattered over 16 4K guest pages, as direct chains and as indirect tables
+*/
+void BenchIndirect(const std::string& image, double seconds){
+    printf("virtio-blk 64K requests in 16 segments, 128 in flight\n");
+    for (bool packed : {false, true}) {
+        for (bool indirect : {false, true}) {
+            VirtioOptions options;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.type = VIRTIO_BLK_T_IN;
+            load.request_size = 65536;
+            load.data_segments = 16;
+            load.driver_features = (1ULL<<VIRTIO_RING_F_EVENT_IDX) | (packed ? 1ULL<<VIRTIO_F_RING_PACKED : 0) | (indirect ? 1ULL<<VIRTIO_RING_F_INDIRECT_DESC : 0);
+            BlkResult r = run_blk(image, options, load);
+            printf("  %-6s %-8s: %12.0f req/s %8.0f MB/s\n", packed ? "packed" : "split", indirect ? "indirect" : "direct",
+                r.requests_per_second, r.requests_per_second * load.request_size / 1e6);
+        }
+    }
+}
+
+/*
+PCIe reads spent on ring bookkeeping per request, reading the rings field by field
+against pulling them over in bulk (ring_snapshot)
+*/
+void BenchRingReads(const std::string& image, double seconds){
+    printf("virtio-blk ring reads per request, 4K reads, 128 in flight\n");
+    for (bool packed : {false, true}) {
+        for (uint16_t segments : {1, 4}) {
+            for (bool snapshot : {false, true}) {
+                VirtioOptions options;
+                options.ring_snapshot = snapshot;
+                BlkLoad load;
+                load.seconds = seconds;
+                load.type = VIRTIO_BLK_T_IN;
+                load.data_segments = segments;
+                load.driver_features = (1ULL<<VIRTIO_RING_F_EVENT_IDX) | (packed ? 1ULL<<VIRTIO_F_RING_PACKED : 0);
+                BlkResult r = run_blk(image, options, load);
+                printf("  %-6s %u data segs %-8s: %6.2f reads/req %12.0f req/s\n", packed ? "packed" : "split", segments,
+                    snapshot ? "snapshot" : "direct", r.stats.chains ? (double)r.stats.ring_reads / r.stats.chains : 0.0, r.requests_per_second);
+            }
+        }
+    }
+}
+
+/*
+Interrupts actually raised on the PLIC with different coalescing settings, for a busy
+and a bursty guest (no EVENT_IDX, so every batch asks for one)
+*/
+void BenchCoalescing(const std::string& image, double seconds){
+    printf("virtio-blk interrupt coalescing, 4K writes\n");
+    CoalesceOptions settings[] = {{0, 1}, {20, 16}, {100, 64}};
+    struct { const char* name; uint16_t inflight; uint32_t burst_interval_us; } loads[] = {
+        {"busy", 128, 0},
+        {"light", 4, 0},
+        {"mixed", 32, 5000},
+    };
+    for (auto& l : loads) {
+        for (CoalesceOptions& c : settings) {
+            VirtioOptions options;
+            options.coalesce = c;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.inflight = l.inflight;
+            load.burst_interval_us = l.burst_interval_us;
+            BlkResult r = run_blk(image, options, load);
+            printf("  %-5s %3uus/%2u frames: %12.0f req/s %10.0f irq/s latency avg %8.1fus dispatcher %5.1f%% cpu\n", l.name, c.usecs, c.frames,
+                r.requests_per_second, r.interrupts_per_second, r.avg_latency_us,
+                r.dispatcher.wall_ns ? 100.0 * r.dispatcher.cpu_ns / r.dispatcher.wall_ns : 0.0);
+        }
+    }
+}
+
+/*
+fio style runs of the mmap, pread and io_uring engines with the image out of the page
+cache: 4K random reads and 64K sequential writes at queue depth 1 and 32
+*/
+void BenchBlkEngines(const std::string& image, double seconds){
+    printf("virtio-blk engines, cold page cache\n");
+    struct { const char* name; uint32_t type; uint32_t request_size; bool random; } jobs[] = {
+        {"randread 4K", VIRTIO_BLK_T_IN, 4096, true},
+        {"write 64K", VIRTIO_BLK_T_OUT, 65536, false},
+    };
+    for (auto& job : jobs) {
+        for (uint16_t depth : {1, 32}) {
+            for (BlkEngine engine : {BlkEngine::MMAP, BlkEngine::PREAD, BlkEngine::IO_URING}) {
+                VirtioOptions options;
+                BlkOptions blk;
+                blk.engine = engine;
+                BlkLoad load;
+                load.seconds = seconds;
+                load.type = job.type;
+                load.request_size = job.request_size;
+                load.random = job.random;
+                load.inflight = depth;
+                load.cold_cache = true;
+                BlkResult r = run_blk(image, options, load, blk);
+                printf("  %-11s qd %2u %-8s: %10.0f IOPS %8.1f MB/s latency avg %8.1fus max %8.1fus\n", job.name, depth,
+                    blk_engine_name(engine), r.requests_per_second,
+                    r.requests_per_second * job.request_size / 1e6, r.avg_latency_us, r.max_latency_us);
+            }
+        }
+    }
+}
+
+/*
+A sequential reader like `cat bigfile` (16K reads, one at a time) on a cold page cache
+with and without host readahead, then 4K sequential I/O 32 deep with and without
+merging adjacent requests into one io_uring readv/writev
+*/
+void BenchBlkSequential(const std::string& image, double seconds){
+    printf("virtio-blk sequential streams\n");
+    for (BlkEngine engine : {BlkEngine::MMAP, BlkEngine::IO_URING}) {
+        for (uint32_t readahead_kb : {0, 2048}) {
+            VirtioOptions options;
+            BlkOptions blk;
+            blk.engine = engine;
+            blk.readahead_kb = readahead_kb;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.type = VIRTIO_BLK_T_IN;
+            load.request_size = 16384;
+            load.inflight = 1;
+            load.cold_cache = true;
+            load.report_io = readahead_kb != 0;
+            BlkResult r = run_blk(image, options, load, blk);
+            printf("  cold read 16K qd 1 %-8s readahead %-3s: %8.0f IOPS %8.1f MB/s latency avg %8.1fus\n",
+                blk_engine_name(engine), readahead_kb ? "on" : "off", r.requests_per_second,
+                r.requests_per_second * load.request_size / 1e6, r.avg_latency_us);
+        }
+    }
+    for (uint32_t type : {VIRTIO_BLK_T_IN, VIRTIO_BLK_T_OUT}) {
+        for (uint32_t max_merge_kb : {0, 1024}) {
+            VirtioOptions options;
+            BlkOptions blk;
+            blk.engine = BlkEngine::IO_URING;
+            blk.max_merge_kb = max_merge_kb;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.type = type;
+            load.inflight = 32;
+            load.report_io = max_merge_kb != 0;
+            BlkResult r = run_blk(image, options, load, blk);
+            printf("  %-5s 4K qd 32 io_uring merging %-3s: %8.0f IOPS %8.1f MB/s latency avg %8.1fus\n",
+                type == VIRTIO_BLK_T_IN ? "read" : "write", max_merge_kb ? "on" : "off", r.requests_per_second,
+                r.requests_per_second * load.request_size / 1e6, r.avg_latency_us);
+        }
+    }
+}
+
+/*
+The same sequential reads and writes moved as single 4K segment requests (what Linux
+sends without VIRTIO_BLK_F_SEG_MAX) and as requests of 32 and 126 4K segments
+*/
+void BenchBlkRequestSize(const std::string& image, double seconds){
+    printf("virtio-blk request size, sequential, 4K segments, 32 in flight\n");
+    for (uint32_t type : {VIRTIO_BLK_T_IN, VIRTIO_BLK_T_OUT}) {
+        for (uint16_t segments : {1, 32, 126}) {
+            VirtioOptions options;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.type = type;
+            load.request_size = segments * 4096;
+            load.data_segments = segments;
+            load.inflight = 32;
+            BlkResult r = run_blk(image, options, load);
+            printf("  %-5s %3u segments: %8.0f IOPS %8.1f MB/s latency avg %8.1fus\n", type == VIRTIO_BLK_T_IN ? "read" : "write",
+                segments, r.requests_per_second, r.requests_per_second * load.request_size / 1e6, r.avg_latency_us);
+        }
+    }
+}
+
+/*
+What each cache mode costs for 4K writes with a flush every 64 requests, the way a
+guest filesystem committing its journal would send them
+*/
+void BenchBlkCacheModes(const std::string& image, double seconds){
+    printf("virtio-blk cache modes, 4K writes, flush every 64, 32 in flight\n");
+    struct { const char* name; BlkCache cache; } modes[] = {
+        {"writeback", BlkCache::WRITEBACK},
+        {"writethrough", BlkCache::WRITETHROUGH},
+        {"none", BlkCache::NONE},
+    };
+    for (BlkEngine engine : {BlkEngine::MMAP, BlkEngine::PREAD, BlkEngine::IO_URING}) {
+        for (auto& mode : modes) {
+            VirtioOptions options;
+            BlkOptions blk;
+            blk.engine = engine;
+            blk.cache = mode.cache;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.inflight = 32;
+            load.flush_every = 64;
+            BlkResult r = run_blk(image, options, load, blk);
+            printf("  %-8s %-12s: %10.0f IOPS latency avg %8.1fus max %8.1fus\n", blk_engine_name(engine),
+                mode.name, r.requests_per_second, r.avg_latency_us, r.max_latency_us);
+        }
+    }
+
+    /*
+    O_DIRECT goes through a bounce buffer: guest buffers at odd addresses, requests
+    smaller than the filesystem's block and the last sectors of the image, checked
+    against the file
+    */
+    char path[] = "/tmp/tt-bh-bench-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    std::vector<uint8_t> want = pattern(1 << 20, 5);
+    ssize_t written = pwrite(fd, want.data(), want.size(), 0);
+    assert(written == (ssize_t)want.size());
+    close(fd);
+    struct { uint64_t offset; uint32_t len; uint16_t segments; } requests[] = {
+        {8192, 16384, 3},
+        {3 * 512, 3 * 512, 2},
+        {(1 << 20) - 5 * 512, 5 * 512, 1},
+    };
+    for (BlkEngine engine : {BlkEngine::PREAD, BlkEngine::IO_URING}) {
+        BlkOptions blk;
+        blk.engine = engine;
+        blk.cache = BlkCache::NONE;
+        BlkChecker check(path, blk);
+        for (auto& r : requests) {
+            std::string what = std::string("O_DIRECT ") + blk_engine_name(engine) + " " + std::to_string(r.len) + " bytes at " + std::to_string(r.offset);
+            check_same((what + " read").c_str(), check.read(r.offset, r.len, r.segments), file_bytes(path, r.offset, r.len));
+            std::vector<uint8_t> data = pattern(r.len, r.offset + (uint64_t)engine);
+            check.write(r.offset, data, r.segments);
+            check_same((what + " written").c_str(), file_bytes(path, r.offset, r.len), data);
+        }
+    }
+
+    // Sectors past the end, including one whose byte offset wraps round to 0, mustn't reach the file
+    want = file_bytes(path, 0, 1 << 20);
+    for (BlkEngine engine : {BlkEngine::MMAP, BlkEngine::PREAD, BlkEngine::IO_URING}) {
+        BlkOptions blk;
+        blk.engine = engine;
+        BlkChecker check(path, blk);
+        for (uint64_t sector : {(uint64_t)(1 << 20) / 512, (uint64_t)1 << 55, (uint64_t)UINT64_MAX}) {
+            for (uint32_t type : {VIRTIO_BLK_T_IN, VIRTIO_BLK_T_OUT}) {
+                bool refused = check.refused(type, sector, 4096);
+                check_field("request past the end", refused, "status", 0, 1);
+            }
+        }
+    }
+    check_same("image after requests past the end", file_bytes(path, 0, 1 << 20), want);
+    unlink(path);
+}
+
+/*
+Zeroing and trimming 1M at a time: writing out zeroes against WRITE_ZEROES and
+DISCARD (fallocate), and how much of the image is still allocated afterwards
+*/
+void BenchBlkDiscard(double seconds){
+    printf("virtio-blk zeroing/trimming 1M requests, 8 in flight\n");
+    struct { const char* name; uint32_t type; } jobs[] = {
+        {"write zeroes (OUT)", VIRTIO_BLK_T_OUT},
+        {"write_zeroes", VIRTIO_BLK_T_WRITE_ZEROES},
+        {"discard", VIRTIO_BLK_T_DISCARD},
+    };
+    for (auto& job : jobs) {
+        std::string image = make_image();
+        VirtioOptions options;
+        BlkLoad load;
+        load.seconds = seconds;
+        load.type = job.type;
+        load.request_size = 1 << 20;
+        load.inflight = 8;
+        BlkResult r = run_blk(image, options, load);
+        struct stat sb;
+        stat(image.c_str(), &sb);
+        printf("  %-18s: %8.0f req/s %8.0f MB/s, image %3.0f%% allocated\n", job.name, r.requests_per_second,
+            r.requests_per_second * load.request_size / 1e6, 100.0 * sb.st_blocks * 512 / FAKE_IMAGE_SIZE);
+        unlink(image.c_str());
+    }
+}
+
+/*
+4K random reads and writes on the raw image vs a copy-on-write overlay of it.
+The overlay is created empty, so the reads start out going to the base and the
+writes pay for copying whole blocks up
+*/
+void BenchBlkOverlay(const std::string& image, double seconds){
+    printf("virtio-blk copy-on-write overlay, 4K random I/O, 32 in flight\n");
+    std::string overlay = image + ".cow";
+    auto start = std::chrono::steady_clock::now();
+    int created = CowImage::create(overlay, image);
+    assert(created == 0);
+    double create_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    printf("  created overlay of a %llu MB image in %.0fus\n", (unsigned long long)(FAKE_IMAGE_SIZE >> 20), create_us);
+    for (uint32_t type : {VIRTIO_BLK_T_IN, VIRTIO_BLK_T_OUT}) {
+        for (const std::string& path : {image, overlay}) {
+            VirtioOptions options;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.type = type;
+            load.random = true;
+            load.inflight = 32;
+            BlkResult r = run_blk(path, options, load);
+            printf("  %-7s %-5s: %10.0f IOPS latency avg %8.1fus\n", path == image ? "raw" : "overlay",
+                type == VIRTIO_BLK_T_IN ? "read" : "write", r.requests_per_second, r.avg_latency_us);
+        }
+    }
+    struct stat sb;
+    stat(overlay.c_str(), &sb);
+    printf("  overlay takes %.1f MB on disk after the writes\n", sb.st_blocks * 512 / 1e6);
+    unlink(overlay.c_str());
+
+    // Partial writes copy their 64K block up from a base that's different everywhere
+    std::string base = image + ".base";
+    std::vector<uint8_t> want = pattern(1 << 20, 1);
+    int fd = open(base.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    ssize_t written = pwrite(fd, want.data(), want.size(), 0);
+    assert(written == (ssize_t)want.size());
+    close(fd);
+    created = CowImage::create(overlay, base);
+    assert(created == 0);
+    struct { uint64_t offset; uint32_t len; } writes[] = {
+        {3 * 65536 + 1536, 4096},
+        {5 * 65536 - 4096, 8192},
+        {8 * 65536, 65536},
+    };
+    {
+        BlkChecker check(overlay);
+        for (auto& w : writes) {
+            std::vector<uint8_t> data = pattern(w.len, w.offset);
+            check.write(w.offset, data, 3);
+            memcpy(want.data() + w.offset, data.data(), w.len);
+        }
+        check_same("overlay after partial writes", check.read(0, 10 * 65536, 5), std::vector<uint8_t>(want.begin(), want.begin() + 10 * 65536));
+    }
+    BlkChecker reopened(overlay);
+    check_same("overlay reopened", reopened.read(0, 10 * 65536, 5), std::vector<uint8_t>(want.begin(), want.begin() + 10 * 65536));
+    unlink(overlay.c_str());
+
+    // A base given relative to where we are, for an overlay in another directory
+    std::string dir = image + ".dir", nested = dir + "/l2cpu0.cow";
+    int made = mkdir(dir.c_str(), 0755);
+    assert(made == 0);
+    char cwd[PATH_MAX];
+    char* got_cwd = getcwd(cwd, sizeof(cwd));
+    assert(got_cwd);
+    size_t slash = base.rfind('/');
+    int moved = chdir(base.substr(0, slash).c_str());
+    assert(moved == 0);
+    created = CowImage::create(nested, base.substr(slash + 1));
+    moved = chdir(cwd);
+    assert(created == 0 && moved == 0);
+    {
+        BlkChecker nested_check(nested);
+        check_same("overlay of a relative base", nested_check.read(0, 65536, 1), std::vector<uint8_t>(want.begin(), want.begin() + 65536));
+    }
+    unlink(nested.c_str());
+    rmdir(dir.c_str());
+    unlink(base.c_str());
+}
+
+/*
+One image against the same FAKE_IMAGE_SIZE striped over 2 and 4 files in 64K
+chunks, cold cache. 4K reads mostly stay on one member, 256K ones go to all of them at once
+*/
+void BenchBlkStripe(const std::string& image, double seconds){
+    printf("virtio-blk striping, cold page cache, 32 in flight\n");
+    std::vector<std::string> disks = {image};
+    std::vector<std::string> files;
+    for (unsigned members : {2, 4}) {
+        std::string disk;
+        for (unsigned i = 0; i < members; i++) {
+            std::string path = image + ".stripe" + std::to_string(members) + "." + std::to_string(i);
+            int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            assert(fd >= 0);
+            std::vector<uint8_t> chunk(1 << 20, 0x5a);
+            for (uint64_t off = 0; off < FAKE_IMAGE_SIZE / members; off += chunk.size()) {
+                ssize_t written = pwrite(fd, chunk.data(), chunk.size(), off);
+                assert(written == (ssize_t)chunk.size());
+            }
+            close(fd);
+            disk += (i ? "," : "") + path;
+            files.push_back(path);
+        }
+        disks.push_back(disk);
+    }
+    struct { const char* name; uint32_t type; uint32_t request_size; bool random; } jobs[] = {
+        {"randread 4K", VIRTIO_BLK_T_IN, 4096, true},
+        {"read 256K", VIRTIO_BLK_T_IN, 256 * 1024, false},
+        {"write 256K", VIRTIO_BLK_T_OUT, 256 * 1024, false},
+    };
+    for (auto& job : jobs) {
+        for (size_t i = 0; i < disks.size(); i++) {
+            VirtioOptions options;
+            BlkOptions blk;
+            blk.stripe_kb = 64;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.type = job.type;
+            load.request_size = job.request_size;
+            load.random = job.random;
+            load.inflight = 32;
+            load.cold_cache = true;
+            load.report_backend = i == disks.size() - 1 && job.type == VIRTIO_BLK_T_OUT;
+            BlkResult r = run_blk(disks[i], options, load, blk);
+            printf("  %-11s %u file%s: %10.0f IOPS %8.1f MB/s latency avg %8.1fus\n", job.name, i ? 1u << i : 1u, i ? "s" : " ",
+                r.requests_per_second, r.requests_per_second * job.request_size / 1e6, r.avg_latency_us);
+        }
+    }
+    for (const std::string& path : files) {
+        unlink(path.c_str());
+    }
+
+    /*
+    Requests over several 64K chunks of a 3 way stripe, checked against the members
+    themselves: chunk c is on member c % 3, at (c / 3) * 64K
+    */
+    std::vector<std::string> members;
+    std::string disk;
+    for (unsigned i = 0; i < 3; i++) {
+        members.push_back(image + ".check" + std::to_string(i));
+        std::vector<uint8_t> data = pattern(1 << 20, i + 1);
+        int fd = open(members[i].c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        ssize_t written = pwrite(fd, data.data(), data.size(), 0);
+        assert(written == (ssize_t)data.size());
+        close(fd);
+        disk += (i ? "," : "") + members[i];
+    }
+    auto striped = [&](uint64_t offset, uint32_t len){
+        std::vector<uint8_t> data;
+        for (uint64_t pos = offset; pos < offset + len; ) {
+            uint64_t c = pos / 65536, within = pos % 65536;
+            uint32_t n = std::min<uint64_t>(65536 - within, offset + len - pos);
+            std::vector<uint8_t> piece = file_bytes(members[c % 3], c / 3 * 65536 + within, n);
+            data.insert(data.end(), piece.begin(), piece.end());
+            pos += n;
+        }
+        return data;
+    };
+    BlkOptions blk;
+    blk.stripe_kb = 64;
+    {
+        BlkChecker check(disk, blk);
+        check_same("read over 5 stripe chunks", check.read(65536 - 1536, 4 * 65536, 5), striped(65536 - 1536, 4 * 65536));
+        std::vector<uint8_t> data = pattern(150 * 1024, 4);
+        check.write(3 * 65536 - 4096, data, 4);
+        check_same("write over 4 stripe chunks", striped(3 * 65536 - 4096, data.size()), data);
+        check_same("write over 4 stripe chunks read back", check.read(3 * 65536 - 4096, data.size(), 2), data);
+    }
+    for (const std::string& path : members) {
+        unlink(path.c_str());
+    }
+}
+
+/*
+Writes a seekable zstd image of FAKE_IMAGE_SIZE in frame_size frames, and the same
+data raw at raw_path. The data compresses about 2:1, like a rootfs
+*/
+std::string make_zstd_image(const std::string& raw_path, uint32_t frame_size){
+    std::string path = raw_path + ".zst";
+    int raw = open(raw_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(raw >= 0 && fd >= 0);
+    std::vector<uint8_t> frame(frame_size), compressed(ZSTD_compressBound(frame_size));
+    std::vector<uint32_t> table;
+    uint64_t rng = 0x9e3779b97f4a7c15ULL, at = 0;
+    for (uint64_t off = 0; off < FAKE_IMAGE_SIZE; off += frame_size) {
+        for (uint8_t& b : frame) {
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            b = 0x40 | (rng & 0x0f);
+        }
+        ssize_t written = pwrite(raw, frame.data(), frame.size(), off);
+        assert(written == (ssize_t)frame.size());
+        size_t n = ZSTD_compress(compressed.data(), compressed.size(), frame.data(), frame.size(), 3);
+        assert(!ZSTD_isError(n));
+        written = pwrite(fd, compressed.data(), n, at);
+        assert(written == (ssize_t)n);
+        at += n;
+        table.push_back(n);
+        table.push_back(frame_size);
+    }
+    uint32_t num_frames = table.size() / 2;
+    std::vector<uint8_t> seek_table(8 + table.size() * 4 + ZstdImage::FOOTER_SIZE);
+    uint32_t header[2] = {ZstdImage::SKIPPABLE_MAGIC, (uint32_t)(seek_table.size() - 8)};
+    memcpy(seek_table.data(), header, sizeof(header));
+    memcpy(seek_table.data() + 8, table.data(), table.size() * 4);
+    uint8_t* footer = seek_table.data() + seek_table.size() - ZstdImage::FOOTER_SIZE;
+    memcpy(footer, &num_frames, 4);
+    footer[4] = 0;
+    memcpy(footer + 5, &ZstdImage::SEEKABLE_MAGIC, 4);
+    ssize_t written = pwrite(fd, seek_table.data(), seek_table.size(), at);
+    assert(written == (ssize_t)seek_table.size());
+    close(raw);
+    close(fd);
+    return path;
+}
+
+/*
+Reads from a seekable zstd image against the same data raw: sequential 128K reads
+decompressed by 1 worker without readahead vs a pool reading ahead, and 4K random
+reads with the whole image fitting in the frame cache vs 1/8 of it
+*/
+void BenchBlkZstd(double seconds){
+    printf("virtio-blk seekable zstd image, 256K frames\n");
+    char raw[] = "/tmp/tt-bh-bench-XXXXXX";
+    close(mkstemp(raw));
+    std::string zst = make_zstd_image(raw, 256 * 1024);
+    struct stat sb;
+    stat(zst.c_str(), &sb);
+    printf("  %llu MB image compressed to %.1f MB\n", (unsigned long long)(FAKE_IMAGE_SIZE >> 20), sb.st_size / 1e6);
+    {
+        // Reads from the end of one frame into the next, and over a whole frame, against the raw image
+        BlkChecker check(zst);
+        check_same("across a zstd frame boundary", check.read(256 * 1024 - 4096, 12 * 1024, 3), file_bytes(raw, 256 * 1024 - 4096, 12 * 1024));
+        check_same("over three zstd frames", check.read(768 * 1024 - 512, 257 * 1024, 7), file_bytes(raw, 768 * 1024 - 512, 257 * 1024));
+    }
+    struct { const char* name; bool compressed; bool random; unsigned workers; unsigned readahead; uint64_t cache_mb; } jobs[] = {
+        {"raw seq 128K", false, false, 0, 0, 0},
+        {"zstd seq 128K, 1 worker, no readahead", true, false, 1, 0, 256},
+        {"zstd seq 128K, 4 workers, readahead 4", true, false, 4, 4, 256},
+        {"raw random 4K", false, true, 0, 0, 0},
+        {"zstd random 4K, cache 64M", true, true, 4, 0, 64},
+        {"zstd random 4K, cache 8M", true, true, 4, 0, 8},
+    };
+    for (auto& job : jobs) {
+        VirtioOptions options;
+        BlkOptions blk;
+        blk.zstd.workers = job.workers;
+        blk.zstd.readahead = job.readahead;
+        blk.zstd.cache_bytes = job.cache_mb << 20;
+        BlkLoad load;
+        load.seconds = seconds;
+        load.type = VIRTIO_BLK_T_IN;
+        load.random = job.random;
+        load.request_size = job.random ? 4096 : 128 * 1024;
+        load.inflight = 32;
+        load.report_backend = job.compressed;
+        BlkResult r = run_blk(job.compressed ? zst : raw, options, load, blk);
+        printf("  %-38s: %8.0f IOPS %8.0f MB/s latency avg %8.1fus\n", job.name, r.requests_per_second,
+            r.requests_per_second * load.request_size / 1e6, r.avg_latency_us);
+    }
+
+    // Writes land in an overlay, the compressed base is never touched
+    std::string overlay = zst + ".cow";
+    int created = CowImage::create(overlay, zst);
+    assert(created == 0);
+    VirtioOptions options;
+    BlkLoad load;
+    load.seconds = seconds;
+    load.type = VIRTIO_BLK_T_OUT;
+    load.random = true;
+    load.inflight = 32;
+    BlkResult r = run_blk(overlay, options, load);
+    printf("  %-38s: %8.0f IOPS latency avg %8.1fus\n", "overlay on zstd random 4K writes", r.requests_per_second, r.avg_latency_us);
+    unlink(overlay.c_str());
+    unlink(zst.c_str());
+    unlink(raw);
+}
+
+/*
+Parallel 4K random reads spread over 1, 2 and 4 virtqueues (VIRTIO_BLK_F_MQ), each
+with its own worker, like blk-mq mapping one queue per X280 hart.
+Only scales as far as there are cores for the workers
+*/
+void BenchBlkMultiQueue(const std::string& image, double seconds){
+    printf("virtio-blk multi-queue 4K random reads, 32 in flight per queue\n");
+    for (BlkEngine engine : {BlkEngine::MMAP, BlkEngine::IO_URING}) {
+        for (uint16_t num_queues : {1, 2, 4}) {
+            VirtioOptions options;
+            options.queue_workers = true;
+            BlkOptions blk;
+            blk.engine = engine;
+            blk.num_queues = num_queues;
+            BlkLoad load;
+            load.seconds = seconds;
+            load.type = VIRTIO_BLK_T_IN;
+            load.random = true;
+            load.inflight = 32;
+            BlkResult r = run_blk(image, options, load, blk);
+            printf("  %-8s %u queues: %10.0f IOPS latency avg %8.1fus\n", blk_engine_name(engine), num_queues,
+                r.requests_per_second, r.avg_latency_us);
+        }
+    }
+}
+
+/*
+A pair of sockets standing in for slirp, so the bench doesn't need it. With bounce set
+packets are copied through a host buffer on the way, the way they were before
+receive/transmit took iovecs. Without peek it can't tell how long the next packet is,
+like TAP
+*/
+class FakeNetBackend : public NetBackend {
+public:
+    static constexpr size_t PACKET = PACKET_SIZE;
+    // Device ends: packets for the guest come in on rx_fd, guest packets go out on tx_fd
+    int rx_fd, tx_fd;
+    bool bounce = false;
+    bool peek_ = true;
+    uint8_t rx_buffer[PACKET];
+    uint8_t tx_buffer[PACKET];
+
+    FakeNetBackend(int rx_fd_, int tx_fd_) : rx_fd(rx_fd_), tx_fd(tx_fd_) {}
+
+    ~FakeNetBackend(){
+        close(rx_fd);
+        close(tx_fd);
+    }
+
+    ssize_t next_packet() override {
+        if (!peek_) {
+            return PACKET;
+        }
+        return recv(rx_fd, nullptr, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+    }
+
+    size_t max_packet() override {
+        return PACKET;
+    }
+
+    bool peeks() override {
+        return peek_;
+    }
+
+    ssize_t peek(uint8_t* head, size_t len) override {
+        return recv(rx_fd, head, len, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+    }
+
+    ssize_t receive(const struct iovec* iov, int iovcnt) override {
+        ssize_t n;
+        if (bounce) {
+            n = recv(rx_fd, rx_buffer, PACKET, MSG_DONTWAIT);
+            if (n > 0) {
+                rx_copied += VirtioRequest::iov_from_buf(std::vector<struct iovec>(iov, iov + iovcnt), rx_buffer, n);
+            }
+        } else {
+            struct msghdr msg = {};
+            msg.msg_iov = const_cast<struct iovec*>(iov);
+            msg.msg_iovlen = iovcnt;
+            n = recvmsg(rx_fd, &msg, MSG_DONTWAIT);
+        }
+        return n < 0 ? -errno : n;
+    }
+
+    int transmit(const struct iovec* iov, int iovcnt) override {
+        ssize_t ret;
+        if (bounce) {
+            size_t len = VirtioRequest::iov_to_buf(std::vector<struct iovec>(iov, iov + iovcnt), tx_buffer, PACKET);
+            tx_copied += len;
+            ret = send(tx_fd, tx_buffer, len, 0);
+        } else {
+            ret = writev(tx_fd, iov, iovcnt);
+        }
+        return ret < 0 ? -errno : 0;
+    }
+
+    int fd() override {
+        return rx_fd;
+    }
+};
+
+/*
+A backend for run_net and the host's side of it: the feeder writes packets for the
+guest to rx_fd, the sink reads the guest's packets from tx_fd (can be the same fd)
+*/
+struct NetPeer {
+    std::shared_ptr<NetBackend> backend;
+    int rx_fd = -1, tx_fd = -1;
+};
+
+NetPeer fake_net_peer(bool bounce, bool peek){
+    int rx_pair[2], tx_pair[2];
+    int r = socketpair(AF_UNIX, SOCK_DGRAM, 0, rx_pair);
+    assert(r == 0);
+    r = socketpair(AF_UNIX, SOCK_DGRAM, 0, tx_pair);
+    assert(r == 0);
+    auto backend = std::make_shared<FakeNetBackend>(rx_pair[1], tx_pair[1]);
+    backend->bounce = bounce;
+    backend->peek_ = peek;
+    return NetPeer{backend, rx_pair[0], tx_pair[0]};
+}
+
+using BenchNet = Bench<VirtioNet>;
+
+
+/*
+Guest side load for run_net
+*/
+struct NetLoad {
+    // rx buffers and tx packets the guest keeps posted
+    uint16_t inflight = 128;
+    // Size of each rx buffer, header included
+    uint32_t rx_buffer_size = sizeof(struct virtio_net_hdr_mrg_rxbuf) + PACKET_SIZE;
+    // Send packets as well as receive them
+    bool tx = true;
+    bool rx = true;
+    uint64_t driver_features = 0;
+    double seconds = 1.0;
+    // Copy packets through a host buffer (FakeNetBackend::bounce)
+    bool bounce = false;
+    // Packets for the guest are one TCP stream's segments rather than zeros
+    bool tcp = false;
+    // tx frames of this size, TSO frames of tso_mss sized segments if that's set
+    uint32_t tx_frame = PACKET_SIZE;
+    uint16_t tso_mss = 0;
+};
+
+// An ethernet/IPv4/TCP frame of len bytes on the stream 10.0.2.2:80 -> 10.0.2.15:port at sequence number seq
+void make_tcp_frame(uint8_t* p, size_t len, uint32_t seq, uint16_t port = 5000){
+    memset(p, 0, 54);
+    p[12] = 0x08;
+    uint8_t* ip = p + 14;
+    ip[0] = 0x45;
+    ip[6] = 0x40;
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    inet_pton(AF_INET, "10.0.2.2", ip + 12);
+    inet_pton(AF_INET, "10.0.2.15", ip + 16);
+    FrameHeaders h;
+    h.l3 = 14;
+    h.l4 = h.end = 34;
+    h.set_ip_length(p, len - 34);
+    uint8_t* tcp = p + 34;
+    uint16_t ports[2] = {htons(80), htons(port)};
+    memcpy(tcp, ports, 4);
+    uint32_t s = htonl(seq), ack = htonl(1);
+    memcpy(tcp + 4, &s, 4);
+    memcpy(tcp + 8, &ack, 4);
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x10;
+    tcp[14] = tcp[15] = 0xff;
+}
+
+struct NetResult {
+    double rx_packets_per_second;
+    double tx_packets_per_second;
+    double rx_bytes_per_second;
+    double tx_bytes_per_second;
+    double rx_packets_per_interrupt;
+    // TCP segments from the backend per packet the guest got (GRO)
+    double rx_segments_per_packet;
+    // Bytes copied through host buffers per byte moved, both ways
+    double copies_per_byte;
+    // Device thread CPU time / wall time
+    double cpu;
+};
+
+/*
+Traffic through a backend: a feeder thread (the iperf sender) keeps it full of 1514
+byte packets for the guest, a sink thread drains what the device sends, and the guest
+keeps load.inflight rx buffers (and tx packets) posted on the two queues
+*/
+NetResult run_net(const VirtioOptions& options, const NetLoad& load, NetPeer peer){
+    using clock = std::chrono::steady_clock;
+    FakeL2CPU l2cpu;
+    std::atomic<bool> exit_flag{false}, traffic_done{false};
+    InterruptDispatcher interrupts(&l2cpu.interrupt_register);
+    BenchNet device(l2cpu.transport(), exit_flag, interrupts, 32, peer.backend);
+    device.options = options;
+
+    std::unique_ptr<FakeQueue> rxq = make_queue(l2cpu, load.driver_features, 0);
+    std::unique_ptr<FakeQueue> txq = make_queue(l2cpu, load.driver_features, FAKE_MEMORY_SIZE / 2);
+    device.attach({rxq.get(), txq.get()}, load.driver_features);
+
+    size_t slot_size = 2048;
+    size_t header = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    size_t tx_slot_size = std::max<size_t>(slot_size, (header + load.tx_frame + 4095) & ~4095);
+    auto post_rx = [&](uint16_t slot){
+        FakeSeg seg = {rxq->buffer_offset + slot * slot_size, load.rx_buffer_size, true};
+        rxq->add(slot, &seg, 1);
+    };
+    auto post_tx = [&](uint16_t slot){
+        FakeSeg seg = {txq->buffer_offset + slot * tx_slot_size, (uint32_t)(header + load.tx_frame), false};
+        txq->add(slot, &seg, 1);
+    };
+    // The guest's tx frames, TCP with their checksum left to the device if it's doing TSO
+    for (uint16_t slot = 0; load.tso_mss && slot < load.inflight; slot++) {
+        uint8_t* p = l2cpu.memory + txq->buffer_offset + slot * tx_slot_size;
+        struct virtio_net_hdr_mrg_rxbuf hdr = {};
+        hdr.hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr.hdr.hdr_len = 54;
+        hdr.hdr.gso_size = load.tso_mss;
+        hdr.hdr.csum_start = 34;
+        hdr.hdr.csum_offset = 16;
+        memcpy(p, &hdr, sizeof(hdr));
+        make_tcp_frame(p + header, load.tx_frame, 0);
+    }
+
+    // Both poll with a timeout so they notice traffic_done, whatever kind of fd they have
+    std::thread feeder([&]{
+        uint8_t packet[FakeNetBackend::PACKET] = {};
+        struct pollfd pfd = {peer.rx_fd, POLLOUT, 0};
+        uint32_t seq = 0;
+        while (!traffic_done && load.rx) {
+            if (load.tcp) {
+                make_tcp_frame(packet, sizeof(packet), seq);
+            }
+            if (poll(&pfd, 1, 10) > 0 && write(peer.rx_fd, packet, sizeof(packet)) > 0) {
+                seq += sizeof(packet) - 54;
+            }
+        }
+    });
+    std::thread sink([&]{
+        std::vector<uint8_t> packet(SoftOffload::MAX_FRAME);
+        struct pollfd pfd = {peer.tx_fd, POLLIN, 0};
+        while (!traffic_done) {
+            if (poll(&pfd, 1, 10) > 0) {
+                ssize_t r = read(peer.tx_fd, packet.data(), packet.size());
+                (void)r;
+            }
+        }
+    });
+    std::thread interrupt_thread([&]{ interrupts.run(exit_flag, options.poll); });
+    std::thread device_thread([&]{ device.device_loop(); });
+
+    for (uint16_t slot = 0; slot < load.inflight; slot++) {
+        post_rx(slot);
+        if (load.tx) {
+            post_tx(slot);
+        }
+    }
+    uint64_t sent = 0;
+    auto start = clock::now();
+    auto end = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(load.seconds));
+    while (clock::now() < end) {
+        int slot;
+        bool reaped = false;
+        while ((slot = rxq->pop_used()) >= 0) {
+            post_rx(slot);
+            reaped = true;
+        }
+        while ((slot = txq->pop_used()) >= 0) {
+            sent++;
+            post_tx(slot);
+            reaped = true;
+        }
+        if (!reaped) {
+            std::this_thread::yield();
+        }
+    }
+    double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    exit_flag = true;
+    device_thread.join();
+    interrupt_thread.join();
+    traffic_done = true;
+    feeder.join();
+    sink.join();
+    close(peer.rx_fd);
+    if (peer.tx_fd != peer.rx_fd) {
+        close(peer.tx_fd);
+    }
+    uint64_t rx_interrupts = device.stats.interrupts_raised;
+    VirtioNet::RxStats rx = device.rx_totals();
+    VirtioNet::TxStats tx = device.tx_totals();
+    uint64_t moved = rx.bytes + tx.bytes;
+    PollStats poll = device.poller.get_stats();
+    return NetResult{rx.packets / elapsed, sent / elapsed, rx.bytes / elapsed,
+        tx.bytes / elapsed, rx_interrupts ? (double)rx.packets / rx_interrupts : 0.0,
+        rx.packets ? (double)(rx.packets + rx.coalesced) / rx.packets : 0.0,
+        moved ? (double)(peer.backend->rx_copied + peer.backend->tx_copied) / moved : 0.0,
+        poll.wall_ns ? (double)poll.cpu_ns / poll.wall_ns : 0.0};
+}
+
+NetResult run_net(const VirtioOptions& options, const NetLoad& load){
+    return run_net(options, load, fake_net_peer(load.bounce, true));
+}
+
+/*
+Bidirectional network traffic with both queues on one device thread against a
+worker per queue. Only shows a difference with a spare core per worker
+*/
+void BenchNetWorkers(double seconds){
+    printf("virtio-net full duplex 1514 byte packets, 128 in flight each way\n");
+    for (bool workers : {false, true}) {
+        VirtioOptions options;
+        options.queue_workers = workers;
+        NetLoad load;
+        load.seconds = seconds;
+        NetResult r = run_net(options, load);
+        printf("  %-17s rx %10.0f pkt/s tx %10.0f pkt/s total %10.0f pkt/s\n", workers ? "per queue workers" : "one thread",
+            r.rx_packets_per_second, r.tx_packets_per_second, r.rx_packets_per_second + r.tx_packets_per_second);
+    }
+}
+
+/*
+iperf style download into the guest: a packet per poll pass against draining everything
+waiting in one go, and full size rx buffers against 512 byte mergeable ones (3 per packet)
+*/
+void BenchNetRx(double seconds){
+    printf("virtio-net rx only, 1514 byte packets, 128 rx buffers posted\n");
+    struct { const char* name; uint16_t budget; uint32_t buffer; uint64_t features; } modes[] = {
+        {"1 per pass", 1, sizeof(struct virtio_net_hdr_mrg_rxbuf) + PACKET_SIZE, 0},
+        {"drained", 256, sizeof(struct virtio_net_hdr_mrg_rxbuf) + PACKET_SIZE, 0},
+        {"drained mergeable", 256, 512, 1ULL << VIRTIO_NET_F_MRG_RXBUF},
+    };
+    for (auto& mode : modes) {
+        VirtioOptions options;
+        options.batch_budget = mode.budget;
+        NetLoad load;
+        load.seconds = seconds;
+        load.tx = false;
+        load.inflight = 128;
+        load.rx_buffer_size = mode.buffer;
+        load.driver_features = mode.features;
+        NetResult r = run_net(options, load);
+        printf("  %-18s: %10.0f pkt/s %6.2f Gbit/s %6.1f packets per interrupt\n", mode.name, r.rx_packets_per_second,
+            r.rx_bytes_per_second * 8 / 1e9, r.rx_packets_per_interrupt);
+    }
+}
+
+/*
+Packets copied through a host buffer against going straight between the socket
+and guest memory, full duplex. CPU is the device thread's, per Gbit moved both ways
+*/
+void BenchNetZeroCopy(double seconds){
+    printf("virtio-net bounce buffer vs zero copy, full duplex 1514 byte packets, 128 in flight each way\n");
+    for (bool bounce : {true, false}) {
+        VirtioOptions options;
+        NetLoad load;
+        load.seconds = seconds;
+        load.bounce = bounce;
+        NetResult r = run_net(options, load);
+        double gbits = (r.rx_bytes_per_second + r.tx_bytes_per_second) * 8 / 1e9;
+        printf("  %-9s: rx %10.0f pkt/s tx %10.0f pkt/s %6.2f Gbit/s, %.2f copies per byte, %5.1f%% cpu, %5.1f%% cpu per Gbit/s\n",
+            bounce ? "bounce" : "zero copy", r.rx_packets_per_second, r.tx_packets_per_second, gbits, r.copies_per_byte,
+            100 * r.cpu, gbits ? 100 * r.cpu / gbits : 0.0);
+    }
+}
+
+/*
+Run f on a thread of its own in a new network namespace, so interfaces it makes never
+show up on the host and go away once the last fd on them is closed. False if we're
+not allowed to (needs CAP_SYS_ADMIN)
+*/
+bool in_net_namespace(const std::function<void()>& f){
+    bool ok = false;
+    std::thread thread([&]{
+        if (unshare(CLONE_NEWNET) == 0) {
+            ok = true;
+            f();
+        }
+    });
+    thread.join();
+    return ok;
+}
+
+// ip link set <ifname> up, from inside its namespace
+bool link_up(const std::string& ifname){
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname.c_str(), IFNAMSIZ - 1);
+    bool ok = sock >= 0 && ioctl(sock, SIOCGIFFLAGS, &ifr) == 0;
+    ifr.ifr_flags |= IFF_UP;
+    ok = ok && ioctl(sock, SIOCSIFFLAGS, &ifr) == 0;
+    if (sock >= 0) {
+        close(sock);
+    }
+    return ok;
+}
+
+/*
+--net tap: the device on TAP device ttbench0, with the host end an AF_PACKET socket on
+the interface, so packets really go through the kernel both ways
+*/
+NetPeer tap_net_peer(){
+    NetPeer peer;
+    in_net_namespace([&]{
+        std::shared_ptr<NetBackend> tap = TapBackend::open_device("ttbench0");
+        if (!tap || !link_up("ttbench0")) {
+            return;
+        }
+        int sock = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+        struct sockaddr_ll addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sll_family = AF_PACKET;
+        addr.sll_protocol = htons(ETH_P_ALL);
+        addr.sll_ifindex = if_nametoindex("ttbench0");
+        int one = 1;
+        if (sock < 0 || setsockopt(sock, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) != 0
+            || bind(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+            if (sock >= 0) {
+                close(sock);
+            }
+            return;
+        }
+        peer = NetPeer{tap, sock, sock};
+    });
+    return peer;
+}
+
+/*
+--net packet: the device's AF_PACKET ring on TAP device ttbench0, with the host end the
+TAP fd standing in for the wire
+*/
+NetPeer packet_net_peer(){
+    NetPeer peer;
+    in_net_namespace([&]{
+        int tap_fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+        strncpy(ifr.ifr_name, "ttbench0", IFNAMSIZ - 1);
+        if (tap_fd < 0 || ioctl(tap_fd, TUNSETIFF, &ifr) != 0 || !link_up("ttbench0")) {
+            if (tap_fd >= 0) {
+                close(tap_fd);
+            }
+            return;
+        }
+        std::shared_ptr<NetBackend> packet = PacketBackend::open_device("ttbench0");
+        if (!packet) {
+            close(tap_fd);
+            return;
+        }
+        peer = NetPeer{packet, tap_fd, tap_fd};
+    });
+    return peer;
+}
+
+/*
+Full duplex through each backend: the fake socketpair one peeking at packet lengths
+(like slirp) or not (like TAP, rx buffers for the longest packet get taken and the
+spares kept for the next), then a real TAP device and an AF_PACKET ring on one, in a
+network namespace
+*/
+void BenchNetBackends(double seconds){
+    printf("virtio-net backends, full duplex 1514 byte packets, 128 in flight each way, 512 byte mergeable rx buffers\n");
+    struct { const char* name; std::function<NetPeer()> open; } backends[] = {
+        {"socket, peek", []{ return fake_net_peer(false, true); }},
+        {"socket, no peek", []{ return fake_net_peer(false, false); }},
+        {"tap", tap_net_peer},
+        {"af_packet ring", packet_net_peer},
+    };
+    for (auto& backend : backends) {
+        NetPeer peer = backend.open();
+        if (!peer.backend) {
+            printf("  %-15s: skipped, no network namespace or TAP device\n", backend.name);
+            continue;
+        }
+        VirtioOptions options;
+        NetLoad load;
+        load.seconds = seconds;
+        load.rx_buffer_size = 512;
+        load.driver_features = 1ULL << VIRTIO_NET_F_MRG_RXBUF;
+        NetResult r = run_net(options, load, peer);
+        printf("  %-15s: rx %10.0f pkt/s tx %10.0f pkt/s %6.1f packets per interrupt, %.2f copies per byte, %5.1f%% cpu\n",
+            backend.name, r.rx_packets_per_second, r.tx_packets_per_second, r.rx_packets_per_interrupt, r.copies_per_byte,
+            100 * r.cpu);
+    }
+}
+
+/*
+Checks for what the offloads build: frames decoded field by field, the way the guest
+or the other end would see them, rather than just counted
+*/
+
+// Ones' complement sum done the plain way, 16 bits big endian at a time, to check Checksum against
+uint16_t reference_sum(const uint8_t* p, size_t n, uint32_t sum = 0){
+    for (size_t i = 0; i + 1 < n; i += 2) {
+        sum += p[i] << 8 | p[i + 1];
+    }
+    if (n & 1) {
+        sum += p[n - 1] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+// Check the lengths and both checksums of an IPv4 TCP frame with no options, returns its payload length
+size_t check_tcp_frame(const char* what, const uint8_t* p, size_t len){
+    check_field(what, len >= 54, "frame length", len, 54);
+    const uint8_t* ip = p + 14;
+    size_t ip_len = ip[2] << 8 | ip[3];
+    check_field(what, ip_len + 14 == len, "IP total length", ip_len, len - 14);
+    uint16_t ip_sum = reference_sum(ip, 20);
+    check_field(what, ip_sum == 0xffff, "IP header sum", ip_sum, 0xffff);
+    uint32_t pseudo = (ip[12] << 8 | ip[13]) + (ip[14] << 8 | ip[15]) + (ip[16] << 8 | ip[17]) + (ip[18] << 8 | ip[19])
+        + ip[9] + (ip_len - 20);
+    uint16_t tcp_sum = reference_sum(ip + 20, ip_len - 20, pseudo);
+    check_field(what, tcp_sum == 0xffff, "TCP sum", tcp_sum, 0xffff);
+    return len - 54;
+}
+
+// Checksum against the plain sum, for data handed over in pieces split at odd places
+void CheckChecksum(){
+    std::vector<uint8_t> data = pattern(9001, 1);
+    // All ones bytes make the most carries
+    std::vector<uint8_t> ones(4097, 0xff);
+    for (const std::vector<uint8_t>* d : {&data, &ones}) {
+        for (size_t len : {1, 2, 3, 15, 16, 17, 33, 1500, 4097, 9001}) {
+            len = std::min(len, d->size());
+            uint16_t want = htons(reference_sum(d->data(), len));
+            for (size_t a : {0, 1, 3, 7, 16, 17, 999}) {
+                for (size_t b : {0, 1, 2, 5, 31, 1001}) {
+                    size_t first = std::min(a, len), second = std::min(first + b, len);
+                    Checksum c;
+                    c.add(d->data(), first);
+                    c.add(d->data() + first, second - first);
+                    c.add(d->data() + second, len - second);
+                    check_field("checksum in three pieces", c.partial() == want, "sum", c.partial(), want);
+                }
+            }
+        }
+    }
+    printf("  data check checksum in pieces split at odd offsets: ok\n");
+}
+
+/*
+A TSO frame through SoftOffload the way the guest leaves it: checksum field holding the
+pseudo header sum, ACK|PSH|FIN|CWR set, headers and payload in separate descriptors.
+Each segment should come out a frame of its own
+*/
+void CheckTsoSegments(){
+    const char* what = "TSO segments";
+    NetPeer peer = fake_net_peer(false, true);
+    SoftOffload offload;
+    size_t mss = 1448, payload = 5000;
+    std::vector<uint8_t> frame(54 + payload);
+    make_tcp_frame(frame.data(), frame.size(), 1000);
+    frame[14 + 4] = 0x12;
+    frame[14 + 5] = 0x34;
+    frame[34 + 13] = 0x80 | 0x10 | 0x08 | 0x01;
+    std::vector<uint8_t> data = pattern(payload, 2);
+    memcpy(frame.data() + 54, data.data(), payload);
+    FrameHeaders h;
+    bool parsed = h.parse(frame.data(), frame.size());
+    assert(parsed);
+    Checksum c;
+    h.pseudo_header(c, frame.data(), frame.size() - 34);
+    uint16_t partial = c.partial();
+    memcpy(frame.data() + 50, &partial, 2);
+
+    struct virtio_net_hdr hdr = {};
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    hdr.gso_size = mss;
+    hdr.hdr_len = 54;
+    hdr.csum_start = 34;
+    hdr.csum_offset = 16;
+    std::vector<struct iovec> iov = {{frame.data(), 100}, {frame.data() + 100, frame.size() - 100}};
+    int r = offload.transmit(*peer.backend, hdr, iov);
+    assert(r == 0);
+
+    size_t segments = (payload + mss - 1) / mss, off = 0;
+    check_field(what, offload.stats.segments == segments, "segment count", offload.stats.segments, segments);
+    std::vector<uint8_t> got;
+    for (size_t i = 0; i < segments; i++) {
+        uint8_t buf[2048];
+        ssize_t n = recv(peer.tx_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        assert(n > 0);
+        size_t len = check_tcp_frame(what, buf, n);
+        bool last = i == segments - 1;
+        check_field(what, len == std::min(mss, payload - off), "payload length", len, std::min(mss, payload - off));
+        size_t id = buf[18] << 8 | buf[19];
+        check_field(what, id == 0x1234 + i, "IP id", id, 0x1234 + i);
+        size_t seq = (uint32_t)(buf[38] << 24 | buf[39] << 16 | buf[40] << 8 | buf[41]);
+        check_field(what, seq == 1000 + off, "sequence number", seq, 1000 + off);
+        size_t flags = buf[47], want = 0x10 | (i == 0 ? 0x80 : 0) | (last ? 0x09 : 0);
+        check_field(what, flags == want, "TCP flags", flags, want);
+        check_field(what, memcmp(buf, frame.data(), 14) == 0 && memcmp(buf + 34, frame.data() + 34, 4) == 0, "headers", 0, 1);
+        got.insert(got.end(), buf + 54, buf + n);
+        off += len;
+    }
+    char extra;
+    check_field(what, recv(peer.tx_fd, &extra, 1, MSG_DONTWAIT) < 0, "frames sent", segments + 1, segments);
+    close(peer.rx_fd);
+    close(peer.tx_fd);
+    printf("  data check %s: ok\n", what);
+    check_same("TSO segment payloads", got, data);
+}
+
+/*
+TCP segments for the guest through GRO: two flows of 1514 byte frames, ended by a short
+segment or a push. Every packet the guest gets is decoded, coalesced ones checked for
+what it needs to take them as GSO (lengths, gso fields, the pseudo header sum left in the
+checksum field), then cut up again with SoftOffload, which should give back exactly the
+frames that went in
+*/
+void CheckGroPackets(){
+    const char* what = "GRO packets";
+    FakeL2CPU l2cpu;
+    std::atomic<bool> exit_flag{false};
+    InterruptDispatcher interrupts(&l2cpu.interrupt_register);
+    NetPeer peer = fake_net_peer(false, true);
+    BenchNet device(l2cpu.transport(), exit_flag, interrupts, 32, peer.backend);
+    uint64_t features = 1ULL << VIRTIO_NET_F_MRG_RXBUF | 1ULL << VIRTIO_NET_F_GUEST_CSUM | 1ULL << VIRTIO_NET_F_GUEST_TSO4;
+    std::unique_ptr<FakeQueue> rxq = make_queue(l2cpu, features, 0);
+    std::unique_ptr<FakeQueue> txq = make_queue(l2cpu, features, FAKE_MEMORY_SIZE / 2);
+    device.attach({rxq.get(), txq.get()}, features);
+    size_t slot_size = 2048, buffer_size = sizeof(struct virtio_net_hdr_mrg_rxbuf) + PACKET_SIZE;
+    for (uint16_t slot = 0; slot < 100; slot++) {
+        FakeSeg seg = {rxq->buffer_offset + slot * slot_size, (uint32_t)buffer_size, true};
+        rxq->add(slot, &seg, 1);
+    }
+
+    // Frame sizes, the second flow (another port, its own sequence numbers) starting at the 7th
+    size_t sizes[] = {1514, 1514, 1514, 1514, 1514, 800, 1514, 1514, 200, 1514};
+    std::vector<std::vector<uint8_t>> sent;
+    std::vector<uint8_t> want;
+    uint32_t seq = 5000;
+    for (size_t k = 0; k < 10; k++) {
+        bool second = k >= 6;
+        if (k == 6) {
+            seq = 1;
+        }
+        std::vector<uint8_t> p(sizes[k]);
+        make_tcp_frame(p.data(), p.size(), seq, second ? 5001 : 5000);
+        p[14 + 5] = second ? k - 6 : k;
+        p[34 + 13] |= k == 8 ? 0x08 : 0;
+        std::vector<uint8_t> data = pattern(p.size() - 54, 10 + k);
+        memcpy(p.data() + 54, data.data(), data.size());
+        FrameHeaders h;
+        h.parse(p.data(), p.size());
+        h.set_ip_length(p.data(), p.size() - 34);
+        Checksum c;
+        h.pseudo_header(c, p.data(), p.size() - 34);
+        memset(p.data() + 50, 0, 2);
+        c.add(p.data() + 34, p.size() - 34);
+        uint16_t check = c.finish();
+        memcpy(p.data() + 50, &check, 2);
+        check_tcp_frame("GRO test frame", p.data(), p.size());
+        ssize_t n = write(peer.rx_fd, p.data(), p.size());
+        assert(n == (ssize_t)p.size());
+        want.insert(want.end(), p.begin(), p.end());
+        sent.push_back(std::move(p));
+        seq += sizes[k] - 54;
+    }
+
+    std::thread device_thread([&]{ device.device_loop(); });
+    NetPeer out = fake_net_peer(false, true);
+    SoftOffload offload;
+    std::vector<uint8_t> packet, got;
+    struct virtio_net_hdr_mrg_rxbuf hdr = {};
+    size_t buffers_left = 0, frames = 0, coalesced = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (frames < sent.size() && std::chrono::steady_clock::now() < deadline) {
+        int slot = rxq->pop_used();
+        if (slot < 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        uint8_t* b = l2cpu.memory + rxq->buffer_offset + slot * slot_size;
+        if (buffers_left == 0) {
+            memcpy(&hdr, b, sizeof(hdr));
+            buffers_left = hdr.num_buffers;
+            packet.assign(b + sizeof(hdr), b + rxq->last_len);
+        } else {
+            packet.insert(packet.end(), b, b + rxq->last_len);
+        }
+        if (--buffers_left) {
+            continue;
+        }
+        size_t gso_type = hdr.hdr.gso_type;
+        if (gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+            coalesced++;
+            const uint8_t* ip = packet.data() + 14;
+            size_t ip_len = ip[2] << 8 | ip[3];
+            check_field(what, gso_type == VIRTIO_NET_HDR_GSO_TCPV4, "gso_type", gso_type, VIRTIO_NET_HDR_GSO_TCPV4);
+            check_field(what, hdr.hdr.flags == VIRTIO_NET_HDR_F_NEEDS_CSUM, "flags", hdr.hdr.flags, VIRTIO_NET_HDR_F_NEEDS_CSUM);
+            check_field(what, hdr.hdr.gso_size == 1460, "gso_size", hdr.hdr.gso_size, 1460);
+            check_field(what, hdr.hdr.hdr_len == 54, "hdr_len", hdr.hdr.hdr_len, 54);
+            check_field(what, hdr.hdr.csum_start == 34, "csum_start", hdr.hdr.csum_start, 34);
+            check_field(what, hdr.hdr.csum_offset == 16, "csum_offset", hdr.hdr.csum_offset, 16);
+            check_field(what, ip_len + 14 == packet.size(), "IP total length", ip_len, packet.size() - 14);
+            uint16_t ip_sum = reference_sum(ip, 20);
+            check_field(what, ip_sum == 0xffff, "IP header sum", ip_sum, 0xffff);
+            uint32_t pseudo = (ip[12] << 8 | ip[13]) + (ip[14] << 8 | ip[15]) + (ip[16] << 8 | ip[17]) + (ip[18] << 8 | ip[19])
+                + ip[9] + (ip_len - 20);
+            size_t partial = packet[50] << 8 | packet[51], want = reference_sum(nullptr, 0, pseudo);
+            check_field(what, partial == want, "partial checksum", partial, want);
+            std::vector<struct iovec> iov = {{packet.data(), packet.size()}};
+            int r = offload.transmit(*out.backend, hdr.hdr, iov);
+            assert(r == 0);
+        } else {
+            check_field(what, frames < sent.size(), "frames", frames + 1, sent.size());
+            check_field(what, packet.size() == sent[frames].size(), "frame length", packet.size(), sent[frames].size());
+            got.insert(got.end(), packet.begin(), packet.end());
+            frames++;
+        }
+        uint8_t buf[2048];
+        ssize_t n;
+        while ((n = recv(out.tx_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            check_field(what, frames < sent.size(), "frames", frames + 1, sent.size());
+            check_tcp_frame(what, buf, n);
+            check_field(what, (size_t)n == sent[frames].size(), "frame length", n, sent[frames].size());
+            got.insert(got.end(), buf, buf + n);
+            frames++;
+        }
+    }
+    exit_flag = true;
+    device_thread.join();
+    close(peer.rx_fd);
+    close(peer.tx_fd);
+    close(out.rx_fd);
+    close(out.tx_fd);
+    check_field(what, frames == sent.size(), "frames", frames, sent.size());
+    check_field(what, coalesced == device.rx[0].stats.gro_packets && coalesced >= 2, "coalesced packets", coalesced,
+        device.rx[0].stats.gro_packets);
+    printf("  data check %s: ok\n", what);
+    check_same("GRO packets cut up again", got, want);
+}
+
+/*
+What the offloads save the X280s: tx as 1514 byte frames against 64K TSO frames that
+get segmented and checksummed here (or taken whole by a TAP device, whose namespace
+then drops them unrouted, so that's just the handover), and a TCP download
+handed over segment by segment against GRO'd into 64K frames. What matters is the
+guest's packets per second for the same Gbit/s, each one costs it a trip through its
+stack
+*/
+void BenchNetOffload(double seconds){
+    printf("virtio-net checksum/TSO/GRO offloads, 128 frames in flight\n");
+    CheckChecksum();
+    CheckTsoSegments();
+    CheckGroPackets();
+    uint64_t mrg = 1ULL << VIRTIO_NET_F_MRG_RXBUF;
+    uint64_t tso = 1ULL << VIRTIO_NET_F_CSUM | 1ULL << VIRTIO_NET_F_HOST_TSO4;
+    uint64_t gro = 1ULL << VIRTIO_NET_F_GUEST_CSUM | 1ULL << VIRTIO_NET_F_GUEST_TSO4;
+    uint32_t tso_frame = 54 + 44 * 1460;
+    struct { const char* name; std::function<NetPeer()> open; bool tx; uint32_t frame; uint16_t mss; uint64_t features; } modes[] = {
+        {"tx 1514 byte frames", []{ return fake_net_peer(false, true); }, true, PACKET_SIZE, 0, mrg},
+        {"tx TSO, segmented here", []{ return fake_net_peer(false, true); }, true, tso_frame, 1460, mrg | tso},
+        {"tx TSO, into tap", tap_net_peer, true, tso_frame, 1460, mrg | tso},
+        {"rx 1514 byte segments", []{ return fake_net_peer(false, true); }, false, PACKET_SIZE, 0, mrg},
+        {"rx GRO", []{ return fake_net_peer(false, true); }, false, PACKET_SIZE, 0, mrg | gro},
+    };
+    for (auto& mode : modes) {
+        NetPeer peer = mode.open();
+        if (!peer.backend) {
+            printf("  %-23s: skipped, no network namespace or TAP device\n", mode.name);
+            continue;
+        }
+        VirtioOptions options;
+        NetLoad load;
+        load.seconds = seconds;
+        load.tx = mode.tx;
+        load.rx = !mode.tx;
+        load.tcp = true;
+        load.tx_frame = mode.frame;
+        load.tso_mss = mode.mss;
+        load.driver_features = mode.features;
+        NetResult r = run_net(options, load, peer);
+        double packets = mode.tx ? r.tx_packets_per_second : r.rx_packets_per_second;
+        double bytes = mode.tx ? r.tx_bytes_per_second : r.rx_bytes_per_second;
+        printf("  %-23s: %8.0f guest pkt/s %6.2f Gbit/s", mode.name, packets, bytes * 8 / 1e9);
+        if (!mode.tx) {
+            printf(" %5.1f segments per packet", r.rx_segments_per_packet);
+        }
+        printf(" %5.1f%% cpu\n", 100 * r.cpu);
+    }
+}
+
+struct NetMqResult {
+    double rx_packets_per_second;
+    double rx_bytes_per_second;
+    // Packets each rx queue handed the guest
+    std::vector<uint64_t> per_queue;
+    // Packets dropped because a queue's backlog was full
+    uint64_t dropped;
+};
+
+/*
+Several TCP downloads at once (iperf -P) into a device with pairs queue pairs: the
+feeder sends each stream's segments in turn, each to a port of its own, the guest
+turns the pairs on over the control queue like Linux does at probe
+(VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) and keeps 128 rx buffers posted on every rx queue
+*/
+NetMqResult run_net_mq(const VirtioOptions& options, uint16_t pairs, uint16_t streams, double seconds){
+    using clock = std::chrono::steady_clock;
+    FakeL2CPU l2cpu;
+    std::atomic<bool> exit_flag{false}, traffic_done{false};
+    InterruptDispatcher interrupts(&l2cpu.interrupt_register);
+    NetPeer peer = fake_net_peer(false, true);
+    BenchNet device(l2cpu.transport(), exit_flag, interrupts, 32, peer.backend, pairs);
+    device.options = options;
+
+    uint64_t features = 1ULL << VIRTIO_NET_F_MRG_RXBUF;
+    if (pairs > 1) {
+        features |= 1ULL << VIRTIO_NET_F_CTRL_VQ | 1ULL << VIRTIO_NET_F_MQ;
+    }
+    // rx0 tx0 rx1 tx1 ... ctrl, splitting the fake DRAM between them
+    uint32_t num_queues = 2 * pairs + (pairs > 1);
+    std::vector<std::unique_ptr<FakeQueue>> queues;
+    std::vector<FakeQueue*> attached;
+    for (uint32_t i = 0; i < num_queues; i++) {
+        queues.push_back(make_queue(l2cpu, features, FAKE_MEMORY_SIZE / num_queues * i));
+        attached.push_back(queues.back().get());
+    }
+    device.attach(attached, features);
+
+    size_t slot_size = 2048;
+    uint16_t inflight = 128;
+    auto post_rx = [&](FakeQueue* q, uint16_t slot){
+        FakeSeg seg = {q->buffer_offset + slot * slot_size, (uint32_t)slot_size, true};
+        q->add(slot, &seg, 1);
+    };
+
+    std::thread interrupt_thread([&]{ interrupts.run(exit_flag, options.poll); });
+    std::thread device_thread([&]{ device.device_loop(); });
+
+    if (pairs > 1) {
+        FakeQueue* ctrl = queues.back().get();
+        uint8_t* cmd = l2cpu.memory + ctrl->buffer_offset;
+        cmd[0] = VIRTIO_NET_CTRL_MQ;
+        cmd[1] = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+        memcpy(cmd + 2, &pairs, sizeof(pairs));
+        cmd[64] = VIRTIO_NET_ERR;
+        FakeSeg segs[2] = {{ctrl->buffer_offset, 4, false}, {ctrl->buffer_offset + 64, 1, true}};
+        ctrl->add(0, segs, 2);
+        while (ctrl->pop_used() < 0) {
+            std::this_thread::yield();
+        }
+        assert(cmd[64] == VIRTIO_NET_OK);
+    }
+    for (uint16_t pair = 0; pair < pairs; pair++) {
+        for (uint16_t slot = 0; slot < inflight; slot++) {
+            post_rx(queues[2 * pair].get(), slot);
+        }
+    }
+
+    std::thread feeder([&]{
+        uint8_t packet[FakeNetBackend::PACKET];
+        std::vector<uint32_t> seq(streams, 0);
+        // Scattered over the ephemeral range like the guest's connections' would be
+        std::vector<uint16_t> ports(streams);
+        for (uint16_t stream = 0; stream < streams; stream++) {
+            ports[stream] = 32768 + ((stream + 1) * 2654435761u >> 16) % 28232;
+        }
+        struct pollfd pfd = {peer.rx_fd, POLLOUT, 0};
+        for (uint16_t stream = 0; !traffic_done; stream = (stream + 1) % streams) {
+            make_tcp_frame(packet, sizeof(packet), seq[stream], ports[stream]);
+            if (poll(&pfd, 1, 10) > 0 && write(peer.rx_fd, packet, sizeof(packet)) > 0) {
+                seq[stream] += sizeof(packet) - 54;
+            }
+        }
+    });
+
+    auto start = clock::now();
+    auto end = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds));
+    while (clock::now() < end) {
+        bool reaped = false;
+        for (uint16_t pair = 0; pair < pairs; pair++) {
+            FakeQueue* q = queues[2 * pair].get();
+            int slot;
+            while ((slot = q->pop_used()) >= 0) {
+                post_rx(q, slot);
+                reaped = true;
+            }
+        }
+        if (!reaped) {
+            std::this_thread::yield();
+        }
+    }
+    double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    exit_flag = true;
+    device_thread.join();
+    interrupt_thread.join();
+    traffic_done = true;
+    feeder.join();
+    close(peer.rx_fd);
+    close(peer.tx_fd);
+
+    NetMqResult r = {};
+    VirtioNet::RxStats rx = device.rx_totals();
+    r.rx_packets_per_second = rx.packets / elapsed;
+    r.rx_bytes_per_second = rx.bytes / elapsed;
+    for (uint16_t pair = 0; pair < pairs; pair++) {
+        r.per_queue.push_back(device.rx[pair].stats.packets);
+        r.dropped += device.backlogs.empty() ? 0 : device.backlogs[pair]->dropped;
+    }
+    return r;
+}
+
+/*
+The Toeplitz hash with the default key against the verification suite in Microsoft's
+RSS documentation: addresses then ports, source first. Through queue() as well, with
+a table as long as the hash's low bits go, so the frame's fields go in in that order too
+*/
+void CheckToeplitz(){
+    struct { const char* src; uint16_t src_port; const char* dst; uint16_t dst_port; uint32_t ip, tcp; } vectors[] = {
+        {"66.9.149.187", 2794, "161.142.100.80", 1766, 0x323e8fc2, 0x51ccc178},
+        {"199.92.111.2", 14230, "65.69.140.83", 4739, 0xd718262a, 0xc626b0ea},
+        {"24.19.198.95", 12898, "12.22.207.184", 38024, 0xd2d0a5de, 0x5c2b394a},
+        {"38.27.205.30", 48228, "209.142.163.6", 2217, 0x82989176, 0xafc7327f},
+        {"153.39.163.191", 44251, "202.188.127.2", 1303, 0x5d1809c5, 0x10e828a2},
+    };
+    RssConfig rss;
+    rss.spread(RssConfig::MAX_TABLE);
+    for (auto& v : vectors) {
+        uint8_t input[12];
+        inet_pton(AF_INET, v.src, input);
+        inet_pton(AF_INET, v.dst, input + 4);
+        uint16_t ports[2] = {htons(v.src_port), htons(v.dst_port)};
+        memcpy(input + 8, ports, 4);
+        uint32_t ip = rss.hash(input, 8), tcp = rss.hash(input, 12);
+        check_field("Toeplitz hash of IPv4 addresses", ip == v.ip, "hash", ip, v.ip);
+        check_field("Toeplitz hash of IPv4 addresses and TCP ports", tcp == v.tcp, "hash", tcp, v.tcp);
+
+        uint8_t frame[54];
+        make_tcp_frame(frame, sizeof(frame), 0);
+        memcpy(frame + 14 + 12, input, 8);
+        memcpy(frame + 34, ports, 4);
+        size_t queue = rss.queue(frame, sizeof(frame));
+        check_field("RSS queue of a TCP frame", queue == (tcp & (RssConfig::MAX_TABLE - 1)), "queue", queue,
+            tcp & (RssConfig::MAX_TABLE - 1));
+    }
+    printf("  data check Toeplitz hash against the RSS verification suite: ok\n");
+}
+
+/*
+The guest going from 4 queue pairs down to 1 with packets still waiting on the other
+queues' backlogs: they should all turn up on the first queue once it has buffers
+*/
+void CheckPairsLowered(){
+    const char* what = "packets stranded by fewer queue pairs";
+    uint16_t pairs = 4;
+    FakeL2CPU l2cpu;
+    std::atomic<bool> exit_flag{false};
+    InterruptDispatcher interrupts(&l2cpu.interrupt_register);
+    NetPeer peer = fake_net_peer(false, true);
+    BenchNet device(l2cpu.transport(), exit_flag, interrupts, 32, peer.backend, pairs);
+    uint64_t features = 1ULL << VIRTIO_NET_F_MRG_RXBUF | 1ULL << VIRTIO_NET_F_CTRL_VQ | 1ULL << VIRTIO_NET_F_MQ;
+    uint32_t num_queues = 2 * pairs + 1;
+    std::vector<std::unique_ptr<FakeQueue>> queues;
+    std::vector<FakeQueue*> attached;
+    for (uint32_t i = 0; i < num_queues; i++) {
+        queues.push_back(make_queue(l2cpu, features, FAKE_MEMORY_SIZE / num_queues * i));
+        attached.push_back(queues.back().get());
+    }
+    device.attach(attached, features);
+    std::thread device_thread([&]{ device.device_loop(); });
+
+    FakeQueue* ctrl = queues.back().get();
+    uint16_t slot = 0;
+    auto set_pairs = [&](uint16_t n){
+        uint8_t* cmd = l2cpu.memory + ctrl->buffer_offset;
+        cmd[0] = VIRTIO_NET_CTRL_MQ;
+        cmd[1] = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+        memcpy(cmd + 2, &n, sizeof(n));
+        cmd[64] = VIRTIO_NET_ERR;
+        FakeSeg segs[2] = {{ctrl->buffer_offset, 4, false}, {ctrl->buffer_offset + 64, 1, true}};
+        ctrl->add(slot++, segs, 2);
+        while (ctrl->pop_used() < 0) {
+            std::this_thread::yield();
+        }
+        assert(cmd[64] == VIRTIO_NET_OK);
+    };
+    set_pairs(pairs);
+
+    // 16 flows, no rx buffers anywhere yet, so everything waits on the backlogs
+    size_t sent = 64;
+    uint8_t packet[PACKET_SIZE];
+    for (size_t i = 0; i < sent; i++) {
+        make_tcp_frame(packet, sizeof(packet), i, 40000 + i % 16);
+        ssize_t n = write(peer.rx_fd, packet, sizeof(packet));
+        assert(n == (ssize_t)sizeof(packet));
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (std::chrono::steady_clock::now() < deadline) {
+        {
+            std::lock_guard<std::mutex> guard(device.rss_lock);
+            if (device.steer_stats.packets == sent) {
+                break;
+            }
+        }
+        std::this_thread::yield();
+    }
+    size_t stranded = 0;
+    for (uint16_t q = 1; q < pairs; q++) {
+        stranded += device.backlogs[q]->queued;
+    }
+    check_field(what, stranded > 0, "packets on the other queues", stranded, 1);
+
+    // The backend's drained but the first queue's backlog isn't, its sleeps have to end on that too
+    assert(device.backlogs[0]->queued > 0);
+    int fd = device.wait_fd(0);
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    struct timeval tv = {};
+    bool wakes = select(fd + 1, &rfds, NULL, NULL, &tv) > 0;
+    check_field(what, wakes, "first queue woken by its backlog", wakes, 1);
+
+    set_pairs(1);
+    FakeQueue* rxq = queues[0].get();
+    for (uint16_t s = 0; s < 128; s++) {
+        FakeSeg seg = {rxq->buffer_offset + s * 2048u, 2048, true};
+        rxq->add(s, &seg, 1);
+    }
+    size_t received = 0;
+    deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (received < sent && std::chrono::steady_clock::now() < deadline) {
+        if (rxq->pop_used() >= 0) {
+            received++;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    exit_flag = true;
+    device_thread.join();
+    close(peer.rx_fd);
+    close(peer.tx_fd);
+    check_field(what, received == sent, "packets on the first queue", received, sent);
+    printf("  data check %s: ok, %zu of %zu moved\n", what, stranded, sent);
+}
+
+/*
+16 parallel TCP downloads into 1 queue pair against 2 and 4, spread by RSS, with a
+worker per queue like --net-queues gives them, and 4 on one thread for what the
+steering's copy costs on its own. The host side only scales as far as there are
+cores for the workers, the real win is in the guest, where each rx queue's
+interrupts and NAPI polling can go to a hart of its own. Per queue counts show how
+evenly the Toeplitz hash spread the streams
+*/
+void BenchNetMultiQueue(double seconds){
+    printf("virtio-net multi-queue rx, 16 TCP streams of 1514 byte packets, 128 rx buffers per queue\n");
+    CheckToeplitz();
+    CheckPairsLowered();
+    struct { uint16_t pairs; bool workers; } modes[] = {{1, false}, {4, false}, {2, true}, {4, true}};
+    for (auto& mode : modes) {
+        VirtioOptions options;
+        options.queue_workers = mode.workers;
+        NetMqResult r = run_net_mq(options, mode.pairs, 16, seconds);
+        printf("  %u queue pairs, %-10s: %10.0f pkt/s %6.2f Gbit/s, %lu dropped, per queue:", mode.pairs,
+            mode.workers ? "workers" : "one thread", r.rx_packets_per_second, r.rx_bytes_per_second * 8 / 1e9, r.dropped);
+        for (uint64_t packets : r.per_queue) {
+            printf(" %lu", packets);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char** argv){
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    std::string image = make_image();
+    BenchBlkBatchDrain(image, seconds);
+    BenchBlkEventIdx(image, seconds);
+    BenchPolling(image, seconds);
+    BenchRingLayout(image, seconds);
+    BenchIndirect(image, seconds);
+    BenchRingReads(image, seconds);
+    BenchCoalescing(image, seconds);
+    BenchBlkEngines(image, seconds);
+    BenchBlkMultiQueue(image, seconds);
+    BenchBlkSequential(image, seconds);
+    BenchBlkRequestSize(image, seconds);
+    BenchBlkCacheModes(image, seconds);
+    BenchBlkDiscard(seconds);
+    BenchBlkOverlay(image, seconds);
+    BenchBlkStripe(image, seconds);
+    BenchBlkZstd(seconds);
+    BenchNetWorkers(seconds);
+    BenchNetRx(seconds);
+    BenchNetZeroCopy(seconds);
+    BenchNetBackends(seconds);
+    BenchNetOffload(seconds);
+    BenchNetMultiQueue(seconds);
+    unlink(image.c_str());
+    return 0;
+}
@@ -0,0 +1,40 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+/*
+Storage behind a VirtioBlk that isn't a plain raw image (overlays, compressed
+images...). Plain images keep going through VirtioBlk's own mmap/io_uring paths.
+
+VirtioBlk hands backends host buffers, never guest memory, and calls them from
+the thread servicing each queue, so with several queues the calls can come from
+several threads at once
+*/
+class BlkBackend {
+public:
+    virtual ~BlkBackend() = default;
+
+    // Size of the disk the guest sees, in bytes
+    virtual uint64_t size() = 0;
+
+    // Writes and zero() fail with -EROFS, VirtioBlk offers the disk as VIRTIO_BLK_F_RO
+    virtual bool read_only() { return false; }
+
+    // Both return len or -errno. Reads past the end of the disk come back as zeroes
+    virtual ssize_t read(void* buf, size_t len, uint64_t offset) = 0;
+    virtual ssize_t write(const void* buf, size_t len, uint64_t offset) = 0;
+
+    // Make every write that has completed durable, 0 or -errno
+    virtual int flush() = 0;
+
+    // Make [offset, offset+len) read as zeroes, giving the space back if unmap. 0 or -errno
+    virtual int zero(uint64_t offset, uint64_t len, bool unmap) = 0;
+
+    // One line of stats for --poll-stats
+    virtual void report(const std::string& name) {}
+};
@@ -21,6 +21,7 @@
 #include <atomic>
 
 #include "l2cpu.h"
+#include "poller.hpp"
 
 using le64_t = uint64_t;
 using le32_t = uint32_t;
@@ -116,9 +117,11 @@ struct debug_descriptor {
     u64 virtuart_base;
 };
 
-inline int uart_loop(int ttdevice, int l2cpu_idx, std::atomic<bool>& exit_thread_flag) {
+inline int uart_loop(int ttdevice, int l2cpu_idx, std::atomic<bool>& exit_thread_flag, Poller& poller) {
 
-    L2CPU l2cpu(l2cpu_idx, ttdevice);
+    // Shared with the virtio devices on this L2CPU
+    std::shared_ptr<L2CPU> l2cpu_context = L2CPU::get(l2cpu_idx, ttdevice);
+    L2CPU& l2cpu = *l2cpu_context;
 
     uint64_t starting_address = l2cpu.get_starting_address();
 
@@ -159,18 +162,21 @@ inline int uart_loop(int ttdevice, int l2cpu_idx, std::atomic<bool>& exit_thread
             return -EAGAIN;
         }
 
+        bool did_work = false;
+
         // Check for input from the terminal
         fd_set rfds;
         struct timeval tv;
         FD_ZERO(&rfds);
         FD_SET(STDIN_FILENO, &rfds);
         tv.tv_sec = 0;
-        tv.tv_usec = 1;
+        tv.tv_usec = 0;
 
         int retval = select(STDIN_FILENO + 1, &rfds, NULL, NULL, &tv);
         if (retval > 0) {
             char input;
             if (read(STDIN_FILENO, &input, 1) > 0) {
+                did_work = true;
                 if (ctrl_a_pressed) {
                     if (input == 'x') {
                         printf("\n\n");
@@ -185,12 +191,18 @@ inline int uart_loop(int ttdevice, int l2cpu_idx, std::atomic<bool>& exit_thread
             }
         }
 
-        // Check for output from the device
+        // Check for output from the device, and take everything that is there
         if (can_pop(q)) {
-            char c = pop_char(q);
-            printf("%c", c);
+            while (can_pop(q)) {
+                char c = pop_char(q);
+                printf("%c", c);
+            }
             std::fflush(stdout);
+            did_work = true;
         }
+
+        // Stdin wakes us straight away, output from the X280 has to wait for the poller
+        poller.wait(did_work, STDIN_FILENO);
     }
 
     return 0;
@@ -0,0 +1,390 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+
+#include "blkbackend.hpp"
+#include "rawimage.hpp"
+#include "zstdimage.hpp"
+
+/*
+Copy-on-write overlay over a read-only base image, so every L2CPU can boot the same
+rootfs without its own copy of it.
+
+The overlay file holds a header (with the base image's path), an index with one entry
+per block of the disk, then the blocks the guest has written to. An index entry is the
+offset of the block's copy in the overlay, or 0 if the block was never written and
+still comes from the base. Blocks are copied up (read from the base, patched, written
+to the overlay) on their first write and added at the end of the file.
+
+A new block's index entry only goes to disk on the next flush, after the block's data
+has been synced, so a crash can't leave an entry pointing at a block that never made
+it out: at worst there are blocks at the end of the file no entry points to, and
+writes the guest never flushed read from the base again.
+
+The base is only ever read, with plain preads, so every instance on the host shares
+its page cache. Making a new instance is writing a header and an empty (sparse) index.
+The base can also be a seekable zstd image (ZstdImage), then it's shipped compressed
+and only the blocks the guest writes ever exist uncompressed on disk.
+
+Layout, all little endian:
+    0                 CowHeader, padded to 4K
+    index_offset      uint64_t per block
+    data_offset       blocks, block_size each
+*/
+class CowImage : public BlkBackend {
+public:
+    static constexpr char MAGIC[8] = {'T', 'T', 'B', 'H', 'C', 'O', 'W', '1'};
+    static constexpr uint32_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+    static constexpr size_t HEADER_SIZE = 4096;
+
+    struct CowHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t block_size;
+        // Size of the disk, the base's size when the overlay was made
+        uint64_t size;
+        uint64_t index_offset;
+        uint64_t data_offset;
+        // Base image, absolute as create() writes it. A relative one (written by hand) is relative to the overlay's directory
+        char base_path[HEADER_SIZE - 40];
+    };
+    static_assert(sizeof(CowHeader) == HEADER_SIZE, "CowHeader has to fill its 4K");
+
+private:
+    int fd = -1;
+    std::unique_ptr<BlkBackend> base;
+    uint64_t base_size = 0;
+    CowHeader header;
+    uint64_t num_blocks = 0;
+    std::unique_ptr<std::atomic<uint64_t>[]> index;
+
+    // Held while copying a block up, so two writes can't both allocate it
+    std::mutex alloc_lock;
+    uint64_t next_block = 0;
+    // Blocks allocated since the last flush, whose index entries aren't on disk yet
+    std::vector<uint64_t> unsynced;
+    // Held while writing index entries out, so flushes don't race each other
+    std::mutex flush_lock;
+
+    std::atomic<uint64_t> base_reads{0}, overlay_reads{0}, copy_ups{0};
+
+    static uint64_t round_up(uint64_t v, uint64_t to){
+        return (v + to - 1) / to * to;
+    }
+
+    static std::string resolve_base(const std::string& overlay_path, const std::string& base_path){
+        if (base_path.empty() || base_path[0] == '/') {
+            return base_path;
+        }
+        size_t slash = overlay_path.rfind('/');
+        return slash == std::string::npos ? base_path : overlay_path.substr(0, slash + 1) + base_path;
+    }
+
+    // Read [offset, offset+len) of the base, zeroes past its end
+    ssize_t read_base(uint8_t* buf, size_t len, uint64_t offset){
+        size_t n = offset < base_size ? std::min<uint64_t>(len, base_size - offset) : 0;
+        if (n != 0) {
+            ssize_t r = base->read(buf, n, offset);
+            if (r < 0) {
+                return r;
+            }
+        }
+        memset(buf + n, 0, len - n);
+        return len;
+    }
+
+    static std::unique_ptr<BlkBackend> open_base(const std::string& path, const ZstdOptions& zstd){
+        if (ZstdImage::probe(path)) {
+            return ZstdImage::open_image(path, zstd);
+        }
+        return RawImage::open_image(path, false);
+    }
+
+    // Overlay offset of block b, allocating (and copying it up from the base) if it's not there yet
+    int64_t get_block(uint64_t b, bool copy_up){
+        uint64_t at = index[b].load(std::memory_order_acquire);
+        if (at != 0) {
+            return at;
+        }
+        std::lock_guard<std::mutex> guard(alloc_lock);
+        at = index[b].load(std::memory_order_relaxed);
+        if (at != 0) {
+            return at;
+        }
+        at = next_block;
+        if (copy_up) {
+            std::vector<uint8_t> block(header.block_size);
+            ssize_t r = read_base(block.data(), block.size(), b * header.block_size);
+            if (r < 0) {
+                return r;
+            }
+            if (pwrite(fd, block.data(), block.size(), at) != (ssize_t)block.size()) {
+                return -EIO;
+            }
+            copy_ups.fetch_add(1, std::memory_order_relaxed);
+        } else if (ftruncate(fd, at + header.block_size) != 0) {
+            // Not copied up: the block is a hole, so it reads as zeroes
+            return -errno;
+        }
+        // The index entry waits for the next flush, see the top
+        unsynced.push_back(b);
+        next_block += header.block_size;
+        index[b].store(at, std::memory_order_release);
+        return at;
+    }
+
+public:
+    // Whether path starts with an overlay header
+    static bool probe(const std::string& path){
+        int f = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (f < 0) {
+            return false;
+        }
+        char magic[8];
+        bool is_overlay = pread(f, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, MAGIC, sizeof(magic)) == 0;
+        close(f);
+        return is_overlay;
+    }
+
+    /*
+    Make a new empty overlay of base_path at path, 0 or -errno. base_path is what the
+    user typed, so a relative one is relative to where they are, not to the overlay;
+    the header gets it as an absolute path
+    */
+    static int create(const std::string& path, const std::string& base_path, uint32_t block_size = DEFAULT_BLOCK_SIZE){
+        char* resolved = realpath(base_path.c_str(), nullptr);
+        if (!resolved) {
+            return -errno;
+        }
+        std::string base = resolved;
+        free(resolved);
+        // A compressed base's size is what it decompresses to, a block device's isn't its st_size either
+        ZstdOptions zstd;
+        zstd.workers = 1;
+        std::unique_ptr<BlkBackend> base_image = open_base(base, zstd);
+        if (!base_image) {
+            return -EINVAL;
+        }
+        if (base.size() >= sizeof(CowHeader::base_path) || block_size < 4096 || (block_size & (block_size - 1))) {
+            return -EINVAL;
+        }
+        CowHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, MAGIC, sizeof(MAGIC));
+        h.version = 1;
+        h.block_size = block_size;
+        h.size = base_image->size();
+        h.index_offset = HEADER_SIZE;
+        h.data_offset = round_up(h.index_offset + round_up(h.size, block_size) / block_size * sizeof(uint64_t), block_size);
+        memcpy(h.base_path, base.data(), base.size());
+
+        int f = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (f < 0) {
+            return -errno;
+        }
+        int r = 0;
+        if (pwrite(f, &h, sizeof(h), 0) != sizeof(h) || ftruncate(f, h.data_offset) != 0 || fsync(f) != 0) {
+            r = -errno;
+        }
+        close(f);
+        return r;
+    }
+
+    // Open the overlay at path and its base, null (after saying why) if that fails
+    static std::unique_ptr<CowImage> open_image(const std::string& path, const ZstdOptions& zstd = ZstdOptions()){
+        std::unique_ptr<CowImage> image(new CowImage());
+        image->fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (image->fd < 0 || pread(image->fd, &image->header, sizeof(header), 0) != sizeof(header)
+            || memcmp(image->header.magic, MAGIC, sizeof(MAGIC)) != 0 || image->header.version != 1) {
+            printf("%s is not a readable overlay\n", path.c_str());
+            return nullptr;
+        }
+        CowHeader& h = image->header;
+        h.base_path[sizeof(h.base_path) - 1] = 0;
+        image->base = open_base(resolve_base(path, h.base_path), zstd);
+        if (!image->base) {
+            return nullptr;
+        }
+        image->base_size = image->base->size();
+
+        image->num_blocks = round_up(h.size, h.block_size) / h.block_size;
+        std::vector<uint64_t> entries(image->num_blocks);
+        if (pread(image->fd, entries.data(), entries.size() * sizeof(uint64_t), h.index_offset) != (ssize_t)(entries.size() * sizeof(uint64_t))) {
+            printf("%s: short overlay index\n", path.c_str());
+            return nullptr;
+        }
+        image->index.reset(new std::atomic<uint64_t>[image->num_blocks]);
+        for (uint64_t b = 0; b < image->num_blocks; b++) {
+            image->index[b].store(entries[b], std::memory_order_relaxed);
+        }
+        // New blocks go after whatever is in the file, a crash can leave a block there that no entry points to
+        struct stat ob;
+        if (fstat(image->fd, &ob) != 0) {
+            perror(("Failed to stat " + path).c_str());
+            return nullptr;
+        }
+        image->next_block = std::max<uint64_t>(h.data_offset, round_up(ob.st_size, h.block_size));
+        return image;
+    }
+
+    ~CowImage(){
+        if (fd >= 0) {
+            flush();
+            close(fd);
+        }
+    }
+
+    uint64_t size() override {
+        return header.size;
+    }
+
+    ssize_t read(void* buf, size_t len, uint64_t offset) override {
+        uint8_t* p = static_cast<uint8_t*>(buf);
+        size_t done = 0;
+        while (done < len) {
+            uint64_t pos = offset + done;
+            uint64_t b = pos / header.block_size;
+            size_t in_block = pos % header.block_size;
+            size_t n = std::min<size_t>(len - done, header.block_size - in_block);
+            if (b >= num_blocks) {
+                memset(p + done, 0, len - done);
+                break;
+            }
+            uint64_t at = index[b].load(std::memory_order_acquire);
+            if (at == 0) {
+                base_reads.fetch_add(1, std::memory_order_relaxed);
+                ssize_t r = read_base(p + done, n, pos);
+                if (r < 0) {
+                    return r;
+                }
+            } else {
+                overlay_reads.fetch_add(1, std::memory_order_relaxed);
+                ssize_t r = pread(fd, p + done, n, at + in_block);
+                if (r < 0) {
+                    return -errno;
+                }
+                // A hole at the end of the file reads short
+                memset(p + done + r, 0, n - r);
+            }
+            done += n;
+        }
+        return len;
+    }
+
+    ssize_t write(const void* buf, size_t len, uint64_t offset) override {
+        const uint8_t* p = static_cast<const uint8_t*>(buf);
+        size_t done = 0;
+        while (done < len) {
+            uint64_t pos = offset + done;
+            uint64_t b = pos / header.block_size;
+            size_t in_block = pos % header.block_size;
+            size_t n = std::min<size_t>(len - done, header.block_size - in_block);
+            if (b >= num_blocks) {
+                return -ENOSPC;
+            }
+            // A write covering the whole block doesn't need the base's copy
+            int64_t at = get_block(b, n != header.block_size);
+            if (at < 0) {
+                return at;
+            }
+            if (pwrite(fd, p + done, n, at + in_block) != (ssize_t)n) {
+                return -EIO;
+            }
+            done += n;
+        }
+        return len;
+    }
+
+    /*
+    Sync the data, then write out the index entries of the blocks allocated since the
+    last flush and sync those
+    */
+    int flush() override {
+        std::lock_guard<std::mutex> flushing(flush_lock);
+        std::vector<uint64_t> blocks;
+        {
+            std::lock_guard<std::mutex> guard(alloc_lock);
+            blocks.swap(unsynced);
+        }
+        if (fdatasync(fd) != 0) {
+            int err = -errno;
+            std::lock_guard<std::mutex> guard(alloc_lock);
+            unsynced.insert(unsynced.end(), blocks.begin(), blocks.end());
+            return err;
+        }
+        if (blocks.empty()) {
+            return 0;
+        }
+        for (uint64_t b : blocks) {
+            uint64_t entry = index[b].load(std::memory_order_relaxed);
+            if (pwrite(fd, &entry, sizeof(entry), header.index_offset + b * sizeof(entry)) != sizeof(entry)) {
+                std::lock_guard<std::mutex> guard(alloc_lock);
+                unsynced.insert(unsynced.end(), blocks.begin(), blocks.end());
+                return -EIO;
+            }
+        }
+        return fdatasync(fd) == 0 ? 0 : -errno;
+    }
+
+    int zero(uint64_t offset, uint64_t len, bool unmap) override {
+        uint64_t end = std::min<uint64_t>(offset + len, header.size);
+        static const std::vector<uint8_t> zeroes(DEFAULT_BLOCK_SIZE, 0);
+        while (offset < end) {
+            uint64_t b = offset / header.block_size;
+            size_t in_block = offset % header.block_size;
+            size_t n = std::min<uint64_t>(end - offset, header.block_size - in_block);
+            if (n == header.block_size) {
+                // Whole block: make it a hole in the overlay, which hides the base's copy
+                int64_t at = get_block(b, false);
+                if (at < 0) {
+                    return at;
+                }
+                if (fallocate(fd, FALLOC_FL_KEEP_SIZE | (unmap ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE), at, n) != 0) {
+                    for (size_t i = 0; i < n; i += zeroes.size()) {
+                        if (pwrite(fd, zeroes.data(), std::min(zeroes.size(), n - i), at + i) < 0) {
+                            return -errno;
+                        }
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < n; i += zeroes.size()) {
+                    ssize_t r = write(zeroes.data(), std::min(zeroes.size(), n - i), offset + i);
+                    if (r < 0) {
+                        return r;
+                    }
+                }
+            }
+            offset += n;
+        }
+        return 0;
+    }
+
+    uint64_t allocated_blocks(){
+        std::lock_guard<std::mutex> guard(alloc_lock);
+        return (next_block - header.data_offset) / header.block_size;
+    }
+
+    void report(const std::string& name) override {
+        uint64_t from_base = base_reads.load(), from_overlay = overlay_reads.load();
+        printf("%s: %lu of %lu blocks in the overlay, %lu copied up, %.1f%% of reads from the base\n", name.c_str(),
+            allocated_blocks(), num_blocks, copy_ups.load(),
+            from_base + from_overlay ? 100.0 * from_base / (from_base + from_overlay) : 0.0);
+        base->report(name + " base");
+    }
+};
@@ -0,0 +1,75 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/*
+Which chunks of a disk image have been written to since we last looked.
+
+mark() is lock free so every queue worker can call it on its write path, drain()
+hands back runs of consecutive dirty chunks (clearing them) so a flush only
+syncs the parts of the image that actually changed
+*/
+class DirtyMap {
+    uint64_t chunk_size;
+    size_t num_chunks;
+    size_t num_words;
+    std::unique_ptr<std::atomic<uint64_t>[]> bits;
+
+public:
+    static constexpr uint64_t DEFAULT_CHUNK = 1ULL << 20;
+
+    explicit DirtyMap(uint64_t size, uint64_t chunk_size_ = DEFAULT_CHUNK)
+        : chunk_size(chunk_size_), num_chunks((size + chunk_size_ - 1) / chunk_size_),
+          num_words((num_chunks + 63) / 64), bits(new std::atomic<uint64_t>[num_words]) {
+        for (size_t i = 0; i < num_words; i++) {
+            bits[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void mark(uint64_t offset, uint64_t len){
+        if (len == 0) {
+            return;
+        }
+        size_t first = offset / chunk_size;
+        size_t last = std::min((offset + len - 1) / chunk_size, num_chunks - 1);
+        for (size_t c = first; c <= last; c++) {
+            uint64_t bit = 1ULL << (c % 64);
+            // Rewrites of a dirty chunk are the common case, skip the locked op for those
+            if (!(bits[c / 64].load(std::memory_order_relaxed) & bit)) {
+                bits[c / 64].fetch_or(bit, std::memory_order_release);
+            }
+        }
+    }
+
+    // Calls f(offset, len) for every run of dirty chunks and marks them clean
+    template <typename F>
+    void drain(F f){
+        uint64_t run_start = 0, run_len = 0;
+        for (size_t w = 0; w < num_words; w++) {
+            uint64_t word = bits[w].exchange(0, std::memory_order_acquire);
+            for (size_t b = 0; b < 64; b++) {
+                if (word & (1ULL << b)) {
+                    uint64_t offset = (w * 64 + b) * chunk_size;
+                    if (run_len != 0 && run_start + run_len == offset) {
+                        run_len += chunk_size;
+                    } else {
+                        if (run_len != 0) {
+                            f(run_start, run_len);
+                        }
+                        run_start = offset;
+                        run_len = chunk_size;
+                    }
+                }
+            }
+        }
+        if (run_len != 0) {
+            f(run_start, run_len);
+        }
+    }
+};
@@ -1,5 +1,6 @@
 #include <atomic>
 #include <cassert>
+#include <climits>
 #include <cstdio>
 #include <getopt.h>
 #include <inttypes.h>
@@ -10,11 +11,17 @@
 #include <string.h>
 #include <string> // Added for std::string
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 #include <mutex> // Added for std::mutex
+#include <condition_variable>
+#include <thread>
 extern "C" {
 #define class __class_compat // Rename 'class' to avoid C++ keyword conflict
 
@@ -30,61 +37,841 @@ extern "C" {
 }
 
 #include "l2cpu.h"
+#include "blkbackend.hpp"
+#include "cowimage.hpp"
+#include "stripeimage.hpp"
+#include "zstdimage.hpp"
+#include "dirtymap.hpp"
+#include "readahead.hpp"
+#include "uring.hpp"
 #include "virtiodevice.hpp"
 
+enum class BlkEngine {
+    // memcpy between the mmap'd image and guest memory on the device thread
+    MMAP,
+    // preadv/pwritev on the device thread, nothing is mapped. Block devices always get this (or io_uring)
+    PREAD,
+    // preadv/pwritev through io_uring, many requests in flight, completed as they finish
+    IO_URING,
+};
+
+enum class BlkCache {
+    // Writes sit in the host's page cache, are written back in the background and synced on flush
+    WRITEBACK,
+    // A write is on disk before the guest hears it's done, flushes are free
+    WRITETHROUGH,
+    // O_DIRECT, the page cache is bypassed. Flushes still sync the disk's own cache
+    NONE,
+};
+
+/*
+What the guest is told about the disk's blocks and how big its requests can get
+(VIRTIO_BLK_F_BLK_SIZE, TOPOLOGY, SEG_MAX and SIZE_MAX). Without SEG_MAX Linux
+sends a single data segment per request
+*/
+struct BlkGeometry {
+    // Smallest unit the guest addresses, 512 or up to 4096
+    uint32_t logical_block_size = 512;
+    // Smallest unit written without a read-modify-write, the host filesystem's block
+    uint32_t physical_block_size = 4096;
+    // Preferred size of big I/Os, Linux sizes its requests and readahead after it (0: no preference)
+    uint32_t opt_io_size = 1 << 20;
+    // Most data segments in one request, at most the queue size less the header and status
+    uint32_t seg_max = 254;
+    // Largest data segment (0: no limit)
+    uint32_t size_max = 0;
+};
+
+/*
+Block backend settings, filled in from the command line
+*/
+struct BlkOptions {
+    BlkEngine engine = BlkEngine::MMAP;
+    // Most requests io_uring keeps in flight at once, per virtqueue
+    uint32_t queue_depth = 128;
+    // Virtqueues offered to the guest (VIRTIO_BLK_F_MQ when more than 1), each serviced by its own worker
+    uint16_t num_queues = 1;
+    BlkCache cache = BlkCache::WRITEBACK;
+    // With BlkCache::WRITEBACK, start writing dirty parts of the image back this often
+    uint32_t writeback_ms = 1000;
+    // Cache and decompression workers for seekable zstd images
+    ZstdOptions zstd;
+    // Chunk each member of a striped disk (--disk a.img,b.img,...) takes in turn
+    uint32_t stripe_kb = 512;
+    /*
+    Most a sequential stream of reads is read ahead of the guest, into the page cache (0: off).
+    A posix_fadvise hint, so only raw images through the page cache get it, not O_DIRECT
+    or the overlay/zstd/stripe backends
+    */
+    uint32_t readahead_kb = 2048;
+    // Adjacent reads/writes taken off a queue in one pass go to io_uring as one I/O of up to this (0: off), not with O_DIRECT
+    uint32_t max_merge_kb = 1024;
+    BlkGeometry geometry;
+};
+
+// O_DIRECT transfers go through one of these, guest memory is behind the BAR and can't be DMA'd to
+struct BlkBounce {
+    uint8_t* data = nullptr;
+    size_t size = 0;
+    // Where in the image the request it's lent to goes
+    uint64_t offset = 0;
+
+    ~BlkBounce(){
+        free(data);
+    }
+};
+
+// Requests for consecutive sectors that go to io_uring as one readv/writev
+struct BlkMerge {
+    uint32_t type = 0;
+    uint64_t offset = 0;
+    uint64_t end = 0;
+    std::vector<VirtioRequest*> requests;
+    std::vector<struct iovec> iov;
+};
+
 class VirtioBlk : public VirtioDevice {
 public:
+    // Limits advertised for VIRTIO_BLK_T_DISCARD/WRITE_ZEROES
+    static constexpr uint32_t MAX_DISCARD_SECTORS = 1u << 22;
+    static constexpr uint32_t MAX_DISCARD_SEG = 256;
+
     int sector_size = 512;
     int fd = -1;
+    // O_DIRECT twin of fd for BlkCache::NONE
+    int direct_fd = -1;
+    // Only with BlkEngine::MMAP
     uint8_t* mapped_data = nullptr;
+    // O_DIRECT wants offsets and lengths in multiples of this, the logical block size for block devices
+    uint32_t direct_align = 512;
+    bool block_device = false;
     size_t file_size = 0;
     size_t num_sectors = 0;
-    struct virtio_blk_outhdr *req;
     std::string disk_image_path;
+    BlkOptions blk_options;
+    // Set for images that aren't raw (overlays), which go through it instead of fd/mapped_data
+    std::unique_ptr<BlkBackend> backend;
 
-    VirtioBlk(int ttdevice, int l2cpu_idx, std::atomic<bool>& exit_flag, std::mutex& interrupt_register_lock, int interrupt_number_, uint64_t mmio_region_offset_, const std::string& image_path)
-        : VirtioDevice(ttdevice, l2cpu_idx, exit_flag, interrupt_register_lock, interrupt_number_, mmio_region_offset_), disk_image_path(image_path) {
-        // FIXME: I don't know if we're handling the last sector's size, reads and writes properly
-        
-        num_queues = 1;
-        device_features_list[0] = 0;
+    // Owned by the thread servicing the queue
+    struct alignas(64) BlkQueue {
+        // Only with BlkEngine::IO_URING
+        std::unique_ptr<IoUring> ring;
+        uint32_t inflight = 0;
+        std::vector<std::unique_ptr<BlkBounce>> bounces;
+        std::vector<BlkBounce*> free_bounces;
+        // Being built up from this pass's requests, goes to the ring when something doesn't fit or the pass ends
+        BlkMerge pending;
+        // Merged I/Os in flight, their user_data is the BlkMerge with the low bit set
+        std::vector<std::unique_ptr<BlkMerge>> merges;
+        std::vector<BlkMerge*> free_merges;
+        Readahead readahead;
+        uint64_t merged_requests = 0, merged_ios = 0;
+    };
+    std::vector<BlkQueue> blk_queues;
+
+    /*
+    With BlkCache::WRITEBACK: dirty is everything written since the last flush, so
+    the flush only syncs that. unkicked is everything the background writeback
+    thread hasn't started writing back yet
+    */
+    std::unique_ptr<DirtyMap> dirty, unkicked;
+    std::thread writeback_thread;
+    std::mutex writeback_lock;
+    std::condition_variable writeback_cv;
+    bool writeback_stop = false;
+
+    VirtioBlk(int ttdevice, int l2cpu_idx, std::atomic<bool>& exit_flag, InterruptDispatcher& interrupts_, int interrupt_number_, uint64_t mmio_region_offset_, const std::string& image_path, const BlkOptions& blk_options_ = BlkOptions())
+        : VirtioBlk(VirtioTransport::from_l2cpu(ttdevice, l2cpu_idx, mmio_region_offset_), exit_flag, interrupts_, interrupt_number_, image_path, blk_options_) {}
+
+    VirtioBlk(VirtioTransport transport_, std::atomic<bool>& exit_flag, InterruptDispatcher& interrupts_, int interrupt_number_, const std::string& image_path, const BlkOptions& blk_options_ = BlkOptions())
+        : VirtioDevice(std::move(transport_), exit_flag, interrupts_, interrupt_number_), disk_image_path(image_path), blk_options(blk_options_) {
+        num_queues = std::max<uint16_t>(blk_options.num_queues, 1);
+        device_features_list[0] = 1<<VIRTIO_BLK_F_FLUSH | 1<<VIRTIO_BLK_F_DISCARD | 1<<VIRTIO_BLK_F_WRITE_ZEROES
+            | (num_queues > 1 ? 1<<VIRTIO_BLK_F_MQ : 0)
+            | 1<<VIRTIO_BLK_F_SEG_MAX | 1<<VIRTIO_BLK_F_BLK_SIZE | 1<<VIRTIO_BLK_F_TOPOLOGY
+            | (blk_options.geometry.size_max ? 1<<VIRTIO_BLK_F_SIZE_MAX : 0);
         device_features_list[1] = 1<<(VIRTIO_F_VERSION_1-32);
         
-        fd = open(disk_image_path.c_str(), O_RDWR);
-        if (fd == -1) {
-            perror(("Failed to open file: " + disk_image_path).c_str());
+        if (StripeImage::probe(disk_image_path) || CowImage::probe(disk_image_path) || ZstdImage::probe(disk_image_path)) {
+            if (StripeImage::probe(disk_image_path)) {
+                backend = StripeImage::open_image(disk_image_path, (uint64_t)blk_options.stripe_kb * 1024);
+            } else if (CowImage::probe(disk_image_path)) {
+                backend = CowImage::open_image(disk_image_path, blk_options.zstd);
+            } else {
+                backend = ZstdImage::open_image(disk_image_path, blk_options.zstd);
+            }
+            if (!backend) {
+                return;
+            }
+            file_size = backend->size();
+            if (backend->read_only()) {
+                device_features_list[0] |= 1<<VIRTIO_BLK_F_RO;
+            }
+        } else if (!open_raw()) {
             return;
         }
-        struct stat sb;
-        if (fstat(fd, &sb) == -1) {
-            perror("Failed to get file size");
-            close(fd);
-            fd = -1;
+        /*
+        The guest only sees whole logical blocks. A partial one at the end of the image
+        would have writes to its missing part silently dropped, so it's left out
+        */
+        BlkGeometry& geometry = blk_options.geometry;
+        uint64_t usable = file_size / geometry.logical_block_size * geometry.logical_block_size;
+        if (usable != file_size) {
+            printf("%s: ignoring the last %lu bytes, the image isn't a multiple of %u bytes\n", disk_image_path.c_str(),
+                file_size - usable, geometry.logical_block_size);
+        }
+        num_sectors = usable / sector_size;
+        *device_id = VIRTIO_ID_BLOCK;
+
+        // Every request also needs a descriptor for its header and one for its status
+        if (geometry.seg_max + 2 > queue_size) {
+            printf("seg_max %u doesn't fit a %u entry virtqueue, using %u\n", geometry.seg_max, queue_size, queue_size - 2);
+            geometry.seg_max = queue_size - 2;
+        }
+        // A request's data segments go to the kernel as one iovec array
+        if (geometry.seg_max > IOV_MAX) {
+            printf("seg_max %u is more than an iovec array holds, using %u\n", geometry.seg_max, IOV_MAX);
+            geometry.seg_max = IOV_MAX;
+        }
+
+        struct virtio_blk_config *device_config = reinterpret_cast<struct virtio_blk_config*>(mmio_base + VIRTIO_MMIO_CONFIG);
+        device_config->capacity = num_sectors;
+        device_config->size_max = geometry.size_max;
+        device_config->seg_max = geometry.seg_max;
+        device_config->blk_size = geometry.logical_block_size;
+        device_config->physical_block_exp = __builtin_ctz(geometry.physical_block_size / geometry.logical_block_size);
+        device_config->alignment_offset = 0;
+        device_config->min_io_size = geometry.physical_block_size / geometry.logical_block_size;
+        device_config->opt_io_size = geometry.opt_io_size / geometry.logical_block_size;
+        device_config->num_queues = num_queues;
+        device_config->max_discard_sectors = MAX_DISCARD_SECTORS;
+        device_config->max_discard_seg = MAX_DISCARD_SEG;
+        // Holes are punched in filesystem blocks, anything smaller just gets zeroed
+        device_config->discard_sector_alignment = std::max<uint32_t>(4096, geometry.physical_block_size) / sector_size;
+        device_config->max_write_zeroes_sectors = MAX_DISCARD_SECTORS;
+        device_config->max_write_zeroes_seg = MAX_DISCARD_SEG;
+        device_config->write_zeroes_may_unmap = 1;
+
+        queue_header_size = sizeof(struct virtio_blk_outhdr);
+        queue_status_size = 1;
+
+        blk_queues.resize(num_queues);
+        for (BlkQueue& q : blk_queues) {
+            q.readahead = Readahead((uint64_t)blk_options.readahead_kb * 1024);
+        }
+        if (backend) {
+            // Backends do their own I/O on the queue's thread and have their own idea of caching
+            if (blk_options.engine != BlkEngine::MMAP || blk_options.cache == BlkCache::NONE) {
+                printf("%s isn't a raw image, using its own backend with %s caching\n", disk_image_path.c_str(),
+                    blk_options.cache == BlkCache::WRITEBACK ? "writeback" : "writethrough");
+            }
+            blk_options.engine = BlkEngine::MMAP;
+            if (blk_options.cache == BlkCache::NONE) {
+                blk_options.cache = BlkCache::WRITETHROUGH;
+            }
             return;
         }
+        if (blk_options.engine == BlkEngine::IO_URING) {
+            for (BlkQueue& q : blk_queues) {
+                q.ring = std::make_unique<IoUring>();
+                int r = q.ring->setup(blk_options.queue_depth);
+                if (r < 0) {
+                    printf("io_uring unavailable (%s), falling back to pread for %s\n", strerror(-r), disk_image_path.c_str());
+                    for (BlkQueue& q : blk_queues) {
+                        q.ring.reset();
+                    }
+                    blk_options.engine = BlkEngine::PREAD;
+                    break;
+                }
+            }
+        }
+
+        if (blk_options.cache == BlkCache::NONE) {
+            direct_fd = open(disk_image_path.c_str(), O_RDWR | O_DIRECT);
+            if (direct_fd == -1) {
+                perror(("O_DIRECT not supported, using writethrough for " + disk_image_path).c_str());
+                blk_options.cache = BlkCache::WRITETHROUGH;
+            }
+        }
+        if (blk_options.cache == BlkCache::WRITEBACK) {
+            dirty = std::make_unique<DirtyMap>(file_size);
+            unkicked = std::make_unique<DirtyMap>(file_size);
+            writeback_thread = std::thread(&VirtioBlk::writeback_loop, this);
+        }
+    }
+
+    ~VirtioBlk(){
+        if (writeback_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(writeback_lock);
+                writeback_stop = true;
+            }
+            writeback_cv.notify_all();
+            writeback_thread.join();
+        }
+        // The kernel may still be reading/writing guest memory for requests in flight
+        for (uint32_t queue_idx = 0; queue_idx < blk_queues.size(); queue_idx++) {
+            while (blk_queues[queue_idx].ring && blk_queues[queue_idx].inflight > 0) {
+                submit_pending(blk_queues[queue_idx]);
+                int r = blk_queues[queue_idx].ring->wait(1);
+                if (r < 0 && r != -EINTR) {
+                    break;
+                }
+                poll_completions(queue_idx);
+            }
+        }
+        blk_queues.clear();
+        if (mapped_data != nullptr && mapped_data != MAP_FAILED) {
+            munmap(mapped_data, file_size);
+        }
+        if (direct_fd >= 0) {
+            close(direct_fd);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    inline bool use_uring(){
+        return blk_options.engine == BlkEngine::IO_URING;
+    }
+
+    /*
+    Open a raw image or block device, and map it with BlkEngine::MMAP. A block device's
+    size comes from the kernel (st_size is 0) and it's opened O_EXCL, so it can't be
+    in use by a mounted filesystem or another L2CPU at the same time
+    */
+    bool open_raw(){
+        struct stat sb;
+        if (stat(disk_image_path.c_str(), &sb) == -1) {
+            perror(("Failed to open file: " + disk_image_path).c_str());
+            return false;
+        }
+        block_device = S_ISBLK(sb.st_mode);
+        fd = open(disk_image_path.c_str(), O_RDWR | (block_device ? O_EXCL : 0));
+        if (fd == -1) {
+            perror(("Failed to open file: " + disk_image_path).c_str());
+            return false;
+        }
         file_size = sb.st_size;
-        num_sectors = (file_size + sector_size - 1) / sector_size;
+        if (block_device) {
+            int logical_block = 0;
+            if (ioctl(fd, BLKGETSIZE64, &file_size) == -1 || ioctl(fd, BLKSSZGET, &logical_block) == -1) {
+                perror(("Failed to get the size of " + disk_image_path).c_str());
+                close(fd);
+                fd = -1;
+                return false;
+            }
+            direct_align = logical_block;
+            // Smaller guest blocks would have O_DIRECT fall back to the page cache
+            BlkGeometry& geometry = blk_options.geometry;
+            if ((uint32_t)logical_block > geometry.logical_block_size) {
+                printf("%s has %d byte blocks, telling the guest the same\n", disk_image_path.c_str(), logical_block);
+                geometry.logical_block_size = logical_block;
+                geometry.physical_block_size = std::max<uint32_t>(geometry.physical_block_size, logical_block);
+                geometry.opt_io_size = geometry.opt_io_size / logical_block * logical_block;
+            }
+            if (blk_options.engine == BlkEngine::MMAP) {
+                blk_options.engine = BlkEngine::PREAD;
+            }
+        }
+        if (blk_options.engine != BlkEngine::MMAP) {
+            return true;
+        }
         mapped_data = (uint8_t*)mmap(NULL, file_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
         if (mapped_data == MAP_FAILED) {
             perror("Failed to mmap file");
+            mapped_data = nullptr;
             close(fd);
             fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    /*
+    Background writeback for BlkCache::WRITEBACK: every writeback_ms start writing out
+    whatever was dirtied since last time, without waiting for it. Keeps dirty data
+    from piling up until the kernel decides to write it all at once, and leaves less
+    for a flush to wait on
+    */
+    void writeback_loop(){
+        std::unique_lock<std::mutex> guard(writeback_lock);
+        while (!writeback_stop) {
+            writeback_cv.wait_for(guard, std::chrono::milliseconds(blk_options.writeback_ms));
+            unkicked->drain([this](uint64_t offset, uint64_t len){
+                sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE);
+            });
+        }
+    }
+
+    // A write to [offset, offset+len) has been handed to the page cache
+    inline void mark_dirty(uint64_t offset, uint64_t len){
+        if (dirty) {
+            dirty->mark(offset, len);
+            unkicked->mark(offset, len);
+        }
+    }
+
+    /*
+    Make every write that completed so far durable. Writeback only syncs the ranges
+    written since the last flush, writethrough has nothing left to do, and with
+    O_DIRECT the data is out of the page cache but may still sit in the disk's cache
+    */
+    bool flush(){
+        bool ok = true;
+        if (backend) {
+            ok = backend->flush() == 0;
+        } else if (blk_options.cache == BlkCache::WRITEBACK && mapped_data) {
+            dirty->drain([&](uint64_t offset, uint64_t len){
+                len = std::min<uint64_t>(len, file_size - offset);
+                ok &= msync(mapped_data + offset, len, MS_SYNC) == 0;
+            });
+        } else if (blk_options.cache == BlkCache::WRITEBACK) {
+            // Written with pwrite, nothing to sync range by range
+            dirty->drain([](uint64_t, uint64_t){});
+            ok = fdatasync(fd) == 0;
+        } else if (blk_options.cache == BlkCache::NONE) {
+            ok = fdatasync(fd) == 0;
+        }
+        return ok;
+    }
+
+    /*
+    VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES, done with fallocate so no data
+    is copied and the image stays sparse. Discards (and write zeroes that allow
+    unmapping) punch holes, other write zeroes allocate zeroed blocks. Where the
+    filesystem can't do either, discards are dropped (they're only a hint) and
+    zeroes get written out
+    */
+    uint8_t discard(VirtioRequest* r, uint32_t type){
+        size_t n = r->readable_size() / sizeof(struct virtio_blk_discard_write_zeroes);
+        if (n == 0 || n > MAX_DISCARD_SEG || r->readable_size() % sizeof(struct virtio_blk_discard_write_zeroes)) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        struct virtio_blk_discard_write_zeroes ranges[MAX_DISCARD_SEG];
+        r->gather(ranges, n * sizeof(ranges[0]));
+        for (size_t i = 0; i < n; i++) {
+            bool unmap = type == VIRTIO_BLK_T_DISCARD || (ranges[i].flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP);
+            // Without adding them up, that could wrap round
+            if (ranges[i].num_sectors > MAX_DISCARD_SECTORS || ranges[i].sector > num_sectors
+                || ranges[i].num_sectors > num_sectors - ranges[i].sector || (type == VIRTIO_BLK_T_DISCARD && ranges[i].flags != 0)) {
+                return type == VIRTIO_BLK_T_DISCARD ? VIRTIO_BLK_S_UNSUPP : VIRTIO_BLK_S_IOERR;
+            }
+            uint64_t offset = ranges[i].sector * sector_size;
+            uint64_t len = (uint64_t)ranges[i].num_sectors * sector_size;
+            len = write_room(offset, len);
+            if (len == 0) {
+                continue;
+            }
+            if (backend) {
+                if (backend->zero(offset, len, unmap) != 0 && type != VIRTIO_BLK_T_DISCARD) {
+                    return VIRTIO_BLK_S_IOERR;
+                }
+                continue;
+            }
+            if (block_device && type == VIRTIO_BLK_T_DISCARD) {
+                // Punching a hole in a block device zeroes it, a discard doesn't have to
+                uint64_t range[2] = {offset, len};
+                ioctl(fd, BLKDISCARD, range);
+                continue;
+            }
+            int mode = FALLOC_FL_KEEP_SIZE | (unmap ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE);
+            if (fallocate(fd, mode, offset, len) == 0) {
+                mark_dirty(offset, len);
+                continue;
+            }
+            if (type == VIRTIO_BLK_T_DISCARD) {
+                continue;
+            }
+            if (!(mode & FALLOC_FL_PUNCH_HOLE) && fallocate(fd, FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE, offset, len) == 0) {
+                mark_dirty(offset, len);
+                continue;
+            }
+            static const std::vector<uint8_t> zeroes(1 << 20, 0);
+            for (uint64_t done = 0; done < len; ) {
+                ssize_t w = pwrite(fd, zeroes.data(), std::min<uint64_t>(zeroes.size(), len - done), offset + done);
+                if (w <= 0) {
+                    return VIRTIO_BLK_S_IOERR;
+                }
+                done += w;
+            }
+            mark_dirty(offset, len);
+        }
+        if (blk_options.cache != BlkCache::WRITEBACK && (backend ? backend->flush() : fdatasync(fd)) != 0) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        return VIRTIO_BLK_S_OK;
+    }
+
+    // Stats of the image format behind the disk, if it isn't raw
+    void report_backend(const std::string& name){
+        if (backend) {
+            backend->report(name);
+        }
+    }
+
+    // Reads/writes for a BlkBackend, through a bounce buffer on the queue's thread
+    bool backend_read(VirtioRequest* r, uint64_t offset){
+        size_t len = r->writable_size();
+        BlkBounce* b = get_bounce(r->queue_idx, len);
+        if (!b) {
+            return false;
+        }
+        ssize_t n = backend->read(b->data, len, offset);
+        if (n >= 0) {
+            r->scatter(b->data, len);
+        }
+        put_bounce(r->queue_idx, b);
+        return n >= 0;
+    }
+
+    bool backend_write(VirtioRequest* r, uint64_t offset){
+        size_t len = write_room(offset, r->readable_size());
+        BlkBounce* b = get_bounce(r->queue_idx, len);
+        if (!b) {
+            return false;
+        }
+        r->gather(b->data, len);
+        ssize_t n = backend->write(b->data, len, offset);
+        put_bounce(r->queue_idx, b);
+        if (n >= 0 && blk_options.cache == BlkCache::WRITETHROUGH) {
+            n = backend->flush();
+        }
+        return n >= 0;
+    }
+
+    // A bounce buffer of at least len bytes, null if there's no memory for it
+    BlkBounce* get_bounce(uint32_t queue_idx, size_t len){
+        BlkQueue& q = blk_queues[queue_idx];
+        if (q.free_bounces.empty()) {
+            q.bounces.push_back(std::make_unique<BlkBounce>());
+            q.free_bounces.push_back(q.bounces.back().get());
+        }
+        BlkBounce* b = q.free_bounces.back();
+        q.free_bounces.pop_back();
+        len = (len + 4095) & ~4095ULL;
+        if (b->size < len) {
+            free(b->data);
+            b->data = static_cast<uint8_t*>(aligned_alloc(4096, len));
+            b->size = b->data ? len : 0;
+            if (!b->data) {
+                q.free_bounces.push_back(b);
+                return nullptr;
+            }
+        }
+        return b;
+    }
+
+    void put_bounce(uint32_t queue_idx, BlkBounce* b){
+        blk_queues[queue_idx].free_bounces.push_back(b);
+    }
+
+    // O_DIRECT needs aligned offsets and lengths, anything else goes through the page cache
+    inline bool direct_aligned(uint64_t offset, size_t len){
+        return offset % direct_align == 0 && len % direct_align == 0;
+    }
+
+    inline size_t direct_round_up(size_t len){
+        return (len + direct_align - 1) / direct_align * direct_align;
+    }
+
+    // Bytes of a write at offset that fall inside the image, the rest of the last sector is dropped
+    inline size_t write_room(uint64_t offset, size_t len){
+        return std::min<uint64_t>(len, file_size - std::min<uint64_t>(offset, file_size));
+    }
+
+    /*
+    BlkEngine::PREAD reads/writes on the device thread, straight between the page cache
+    and guest memory
+    */
+    bool pread_request(VirtioRequest* r, uint32_t type, uint64_t offset){
+        std::vector<struct iovec>& iov = request_iov(r, type, offset);
+        size_t want = 0;
+        for (const struct iovec& v : iov) {
+            want += v.iov_len;
+        }
+        ssize_t n = type == VIRTIO_BLK_T_IN ? preadv(fd, iov.data(), iov.size(), offset)
+            : pwritev2(fd, iov.data(), iov.size(), offset, blk_options.cache == BlkCache::WRITETHROUGH ? RWF_DSYNC : 0);
+        return n == (ssize_t)want;
+    }
+
+    // BlkCache::NONE reads/writes on the device thread, through a bounce buffer
+    bool direct_read(VirtioRequest* r, uint64_t offset){
+        size_t len = r->writable_size();
+        size_t aligned_len = direct_round_up(len);
+        BlkBounce* b = get_bounce(r->queue_idx, aligned_len);
+        if (!b) {
+            return false;
+        }
+        ssize_t n = pread(direct_fd, b->data, aligned_len, offset);
+        if (n < 0 && errno == EINVAL) {
+            n = pread(fd, b->data, len, offset);
+        }
+        bool ok = n >= (ssize_t)len;
+        if (ok) {
+            r->scatter(b->data, len);
+        }
+        put_bounce(r->queue_idx, b);
+        return ok;
+    }
+
+    bool direct_write(VirtioRequest* r, uint64_t offset){
+        size_t len = write_room(offset, r->readable_size());
+        BlkBounce* b = get_bounce(r->queue_idx, len);
+        if (!b) {
+            return false;
+        }
+        r->gather(b->data, len);
+        ssize_t n = -1;
+        if (direct_aligned(offset, len)) {
+            n = pwrite(direct_fd, b->data, len, offset);
+        }
+        if (n < 0) {
+            n = pwrite(fd, b->data, len, offset);
+            if (n >= 0 && fdatasync(fd) != 0) {
+                n = -1;
+            }
+        }
+        put_bounce(r->queue_idx, b);
+        return n == (ssize_t)len;
+    }
+
+    /*
+    Start req on the io_uring. With O_DIRECT the data goes through a bounce buffer
+    hung off req->device_data
+    */
+    void submit_request(VirtioRequest* r, uint32_t type, uint64_t offset){
+        BlkQueue& q = blk_queues[r->queue_idx];
+        if (type != VIRTIO_BLK_T_FLUSH && blk_options.cache != BlkCache::NONE && blk_options.max_merge_kb != 0) {
+            merge_request(q, r, type, offset);
             return;
         }
-        *device_id = VIRTIO_ID_BLOCK;
+        BlkBounce* b = nullptr;
+        size_t len = 0, aligned_len = 0;
+        if (type != VIRTIO_BLK_T_FLUSH && blk_options.cache == BlkCache::NONE) {
+            len = type == VIRTIO_BLK_T_IN ? r->writable_size() : write_room(offset, r->readable_size());
+            aligned_len = type == VIRTIO_BLK_T_IN ? direct_round_up(len) : len;
+            b = get_bounce(r->queue_idx, aligned_len);
+            if (!b) {
+                *r->status = VIRTIO_BLK_S_IOERR;
+                complete_request(r, 1);
+                return;
+            }
+        }
+        submit_pending(q);
+        struct io_uring_sqe* sqe = q.ring->get_sqe();
+        // queue_has_data stops us at queue_depth, so there's always room
+        assert(sqe != nullptr);
+        sqe->user_data = reinterpret_cast<uint64_t>(r);
+        sqe->fd = fd;
+        q.inflight++;
+        if (type == VIRTIO_BLK_T_FLUSH) {
+            // The writes it covers have all completed, so they're in the page cache already
+            if (dirty) {
+                dirty->drain([](uint64_t, uint64_t){});
+            }
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            return;
+        }
+        sqe->off = offset;
+        if (b) {
+            b->offset = offset;
+            r->device_data = b;
+            if (type == VIRTIO_BLK_T_OUT) {
+                r->gather(b->data, len);
+            }
+            if (direct_aligned(offset, aligned_len)) {
+                sqe->fd = direct_fd;
+            } else {
+                sqe->rw_flags = RWF_DSYNC;
+            }
+            sqe->opcode = type == VIRTIO_BLK_T_IN ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->addr = reinterpret_cast<uint64_t>(b->data);
+            sqe->len = aligned_len;
+            return;
+        }
+        std::vector<struct iovec>& iov = request_iov(r, type, offset);
+        prep_rw(sqe, type, offset, iov);
+    }
 
-        struct virtio_blk_config *device_config = reinterpret_cast<struct virtio_blk_config*>(mmio_base + VIRTIO_MMIO_CONFIG);
-        device_config->capacity = num_sectors;
+    // The guest buffers of a read/write, a write's cut off at the end of the image
+    std::vector<struct iovec>& request_iov(VirtioRequest* r, uint32_t type, uint64_t offset){
+        std::vector<struct iovec>& iov = type == VIRTIO_BLK_T_IN ? r->writable : r->readable;
+        if (type == VIRTIO_BLK_T_OUT) {
+            size_t room = write_room(offset, r->readable_size());
+            mark_dirty(offset, room);
+            size_t i = 0;
+            for (; i < iov.size() && room > 0; i++) {
+                iov[i].iov_len = std::min(iov[i].iov_len, room);
+                room -= iov[i].iov_len;
+            }
+            iov.resize(i);
+        }
+        return iov;
+    }
 
-        queue_header_size = sizeof(struct virtio_blk_outhdr);
+    void prep_rw(struct io_uring_sqe* sqe, uint32_t type, uint64_t offset, std::vector<struct iovec>& iov){
+        sqe->fd = fd;
+        sqe->off = offset;
+        if (type == VIRTIO_BLK_T_OUT && blk_options.cache == BlkCache::WRITETHROUGH) {
+            sqe->rw_flags = RWF_DSYNC;
+        }
+        sqe->opcode = type == VIRTIO_BLK_T_IN ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->addr = reinterpret_cast<uint64_t>(iov.data());
+        sqe->len = iov.size();
+    }
+
+    /*
+    Add a read/write to the queue's pending merge if it carries on where that one ends,
+    otherwise send the pending one off and start over with this one. The guest splits
+    big I/Os into a chain per few segments, this puts them back together
+    */
+    void merge_request(BlkQueue& q, VirtioRequest* r, uint32_t type, uint64_t offset){
+        std::vector<struct iovec>& iov = request_iov(r, type, offset);
+        uint64_t len = 0;
+        for (const struct iovec& v : iov) {
+            len += v.iov_len;
+        }
+        BlkMerge& m = q.pending;
+        if (!m.requests.empty() && (m.type != type || m.end != offset || m.iov.size() + iov.size() > IOV_MAX
+            || m.end - m.offset + len > (uint64_t)blk_options.max_merge_kb * 1024)) {
+            submit_pending(q);
+        }
+        if (m.requests.empty()) {
+            m.type = type;
+            m.offset = m.end = offset;
+        }
+        m.requests.push_back(r);
+        m.iov.insert(m.iov.end(), iov.begin(), iov.end());
+        m.end += len;
+        q.inflight++;
+    }
+
+    // Hand the pending merge to the ring, on its own if it's a single request
+    void submit_pending(BlkQueue& q){
+        BlkMerge& m = q.pending;
+        if (m.requests.empty()) {
+            return;
+        }
+        struct io_uring_sqe* sqe = q.ring->get_sqe();
+        assert(sqe != nullptr);
+        if (m.requests.size() == 1) {
+            VirtioRequest* r = m.requests[0];
+            sqe->user_data = reinterpret_cast<uint64_t>(r);
+            prep_rw(sqe, m.type, m.offset, m.type == VIRTIO_BLK_T_IN ? r->writable : r->readable);
+            m.requests.clear();
+            m.iov.clear();
+            return;
+        }
+        if (q.free_merges.empty()) {
+            q.merges.push_back(std::make_unique<BlkMerge>());
+            q.free_merges.push_back(q.merges.back().get());
+        }
+        BlkMerge* in_flight = q.free_merges.back();
+        q.free_merges.pop_back();
+        // Swap rather than copy, so both keep their vectors' capacity
+        std::swap(*in_flight, m);
+        q.merged_requests += in_flight->requests.size();
+        q.merged_ios++;
+        sqe->user_data = reinterpret_cast<uint64_t>(in_flight) | 1;
+        prep_rw(sqe, in_flight->type, in_flight->offset, in_flight->iov);
+    }
+
+    // A merged I/O came back, every request gets its share of the result
+    void finish_merge(BlkQueue& q, BlkMerge* m, int32_t res){
+        int64_t done = 0;
+        for (VirtioRequest* r : m->requests) {
+            int64_t len = m->type == VIRTIO_BLK_T_IN ? r->writable_size() : r->readable_size();
+            int32_t share = res < 0 ? res : std::clamp<int64_t>(res - done, 0, len);
+            done += len;
+            finish_request(r, share);
+        }
+        m->requests.clear();
+        m->iov.clear();
+        q.free_merges.push_back(m);
+    }
+
+    // Start reading ahead of the queue's sequential stream, if it has one
+    void readahead(uint32_t queue_idx, uint64_t offset, uint64_t len){
+        uint64_t start, ra_len;
+        if (blk_queues[queue_idx].readahead.access(offset, len, start, ra_len) && start < file_size) {
+            // Asynchronous, the kernel only queues up the reads into the page cache
+            posix_fadvise(fd, start, std::min(ra_len, file_size - start), POSIX_FADV_WILLNEED);
+        }
     }
 
-    void process_queue_start(int queue_idx, uint8_t* addr, uint64_t len) override {
-        assert(queue_idx==0);
-        req = (struct virtio_blk_outhdr*)addr;
+    // Merge and readahead stats for --poll-stats
+    void report_io(const std::string& name){
+        uint64_t merged_requests = 0, merged_ios = 0, sequential = 0, hits = 0, windows = 0, bytes = 0;
+        for (BlkQueue& q : blk_queues) {
+            merged_requests += q.merged_requests;
+            merged_ios += q.merged_ios;
+            sequential += q.readahead.sequential;
+            hits += q.readahead.hits;
+            windows += q.readahead.windows;
+            bytes += q.readahead.bytes;
+        }
+        printf("%s: %lu requests merged into %lu I/Os, %lu sequential reads (%.1f%% read ahead), %lu readahead windows %.1f MB\n",
+            name.c_str(), merged_requests, merged_ios, sequential, sequential ? 100.0 * hits / sequential : 0.0, windows, bytes / 1e6);
+    }
+
+    // A read/write/flush came back from the io_uring
+    void finish_request(VirtioRequest* r, int32_t res){
+        blk_queues[r->queue_idx].inflight--;
+        BlkBounce* b = static_cast<BlkBounce*>(r->device_data);
+        bool is_read = !r->writable.empty();
+        if (b && res == -EINVAL) {
+            // The filesystem wants bigger alignment than a sector for O_DIRECT, go around the page cache
+            if (is_read) {
+                res = pread(fd, b->data, r->writable_size(), b->offset);
+            } else {
+                size_t len = write_room(b->offset, r->readable_size());
+                res = pwrite(fd, b->data, len, b->offset) == (ssize_t)len && fdatasync(fd) == 0 ? len : -EIO;
+            }
+        }
+        uint8_t status = VIRTIO_BLK_S_OK;
+        uint32_t written = 0;
+        size_t want = is_read ? r->writable_size() : b ? write_room(b->offset, r->readable_size()) : r->readable_size();
+        if (res < 0 || (size_t)res < want) {
+            status = VIRTIO_BLK_S_IOERR;
+        } else if (is_read) {
+            if (b) {
+                r->scatter(b->data, want);
+            }
+            written = want;
+        }
+        if (b) {
+            put_bounce(r->queue_idx, b);
+            r->device_data = nullptr;
+        }
+        *r->status = status;
+        complete_request(r, written + 1);
+    }
+
+    uint32_t poll_completions(uint32_t queue_idx) override {
+        if (!use_uring()) {
+            return 0;
+        }
+        // Everything process_request queued up this pass goes to the kernel in one syscall
+        BlkQueue& q = blk_queues[queue_idx];
+        submit_pending(q);
+        q.ring->submit();
+        return q.ring->reap([this, &q](const struct io_uring_cqe& cqe){
+            if (cqe.user_data & 1) {
+                finish_merge(q, reinterpret_cast<BlkMerge*>(cqe.user_data & ~1ULL), cqe.res);
+            } else {
+                finish_request(reinterpret_cast<VirtioRequest*>(cqe.user_data), cqe.res);
+            }
+        });
+    }
+
+    int wait_fd(uint32_t queue_idx) override {
+        return use_uring() ? blk_queues[queue_idx].ring->get_event_fd() : -1;
     }
 
-    void process_queue_data(int queue_idx, uint8_t* addr, uint64_t len) override {
+    void process_request(VirtioRequest* r) override {
         /*
         FIXME: x280 side driver seems to use some kind of in memory cache 
         and coalesces writes. write speeds are abnormally high when cache is used and
@@ -110,30 +897,92 @@ public:
         Similarly, wget's from host to x280 may show abnormal speeds while the cache is in use
         */
 
-        // Only one queue, so queue_idx is always 0
-        assert(queue_idx==0);
+        struct virtio_blk_outhdr req;
+        if (!r->status || r->read_header(&req, sizeof(req)) != sizeof(req)) {
+            printf("Malformed block request: %zu byte header, %s status\n", r->header_size(), r->status ? "with" : "no");
+            complete_request(r, 0);
+            return;
+        }
 
-        // Use req->type to determine read/write
-        switch (req->type) {
+        uint8_t status = VIRTIO_BLK_S_OK;
+        uint32_t written = 0;
+        size_t data_size = req.type == VIRTIO_BLK_T_IN ? r->writable_size() : r->readable_size();
+        // Before working out the offset, a huge sector would wrap it round back into range
+        bool in_range = req.sector < num_sectors && data_size <= (num_sectors - req.sector) * sector_size;
+        uint64_t offset = in_range ? sector_size * req.sector : 0;
+        const uint64_t start_offset = offset;
+        if (req.type == VIRTIO_BLK_T_IN && in_range && !backend && blk_options.cache != BlkCache::NONE) {
+            readahead(r->queue_idx, offset, data_size);
+        }
+        if (use_uring() && (((req.type == VIRTIO_BLK_T_IN || req.type == VIRTIO_BLK_T_OUT) && data_size > 0 && in_range)
+            || (req.type == VIRTIO_BLK_T_FLUSH && blk_options.cache != BlkCache::WRITETHROUGH))) {
+            submit_request(r, req.type, offset);
+            return;
+        }
+        // Data segments follow each other on disk
+        switch (req.type) {
             case VIRTIO_BLK_T_IN:
-                memcpy(addr, mapped_data + ((sector_size * req->sector)), len);
+                if (!in_range) {
+                    status = VIRTIO_BLK_S_IOERR;
+                    break;
+                }
+                if (backend || blk_options.cache == BlkCache::NONE || !mapped_data) {
+                    bool ok = backend ? backend_read(r, offset)
+                        : blk_options.cache == BlkCache::NONE ? direct_read(r, offset) : pread_request(r, req.type, offset);
+                    status = ok ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+                    written = r->writable_size();
+                    break;
+                }
+                for (struct iovec& v : r->writable) {
+                    memcpy(v.iov_base, mapped_data + offset, v.iov_len);
+                    offset += v.iov_len;
+                    written += v.iov_len;
+                }
                 break;
             case VIRTIO_BLK_T_OUT:
-                memcpy(mapped_data + ((sector_size * req->sector)), addr, len);
+                if (!in_range) {
+                    status = VIRTIO_BLK_S_IOERR;
+                    break;
+                }
+                if (backend || blk_options.cache == BlkCache::NONE || !mapped_data) {
+                    bool ok = backend ? backend_write(r, offset)
+                        : blk_options.cache == BlkCache::NONE ? direct_write(r, offset) : pread_request(r, req.type, offset);
+                    status = ok ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+                    break;
+                }
+                for (struct iovec& v : r->readable) {
+                    memcpy(mapped_data + offset, v.iov_base, v.iov_len);
+                    offset += v.iov_len;
+                }
+                // Only once the data is in, a flush or writeback draining the range earlier would miss it
+                mark_dirty(start_offset, write_room(start_offset, data_size));
+                if (blk_options.cache == BlkCache::WRITETHROUGH) {
+                    // msync wants a page aligned start
+                    uint64_t start = start_offset & ~4095ULL;
+                    uint64_t end = start_offset + write_room(start_offset, data_size);
+                    if (end > start && msync(mapped_data + start, end - start, MS_SYNC) != 0) {
+                        status = VIRTIO_BLK_S_IOERR;
+                    }
+                }
+                break;
+            case VIRTIO_BLK_T_FLUSH:
+                status = flush() ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+                break;
+            case VIRTIO_BLK_T_DISCARD:
+            case VIRTIO_BLK_T_WRITE_ZEROES:
+                status = discard(r, req.type);
                 break;
             default:
-                printf("Unimplemented Request Type: %d Len: %lu\n", req->type, len);
+                printf("Unimplemented Request Type: %d Len: %zu\n", req.type, r->readable_size() + r->writable_size());
+                status = VIRTIO_BLK_S_UNSUPP;
         }
+        *r->status = status;
+        complete_request(r, written + 1);
     }
 
-    void process_queue_complete(int queue_idx, uint8_t* addr, uint64_t len) override {
-        assert(queue_idx==0);
-        // For block device, set status byte to 0 (success)
-        *addr = 0;
-    }
-
+    // Don't take more requests off the ring than io_uring can have in flight
     inline bool queue_has_data(int queue_idx){
-        return true;
+        return !use_uring() || blk_queues[queue_idx].inflight < blk_options.queue_depth;
     }
 
 };
@@ -0,0 +1,77 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+Helpers for reading the L2CPU's DRAM through the BAR.
+
+The DRAM is mapped write-combining. Writes get merged into bursts for free, but
+reads are uncached: every load the CPU issues becomes a PCIe read that has to
+go all the way to the chip and back. Reading a ring one field at a time costs
+one round trip per field.
+
+copy_from_guest uses SSE4.1 streaming loads (movntdqa), which on WC memory pull
+a whole 64 byte line per PCIe read, so a bulk copy costs one round trip per line
+*/
+
+static constexpr size_t GUEST_LINE = 64;
+
+// Number of lines (i.e. PCIe reads with streaming loads) a copy of n bytes at src touches
+static inline uint64_t guest_lines(const void* src, size_t n){
+    if (n == 0) {
+        return 0;
+    }
+    uintptr_t a = reinterpret_cast<uintptr_t>(src);
+    return (a + n - 1) / GUEST_LINE - a / GUEST_LINE + 1;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.1")))
+static inline void stream_copy(void* dst, const void* src, size_t n){
+    uint8_t* d = static_cast<uint8_t*>(dst);
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    // movntdqa needs 16 byte aligned sources, do the unaligned head the normal way
+    size_t head = (16 - (reinterpret_cast<uintptr_t>(s) & 15)) & 15;
+    if (head > n) {
+        head = n;
+    }
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    // Issue a whole line's worth of loads back to back so they're served by one read
+    for (; n >= 64; n -= 64, s += 64, d += 64) {
+        __m128i a = _mm_stream_load_si128((__m128i*)(s));
+        __m128i b = _mm_stream_load_si128((__m128i*)(s + 16));
+        __m128i c = _mm_stream_load_si128((__m128i*)(s + 32));
+        __m128i e = _mm_stream_load_si128((__m128i*)(s + 48));
+        _mm_storeu_si128((__m128i*)(d), a);
+        _mm_storeu_si128((__m128i*)(d + 16), b);
+        _mm_storeu_si128((__m128i*)(d + 32), c);
+        _mm_storeu_si128((__m128i*)(d + 48), e);
+    }
+    for (; n >= 16; n -= 16, s += 16, d += 16) {
+        _mm_storeu_si128((__m128i*)(d), _mm_stream_load_si128((__m128i*)(s)));
+    }
+    memcpy(d, s, n);
+}
+#endif
+
+static inline void copy_from_guest(void* dst, const void* src, size_t n){
+#if defined(__x86_64__)
+    static const bool have_sse41 = __builtin_cpu_supports("sse4.1");
+    if (have_sse41) {
+        stream_copy(dst, src, n);
+        return;
+    }
+#endif
+    memcpy(dst, src, n);
+}
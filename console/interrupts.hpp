@@ -0,0 +1,262 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "l2cpu.h"
+#include "poller.hpp"
+
+/*
+Interrupt coalescing thresholds for one device, same idea as ethtool's rx-usecs/rx-frames.
+An interrupt goes out as soon as either threshold is hit. The defaults (0us, 1 frame)
+raise one as soon as the device asks for it
+*/
+struct CoalesceOptions {
+    // Hold an interrupt back for at most this long after the first completion it covers
+    uint32_t usecs = 0;
+    // Or until this many completions (chains put on the used ring) are waiting for it
+    uint32_t frames = 1;
+};
+
+/*
+Owns the L2CPU's interrupt register (0x2FF10404) and is the only thing that writes it.
+
+Devices post() their completions from their own threads without taking any lock:
+every device has a mailbox (pending completion count + time of the oldest one)
+that it adds to with atomics, and the dispatcher thread (run()) empties the
+mailboxes and pulses the PLIC once a device's coalescing thresholds are hit.
+Mailboxes never fill up, however far behind the dispatcher gets, and everything
+that piled up in one goes out as a single interrupt.
+
+Before this every device pulsed the register itself under one global mutex.
+*/
+class InterruptDispatcher {
+public:
+    static constexpr int MAX_SOURCES = 8;
+
+private:
+    struct Source {
+        int interrupt_number = 0;
+        std::atomic<uint32_t> usecs{0};
+        std::atomic<uint32_t> frames{1};
+        // Mailbox
+        std::atomic<uint32_t> pending{0};
+        std::atomic<uint64_t> first_ns{0};
+        // Written by the dispatcher thread only
+        std::atomic<uint64_t> completions{0};
+        std::atomic<uint64_t> interrupts{0};
+    };
+
+    // Keep the L2CPU and the TLB window behind interrupt_register alive (null in benchmarks)
+    std::shared_ptr<L2CPU> l2cpu;
+    std::unique_ptr<TlbWindow2M> window;
+    volatile uint32_t* interrupt_register;
+
+    Source sources[MAX_SOURCES];
+    std::atomic<int> num_sources{0};
+    std::mutex add_source_lock;
+
+    // Wakes the dispatcher up from a sleep when a post comes in
+    int event_fd = -1;
+    std::atomic<bool> asleep{false};
+    uint64_t start_ns = 0, stop_ns = 0;
+
+    static uint64_t now_ns(){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    inline void fire(Source& s){
+        uint32_t n = s.pending.exchange(0, std::memory_order_acq_rel);
+        s.first_ns.store(0, std::memory_order_relaxed);
+        /*
+        FIXME: setting multiple interrupts on the plic seems to be buggy
+        so every device gets its own pulse, even when several are due together
+        */
+        *interrupt_register = (1 << (s.interrupt_number - 5));
+        __sync_synchronize();
+        *interrupt_register = 0;
+        s.completions.fetch_add(n, std::memory_order_relaxed);
+        s.interrupts.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Sleep until a post wakes us up or timeout_ns is up
+    void sleep_for_post(uint64_t timeout_ns){
+        struct pollfd pfd = {event_fd, POLLIN, 0};
+        struct timespec ts;
+        ts.tv_sec = timeout_ns / 1000000000ULL;
+        ts.tv_nsec = timeout_ns % 1000000000ULL;
+        ppoll(&pfd, 1, &ts, NULL);
+    }
+
+public:
+    Poller poller;
+
+    explicit InterruptDispatcher(uint32_t* interrupt_register_)
+        : interrupt_register(interrupt_register_) {
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    static std::unique_ptr<InterruptDispatcher> for_l2cpu(int ttdevice, int l2cpu_idx){
+        auto l2cpu = L2CPU::get(l2cpu_idx, ttdevice);
+        // TODO: Check if (interrupt_number-5) is in valid
+        // range, and adjust which register to use accordingly
+        uint64_t interrupt_address = 0x2FF10000 + 0x404;
+        auto window = l2cpu->get_persistent_2M_tlb_window(interrupt_address);
+        auto dispatcher = std::make_unique<InterruptDispatcher>(reinterpret_cast<uint32_t*>(window->get_window()));
+        dispatcher->l2cpu = std::move(l2cpu);
+        dispatcher->window = std::move(window);
+        return dispatcher;
+    }
+
+    ~InterruptDispatcher(){
+        if (event_fd >= 0) {
+            close(event_fd);
+        }
+    }
+
+    /*
+    Get the mailbox for an interrupt number, the same one every time so devices that
+    reconnect keep their counters. Returns -1 if we're out of mailboxes
+    */
+    int add_source(int interrupt_number, const CoalesceOptions& coalesce){
+        std::lock_guard<std::mutex> guard(add_source_lock);
+        int n = num_sources.load(std::memory_order_relaxed);
+        int i = 0;
+        while (i < n && sources[i].interrupt_number != interrupt_number) {
+            i++;
+        }
+        if (i == MAX_SOURCES) {
+            return -1;
+        }
+        sources[i].usecs = coalesce.usecs;
+        sources[i].frames = coalesce.frames ? coalesce.frames : 1;
+        if (i == n) {
+            sources[i].interrupt_number = interrupt_number;
+            // The dispatcher only looks at sources below num_sources, publish this one once it's set up
+            num_sources.store(n + 1, std::memory_order_release);
+        }
+        return i;
+    }
+
+    /*
+    Ask for an interrupt covering `completions` newly used chains. Lock free, can be
+    called from any thread
+    */
+    inline void post(int source, uint32_t completions){
+        Source& s = sources[source];
+        uint64_t expected = 0;
+        s.first_ns.compare_exchange_strong(expected, now_ns(), std::memory_order_relaxed);
+        s.pending.fetch_add(completions ? completions : 1, std::memory_order_seq_cst);
+        if (asleep.load(std::memory_order_seq_cst)) {
+            uint64_t one = 1;
+            ssize_t r = write(event_fd, &one, sizeof(one));
+            (void)r;
+        }
+    }
+
+    // Dispatcher thread body, returns once exit_flag is set
+    void run(std::atomic<bool>& exit_flag, const PollOptions& poll_options){
+        poller.start(poll_options);
+        start_ns = now_ns();
+        while (!exit_flag) {
+            bool fired = false, waiting = false;
+            // When the first interrupt being held back is due
+            uint64_t deadline = UINT64_MAX;
+            // What each mailbox had when we looked, to catch posts that come in before we sleep
+            uint32_t seen[MAX_SOURCES] = {};
+            uint64_t now = now_ns();
+            int n = num_sources.load(std::memory_order_acquire);
+            for (int i = 0; i < n; i++) {
+                Source& s = sources[i];
+                uint32_t pending = s.pending.load(std::memory_order_acquire);
+                seen[i] = pending;
+                if (pending == 0) {
+                    continue;
+                }
+                /*
+                A post that raced with the previous fire can leave completions behind with
+                no timestamp, start their clock now
+                */
+                uint64_t first = s.first_ns.load(std::memory_order_relaxed);
+                if (first == 0) {
+                    // If a post beats us to it, first picks up its time instead
+                    s.first_ns.compare_exchange_strong(first, now, std::memory_order_relaxed);
+                    if (first == 0) {
+                        first = now;
+                    }
+                }
+                uint64_t due = first + s.usecs.load(std::memory_order_relaxed) * 1000ULL;
+                if (pending >= s.frames.load(std::memory_order_relaxed) || now >= due) {
+                    fire(s);
+                    fired = true;
+                } else {
+                    waiting = true;
+                    deadline = std::min(deadline, due);
+                }
+            }
+            if (fired) {
+                poller.wait(true);
+                continue;
+            }
+
+            /*
+            Nothing due yet. Let posts know they need to wake us, then check once more
+            before sleeping: until the first held back interrupt is due if there is one,
+            for as long as the poller likes otherwise
+            */
+            asleep.store(true, std::memory_order_seq_cst);
+            bool posted = false;
+            for (int i = 0; i < n; i++) {
+                posted |= sources[i].pending.load(std::memory_order_seq_cst) != seen[i];
+            }
+            if (!posted) {
+                if (waiting) {
+                    sleep_for_post(deadline - now);
+                } else {
+                    poller.wait(false, event_fd);
+                }
+            }
+            asleep.store(false, std::memory_order_relaxed);
+            uint64_t count;
+            while (read(event_fd, &count, sizeof(count)) > 0) {
+            }
+        }
+        stop_ns = now_ns();
+        poller.stop();
+    }
+
+    uint64_t interrupts(int source){
+        return sources[source].interrupts.load(std::memory_order_relaxed);
+    }
+
+    uint64_t completions(int source){
+        return sources[source].completions.load(std::memory_order_relaxed);
+    }
+
+    // Interrupt rate per device since run() started
+    void report(){
+        double seconds = ((stop_ns ? stop_ns : now_ns()) - start_ns) / 1e9;
+        int n = num_sources.load(std::memory_order_acquire);
+        for (int i = 0; i < n; i++) {
+            Source& s = sources[i];
+            uint64_t irqs = s.interrupts.load(), done = s.completions.load();
+            printf("irq %d: %lu interrupts (%.0f/s), %.1f completions per interrupt, coalescing %uus/%u frames\n",
+                s.interrupt_number, irqs, seconds > 0 ? irqs / seconds : 0.0, irqs ? (double)done / irqs : 0.0,
+                s.usecs.load(), s.frames.load());
+        }
+    }
+};
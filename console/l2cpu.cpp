@@ -43,14 +43,42 @@ const std::map<int, uint64_t> l2cpu_memory_size_mapping {
     {3, 0x8000'0000ULL},
 };
 
-L2CPU::L2CPU(int idx, int card_idx)
-    : idx(idx), card_idx(card_idx)
+std::mutex Card::cards_lock;
+std::map<int, std::weak_ptr<Card>> Card::cards;
+
+Card::Card(int idx)
+    : idx(idx)
 {
-    assert(idx >=0 && idx < 4);
     std::stringstream chardev_string;
-    chardev_string<<"/dev/tenstorrent/"<<card_idx;
+    chardev_string<<"/dev/tenstorrent/"<<idx;
     fd = open(chardev_string.str().c_str(), O_RDWR | O_CLOEXEC);
     set_frequency();
+}
+
+std::shared_ptr<Card> Card::get(int idx){
+    std::lock_guard<std::mutex> guard(cards_lock);
+    std::shared_ptr<Card> card = cards[idx].lock();
+    if (!card) {
+        card = std::make_shared<Card>(idx);
+        cards[idx] = card;
+    }
+    return card;
+}
+
+int Card::get_fd(){
+    return fd;
+}
+
+Card::~Card() noexcept
+{
+    close(fd);
+}
+
+L2CPU::L2CPU(int idx, int card_idx)
+    : card(Card::get(card_idx)), idx(idx), card_idx(card_idx)
+{
+    assert(idx >=0 && idx < 4);
+    fd = card->get_fd();
     starting_address = l2cpu_starting_address_mapping.at(idx);
     coordinates = l2cpu_tile_mapping.at(idx);
     memory_size = l2cpu_memory_size_mapping.at(idx);
@@ -61,6 +89,19 @@ L2CPU::L2CPU(int idx, int card_idx)
     second = std::make_unique<TlbWindow4G>(fd, coordinates.x, coordinates.y, 0x4001'0000'0000ULL, memory+(1ULL<<32), true);
 }
 
+std::shared_ptr<L2CPU> L2CPU::get(int idx, int card_idx){
+    static std::mutex l2cpus_lock;
+    static std::map<std::pair<int, int>, std::weak_ptr<L2CPU>> l2cpus;
+    std::lock_guard<std::mutex> guard(l2cpus_lock);
+    std::weak_ptr<L2CPU>& slot = l2cpus[{card_idx, idx}];
+    std::shared_ptr<L2CPU> l2cpu = slot.lock();
+    if (!l2cpu) {
+        l2cpu = std::make_shared<L2CPU>(idx, card_idx);
+        slot = l2cpu;
+    }
+    return l2cpu;
+}
+
 uint64_t L2CPU::get_starting_address(){
   return starting_address;
 }
@@ -101,7 +142,12 @@ uint8_t* L2CPU::get_memory_ptr(){
     return memory+(starting_address-0x4000'0000'0000ULL);
 }
 
+// The PLL is per card, Card has already done this when it was opened
 void L2CPU::set_frequency(){
+  card->set_frequency();
+}
+
+void Card::set_frequency(){
   const uint64_t PLL4_BASE = 0x80020500;
   const uint64_t PLL_CNTL_1 = 0x4;
   const uint64_t PLL_CNTL_5 = 0x14;
@@ -176,7 +222,9 @@ void L2CPU::set_frequency(){
 
 L2CPU::~L2CPU() noexcept
 {
+    // Windows go before the card's fd they were allocated on
+    first.reset();
+    second.reset();
     munmap(memory, 2ULL<<32);
-    close(fd);
 }
 
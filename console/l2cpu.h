@@ -6,12 +6,39 @@
 #include <vector>
 #include <memory>
 #include <map>
+#include <mutex>
 
 #include "ioctl.h"
 #include "tlb.h"
 
+/*
+One open /dev/tenstorrent/N. Every L2CPU on the card shares it, and the clock
+is set up once when the card is first opened rather than once per L2CPU
+*/
+class Card
+{
+    int fd;
+    int idx;
+
+    static std::mutex cards_lock;
+    static std::map<int, std::weak_ptr<Card>> cards;
+
+public:
+    Card(int idx);
+
+    // The card's context if something still holds it, otherwise a freshly opened one
+    static std::shared_ptr<Card> get(int idx);
+
+    int get_fd();
+
+    void set_frequency();
+
+    ~Card() noexcept;
+};
+
 class L2CPU
 {
+    std::shared_ptr<Card> card;
     int fd;
 
     int idx;
@@ -28,6 +55,12 @@ class L2CPU
 public:
     L2CPU(int idx, int card_idx=0);
 
+    /*
+    Shared L2CPU context, so all the devices on one L2CPU use the same 4G windows.
+    Lives as long as somebody holds it, devices that reconnect get the same one back
+    */
+    static std::shared_ptr<L2CPU> get(int idx, int card_idx=0);
+
     uint64_t get_starting_address();
     uint64_t get_memory_size();
 
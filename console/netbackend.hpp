@@ -0,0 +1,66 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+Where a VirtioNet's packets come from and go to: slirp, a TAP device, a raw socket
+on a host NIC... Picked with --net, opened once and kept across guest reboots.
+
+VirtioNet hands backends iovecs pointing straight at the guest's buffers. rx calls
+come from the first rx queue's thread and tx calls from every tx queue's, which can be
+several threads at once (--queue-workers, --net-queues)
+*/
+class NetBackend {
+public:
+    virtual ~NetBackend() = default;
+
+    /*
+    Length of the next packet for the guest, without taking it, or -1 if none is
+    waiting. Backends that can't tell without reading it return max_packet() whenever
+    one might be waiting, VirtioNet then has room for anything when it calls receive()
+    */
+    virtual ssize_t next_packet() = 0;
+
+    // Longest packet we can get, ethernet header included
+    virtual size_t max_packet() = 0;
+
+    // Take the next packet into iov: its full length (more than fits in iov if it got cut short) or -errno, -EAGAIN if there wasn't one
+    virtual ssize_t receive(const struct iovec* iov, int iovcnt) = 0;
+
+    // Send one packet from the guest, 0 or -errno
+    virtual int transmit(const struct iovec* iov, int iovcnt) = 0;
+
+    // Readable when there are packets for the guest, the poller sleeps on it
+    virtual int fd() = 0;
+
+    /*
+    Packets carry a virtio-net header (struct virtio_net_hdr_mrg_rxbuf, num_buffers
+    left alone) in front of them both ways, and the backend does the checksums and
+    segmentation it asks for itself (TAP, in the kernel)
+    */
+    virtual bool vnet_hdr() { return false; }
+
+    // Offloads the guest accepted, for vnet_hdr() backends to know what they may hand it
+    virtual void set_offloads(bool csum, bool tso4, bool tso6, bool ecn) {}
+
+    /*
+    Backends that can also look at the start of the next packet without taking it,
+    which is what software GRO works from. peek() is next_packet() that also copies
+    up to len bytes of the packet to head
+    */
+    virtual bool peeks() { return false; }
+    virtual ssize_t peek(uint8_t* head, size_t len) { return -1; }
+
+    // One line of stats for --poll-stats
+    virtual void report(const std::string& name) {}
+
+    // Bytes that went through a host buffer on their way to / from the guest
+    std::atomic<uint64_t> rx_copied{0}, tx_copied{0};
+};
@@ -0,0 +1,348 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+extern "C" {
+#define class __class_compat // Rename 'class' to avoid C++ keyword conflict
+#include <linux/virtio_net.h>
+#undef class
+}
+
+#include "netbackend.hpp"
+#include "virtiorequest.hpp"
+
+/*
+Checksum and segmentation offloads done on the host for backends that only take
+plain ethernet frames (slirp, AF_PACKET), so the X280s can hand over 64K TCP
+super-frames with the checksum left to us, and get them back the same way.
+*/
+
+/*
+Internet checksum (RFC 1071) of data in pieces. Sums 32 bits at a time into four
+64 bit accumulators, which the compiler turns into vector adds, and folds once at the
+end. Pieces can be any length, one starting at an odd offset is byte swapped in
+*/
+struct Checksum {
+    uint64_t sum = 0;
+    bool odd = false;
+
+    static uint64_t sum_bytes(const uint8_t* p, size_t n){
+        uint64_t a = 0, b = 0, c = 0, d = 0;
+        for (; n >= 16; p += 16, n -= 16) {
+            uint32_t w[4];
+            memcpy(w, p, sizeof(w));
+            a += w[0];
+            b += w[1];
+            c += w[2];
+            d += w[3];
+        }
+        uint64_t s = a + b + c + d;
+        for (; n >= 2; p += 2, n -= 2) {
+            uint16_t h;
+            memcpy(&h, p, 2);
+            s += h;
+        }
+        if (n) {
+            uint16_t h = 0;
+            memcpy(&h, p, 1);
+            s += h;
+        }
+        return s;
+    }
+
+    static uint16_t fold64(uint64_t s){
+        while (s >> 16) {
+            s = (s & 0xffff) + (s >> 16);
+        }
+        return s;
+    }
+
+    void add(const void* p, size_t n){
+        uint16_t s = fold64(sum_bytes(static_cast<const uint8_t*>(p), n));
+        sum += odd ? (uint16_t)((s << 8) | (s >> 8)) : s;
+        odd ^= n & 1;
+    }
+
+    // Folded sum, what goes in the field for a partial (pseudo header) checksum
+    uint16_t partial() const { return fold64(sum); }
+    // What goes in the field for a finished one
+    uint16_t finish() const { return ~partial(); }
+};
+
+/*
+Where the headers of an ethernet frame carrying TCP or UDP over IPv4 or IPv6 are.
+Only what the Linux stack hands virtio-net: an optional VLAN tag, no IPv6 extension
+headers, no IP options on the TCP/UDP path
+*/
+struct FrameHeaders {
+    size_t l3 = 0, l4 = 0, end = 0;
+    bool ipv6 = false;
+    uint8_t proto = 0;
+
+    bool parse(const uint8_t* p, size_t len){
+        if (len < 14) {
+            return false;
+        }
+        l3 = 14;
+        uint16_t type = p[12] << 8 | p[13];
+        if (type == 0x8100 && len >= 18) {
+            type = p[16] << 8 | p[17];
+            l3 = 18;
+        }
+        if (type == 0x0800 && len >= l3 + 20 && (p[l3] >> 4) == 4) {
+            ipv6 = false;
+            l4 = l3 + (p[l3] & 0xf) * 4;
+            proto = p[l3 + 9];
+        } else if (type == 0x86dd && len >= l3 + 40) {
+            ipv6 = true;
+            l4 = l3 + 40;
+            proto = p[l3 + 6];
+        } else {
+            return false;
+        }
+        if (proto == IPPROTO_TCP && len >= l4 + 20) {
+            end = l4 + (p[l4 + 12] >> 4) * 4;
+        } else if (proto == IPPROTO_UDP) {
+            end = l4 + 8;
+        } else {
+            return false;
+        }
+        return end <= len;
+    }
+
+    // Sum of the TCP/UDP pseudo header for l4_len bytes of transport header and payload
+    void pseudo_header(Checksum& c, const uint8_t* p, size_t l4_len) const {
+        if (ipv6) {
+            c.add(p + l3 + 8, 32);
+            uint32_t words[2] = {htonl(l4_len), htonl(proto)};
+            c.add(words, sizeof(words));
+        } else {
+            c.add(p + l3 + 12, 8);
+            uint16_t words[2] = {htons(proto), htons(l4_len)};
+            c.add(words, sizeof(words));
+        }
+    }
+
+    // Set the IP length fields for l4_len bytes after the IP header, and redo the IPv4 header checksum
+    void set_ip_length(uint8_t* p, size_t l4_len) const {
+        if (ipv6) {
+            uint16_t n = htons(l4_len);
+            memcpy(p + l3 + 4, &n, 2);
+            return;
+        }
+        uint16_t n = htons(l4 - l3 + l4_len);
+        memcpy(p + l3 + 2, &n, 2);
+        memset(p + l3 + 10, 0, 2);
+        Checksum c;
+        c.add(p + l3, l4 - l3);
+        uint16_t check = c.finish();
+        memcpy(p + l3 + 10, &check, 2);
+    }
+};
+
+/*
+Sends guest frames that left their checksum (VIRTIO_NET_F_CSUM) or segmentation
+(VIRTIO_NET_F_HOST_TSO4/6) to us through a backend that can't take them as they are.
+
+The frame is copied out of guest memory once into frame and everything is worked
+out from there: the checksums have to read every byte anyway, and reading the BAR
+once here beats reading it again in the kernel's copy. Segments go out as their own
+headers followed by a slice of that copy
+*/
+class SoftOffload {
+public:
+    // Longest frame we take from the guest, a 64K GSO frame and its headers
+    static constexpr size_t MAX_FRAME = 65536 + 256;
+
+    struct Stats {
+        uint64_t checksummed = 0, segmented = 0, segments = 0, dropped = 0;
+    } stats;
+
+private:
+    std::vector<uint8_t> frame = std::vector<uint8_t>(MAX_FRAME);
+    uint8_t head[256];
+    std::vector<struct iovec> iov;
+
+    int send(NetBackend& backend, uint8_t* hdrs, size_t hdrs_len, const uint8_t* data, size_t data_len){
+        iov.clear();
+        iov.push_back({hdrs, hdrs_len});
+        if (data_len) {
+            iov.push_back({const_cast<uint8_t*>(data), data_len});
+        }
+        backend.tx_copied += hdrs_len + data_len;
+        return backend.transmit(iov.data(), iov.size());
+    }
+
+    /*
+    Cut a TCP frame into segments of hdr.gso_size. Every segment gets a copy of the
+    headers with its own lengths, IPv4 id and sequence number; FIN and PSH only go on
+    the last one, CWR only on the first, and every TCP checksum is done here
+    */
+    int segment_tcp(NetBackend& backend, const struct virtio_net_hdr& hdr, const FrameHeaders& h, size_t len){
+        size_t mss = hdr.gso_size;
+        size_t payload = len - h.end;
+        if (mss == 0 || h.end > sizeof(head)) {
+            return -EINVAL;
+        }
+        memcpy(head, frame.data(), h.end);
+        uint8_t* tcp = head + h.l4;
+        uint32_t seq;
+        memcpy(&seq, tcp + 4, 4);
+        seq = ntohl(seq);
+        uint8_t flags = tcp[13];
+        uint16_t id = 0;
+        if (!h.ipv6) {
+            memcpy(&id, head + h.l3 + 4, 2);
+            id = ntohs(id);
+        }
+        stats.segmented++;
+        int ret = 0;
+        for (size_t off = 0, i = 0; off < payload || i == 0; off += mss, i++) {
+            size_t n = std::min(mss, payload - off);
+            bool last = off + n >= payload;
+            uint32_t s = htonl(seq + off);
+            memcpy(tcp + 4, &s, 4);
+            // Flags: CWR (0x80) on the first segment only, FIN (0x01) and PSH (0x08) on the last only
+            tcp[13] = flags & ~(i ? 0x80 : 0) & ~(last ? 0 : 0x09);
+            if (!h.ipv6) {
+                uint16_t seg_id = htons(id + i);
+                memcpy(head + h.l3 + 4, &seg_id, 2);
+            }
+            size_t l4_len = h.end - h.l4 + n;
+            h.set_ip_length(head, l4_len);
+            memset(tcp + 16, 0, 2);
+            Checksum c;
+            h.pseudo_header(c, head, l4_len);
+            c.add(tcp, h.end - h.l4);
+            c.add(frame.data() + h.end + off, n);
+            uint16_t check = c.finish();
+            memcpy(tcp + 16, &check, 2);
+            int r = send(backend, head, h.end, frame.data() + h.end + off, n);
+            if (r < 0) {
+                ret = r;
+            }
+            stats.segments++;
+        }
+        return ret;
+    }
+
+public:
+    // Send the frame in readable the way hdr asks, 0 or -errno
+    int transmit(NetBackend& backend, const struct virtio_net_hdr& hdr, const std::vector<struct iovec>& readable){
+        size_t len = VirtioRequest::iov_size(readable);
+        if (len > MAX_FRAME) {
+            stats.dropped++;
+            return -EMSGSIZE;
+        }
+        VirtioRequest::iov_to_buf(readable, frame.data(), len);
+
+        uint8_t gso = hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+        if (gso == VIRTIO_NET_HDR_GSO_TCPV4 || gso == VIRTIO_NET_HDR_GSO_TCPV6) {
+            FrameHeaders h;
+            if (!h.parse(frame.data(), len) || h.proto != IPPROTO_TCP || h.ipv6 != (gso == VIRTIO_NET_HDR_GSO_TCPV6)) {
+                stats.dropped++;
+                return -EINVAL;
+            }
+            return segment_tcp(backend, hdr, h, len);
+        }
+        if (gso != VIRTIO_NET_HDR_GSO_NONE) {
+            // UFO only goes to backends that do it themselves
+            stats.dropped++;
+            return -EINVAL;
+        }
+
+        /*
+        The checksum covers csum_start to the end, starting from the pseudo header sum
+        the guest left in the field, and goes at csum_start + csum_offset
+        */
+        size_t start = hdr.csum_start, at = hdr.csum_start + hdr.csum_offset;
+        if ((hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && start <= len && at + 2 <= len) {
+            Checksum c;
+            c.add(frame.data() + start, len - start);
+            uint16_t check = c.finish();
+            // A UDP checksum that comes out as 0 is sent as ffff, 0 means none
+            if (check == 0) {
+                check = 0xffff;
+            }
+            memcpy(frame.data() + at, &check, 2);
+            stats.checksummed++;
+        }
+        iov.assign(1, {frame.data(), len});
+        backend.tx_copied += len;
+        return backend.transmit(iov.data(), 1);
+    }
+};
+
+/*
+A TCP segment for the guest, as far as software GRO cares, read from the headers
+peeked off the backend. Only plain in-order data segments (ACK, maybe PSH) with
+nothing after them (no ethernet padding) are worth merging
+*/
+struct TcpSegment {
+    FrameHeaders h;
+    uint32_t seq = 0;
+    size_t payload = 0;
+    bool psh = false;
+
+    bool parse(const uint8_t* p, size_t peeked, size_t len){
+        if (!h.parse(p, std::min(peeked, len)) || h.proto != IPPROTO_TCP || h.end >= len) {
+            return false;
+        }
+        size_t ip_len;
+        if (h.ipv6) {
+            ip_len = 40 + (p[h.l3 + 4] << 8 | p[h.l3 + 5]);
+        } else {
+            // No options, no fragments
+            if (h.l4 - h.l3 != 20 || (p[h.l3 + 6] & 0x3f) || p[h.l3 + 7]) {
+                return false;
+            }
+            ip_len = p[h.l3 + 2] << 8 | p[h.l3 + 3];
+        }
+        if (h.l3 + ip_len != len) {
+            return false;
+        }
+        // ACK and nothing but PSH besides
+        uint8_t flags = p[h.l4 + 13];
+        if ((flags & ~0x08) != 0x10) {
+            return false;
+        }
+        psh = flags & 0x08;
+        memcpy(&seq, p + h.l4 + 4, 4);
+        seq = ntohl(seq);
+        payload = len - h.end;
+        return true;
+    }
+
+    /*
+    Whether this carries on from first (whose headers are in first_p) in the same
+    flow: same addresses and ports, same IP TTL/TOS and DF, same ack, same TCP options
+    (Linux GRO's rules too)
+    */
+    bool same_flow(const uint8_t* p, const TcpSegment& first, const uint8_t* first_p) const {
+        if (h.ipv6 != first.h.ipv6 || h.l3 != first.h.l3 || h.end != first.h.end || memcmp(p, first_p, h.l3) != 0) {
+            return false;
+        }
+        if (h.ipv6) {
+            // Version, class and flow label, next header and hop limit, addresses
+            if (memcmp(p + h.l3, first_p + h.l3, 4) || memcmp(p + h.l3 + 6, first_p + h.l3 + 6, 34)) {
+                return false;
+            }
+        } else {
+            if (p[h.l3 + 1] != first_p[h.l3 + 1] || p[h.l3 + 6] != first_p[h.l3 + 6] || memcmp(p + h.l3 + 8, first_p + h.l3 + 8, 2)
+                || memcmp(p + h.l3 + 12, first_p + h.l3 + 12, 8)) {
+                return false;
+            }
+        }
+        // Ports, ack, then the options
+        return memcmp(p + h.l4, first_p + h.l4, 4) == 0 && memcmp(p + h.l4 + 8, first_p + h.l4 + 8, 4) == 0
+            && memcmp(p + h.l4 + 20, first_p + h.l4 + 20, h.end - h.l4 - 20) == 0;
+    }
+};
@@ -0,0 +1,389 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+extern "C" {
+#define class __class_compat // Rename 'class' to avoid C++ keyword conflict
+#include <linux/virtio_net.h>
+#undef class
+}
+
+#include "netbackend.hpp"
+#include "virtiorequest.hpp"
+
+/*
+Receive side scaling for multiqueue virtio-net (VIRTIO_NET_F_MQ/VIRTIO_NET_F_RSS):
+which rx queue a packet for the guest goes to, picked from the Toeplitz hash of its
+addresses and ports through an indirection table, the way a NIC does it. Every
+packet of a flow lands on the same queue, so the guest's TCP sees it in order, and
+different flows get spread over the queues and so over the harts taking them.
+
+The guest can set the key, table and hash types (VIRTIO_NET_CTRL_MQ_RSS_CONFIG),
+otherwise it's the usual default key and the table going round the active pairs
+*/
+struct RssConfig {
+    static constexpr size_t MAX_KEY = 40;
+    static constexpr size_t MAX_TABLE = 128;
+    // Longest hash input: IPv6 addresses and ports
+    static constexpr size_t INPUT_SIZE = 36;
+    static constexpr uint32_t HASH_TYPES = VIRTIO_NET_RSS_HASH_TYPE_IPv4 | VIRTIO_NET_RSS_HASH_TYPE_TCPv4
+        | VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | VIRTIO_NET_RSS_HASH_TYPE_IPv6 | VIRTIO_NET_RSS_HASH_TYPE_TCPv6
+        | VIRTIO_NET_RSS_HASH_TYPE_UDPv6;
+
+    uint32_t hash_types = HASH_TYPES;
+    uint8_t key[MAX_KEY];
+    // Rx queue (pair) for each value of the hash's low bits, a power of two long
+    std::vector<uint16_t> table;
+    // Rx queue for packets that aren't IP or whose hash type is off
+    uint16_t unclassified = 0;
+    /*
+    The hash, XOR of a 32 bit window of the key for every input bit set, done a byte at
+    a time: lut[i * 256 + b] is what byte b at input offset i adds in
+    */
+    std::vector<uint32_t> lut;
+
+    RssConfig(){
+        static const uint8_t default_key[MAX_KEY] = {
+            0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+            0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+            0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+        };
+        set_key(default_key, MAX_KEY);
+        spread(1);
+    }
+
+    void set_key(const uint8_t* k, size_t len){
+        memset(key, 0, sizeof(key));
+        memcpy(key, k, std::min(len, MAX_KEY));
+        lut.assign(INPUT_SIZE * 256, 0);
+        for (size_t i = 0; i < INPUT_SIZE; i++) {
+            for (uint32_t b = 0; b < 256; b++) {
+                uint32_t h = 0;
+                for (uint32_t bit = 0; bit < 8; bit++) {
+                    if (b & (0x80 >> bit)) {
+                        h ^= window(i * 8 + bit);
+                    }
+                }
+                lut[i * 256 + b] = h;
+            }
+        }
+    }
+
+    // The default table: every hash value round the first pairs queues in turn
+    void spread(uint16_t pairs){
+        table.resize(MAX_TABLE);
+        for (size_t i = 0; i < table.size(); i++) {
+            table[i] = i % pairs;
+        }
+        unclassified = 0;
+    }
+
+    uint32_t hash(const uint8_t* input, size_t len) const {
+        uint32_t h = 0;
+        for (size_t i = 0; i < len; i++) {
+            h ^= lut[i * 256 + input[i]];
+        }
+        return h;
+    }
+
+    /*
+    Rx queue for a frame (ethernet header on). Ports go into the hash for TCP and UDP
+    unless it's an IPv4 fragment, which may not have them. IPv6 extension headers
+    aren't followed, those packets hash on their addresses only
+    */
+    uint16_t queue(const uint8_t* p, size_t len) const {
+        if (len < 14) {
+            return unclassified;
+        }
+        size_t l3 = 14;
+        uint16_t type = p[12] << 8 | p[13];
+        if (type == 0x8100 && len >= 18) {
+            type = p[16] << 8 | p[17];
+            l3 = 18;
+        }
+        uint8_t input[INPUT_SIZE];
+        size_t addrs, l4 = 0;
+        uint8_t proto;
+        bool fragment = false;
+        uint32_t ip, tcp, udp;
+        if (type == 0x0800 && len >= l3 + 20) {
+            addrs = 8;
+            memcpy(input, p + l3 + 12, addrs);
+            l4 = l3 + (p[l3] & 0xf) * 4;
+            proto = p[l3 + 9];
+            fragment = ((p[l3 + 6] << 8 | p[l3 + 7]) & 0x3fff) != 0;
+            ip = VIRTIO_NET_RSS_HASH_TYPE_IPv4;
+            tcp = VIRTIO_NET_RSS_HASH_TYPE_TCPv4;
+            udp = VIRTIO_NET_RSS_HASH_TYPE_UDPv4;
+        } else if (type == 0x86dd && len >= l3 + 40) {
+            addrs = 32;
+            memcpy(input, p + l3 + 8, addrs);
+            l4 = l3 + 40;
+            proto = p[l3 + 6];
+            ip = VIRTIO_NET_RSS_HASH_TYPE_IPv6;
+            tcp = VIRTIO_NET_RSS_HASH_TYPE_TCPv6;
+            udp = VIRTIO_NET_RSS_HASH_TYPE_UDPv6;
+        } else {
+            return unclassified;
+        }
+        size_t n;
+        if (!fragment && len >= l4 + 4 && ((proto == IPPROTO_TCP && (hash_types & tcp)) || (proto == IPPROTO_UDP && (hash_types & udp)))) {
+            memcpy(input + addrs, p + l4, 4);
+            n = addrs + 4;
+        } else if (hash_types & ip) {
+            n = addrs;
+        } else {
+            return unclassified;
+        }
+        return table[hash(input, n) & (table.size() - 1)];
+    }
+
+    /*
+    Take a struct virtio_net_rss_config from the guest, checking it against what we
+    offered. Sets pairs to the queue pairs it turns on (max_tx_vq), false if it's no good
+    */
+    bool configure(const uint8_t* cmd, size_t len, uint16_t max_pairs, uint16_t& pairs){
+        if (len < 8) {
+            return false;
+        }
+        uint32_t types;
+        uint16_t mask, unclassified_queue;
+        memcpy(&types, cmd, 4);
+        memcpy(&mask, cmd + 4, 2);
+        memcpy(&unclassified_queue, cmd + 6, 2);
+        size_t entries = (size_t)mask + 1;
+        if (entries > MAX_TABLE || (entries & mask) || len < 8 + entries * 2 + 3) {
+            return false;
+        }
+        std::vector<uint16_t> new_table(entries);
+        memcpy(new_table.data(), cmd + 8, entries * 2);
+        const uint8_t* tail = cmd + 8 + entries * 2;
+        uint16_t max_tx_vq;
+        memcpy(&max_tx_vq, tail, 2);
+        uint8_t key_len = tail[2];
+        if (max_tx_vq < 1 || max_tx_vq > max_pairs || unclassified_queue >= max_pairs || key_len > MAX_KEY
+            || len < 8 + entries * 2 + 3 + key_len) {
+            return false;
+        }
+        for (uint16_t q : new_table) {
+            if (q >= max_pairs) {
+                return false;
+            }
+        }
+        hash_types = types & HASH_TYPES;
+        table = std::move(new_table);
+        unclassified = unclassified_queue;
+        if (key_len) {
+            set_key(tail + 3, key_len);
+        }
+        pairs = max_tx_vq;
+        return true;
+    }
+
+private:
+    // The 32 bits of the key starting at bit (big endian, the first byte's top bit is bit 0)
+    uint32_t window(size_t bit) const {
+        uint64_t v = 0;
+        for (size_t i = 0; i < 5; i++) {
+            size_t byte = bit / 8 + i;
+            v = v << 8 | (byte < MAX_KEY ? key[byte] : 0);
+        }
+        return v >> (8 - bit % 8);
+    }
+};
+
+/*
+Packets RSS has steered to one rx queue of a multiqueue VirtioNet, waiting for that
+queue's thread to take them. The thread on the real backend reads every packet into
+a host buffer, hashes it and queues it here, and the queue drains it like any other
+backend, peeking included, so GRO works the same. It costs a copy the single queue
+doesn't have, but each queue's guest buffers are only ever touched by its own thread.
+
+Buffers go round between the steering thread and the queue by swapping, none get
+allocated once there are enough. fd() is an eventfd that's readable while packets wait
+*/
+class NetBacklog : public NetBackend {
+public:
+    // Packets that can wait before more get dropped, like a NIC's rx ring
+    static constexpr size_t MAX_PACKETS = 256;
+
+private:
+    struct Packet {
+        std::vector<uint8_t> data;
+        size_t len;
+    };
+    std::mutex lock;
+    std::deque<Packet> packets;
+    std::vector<std::vector<uint8_t>> free_buffers;
+    // The packet being received, only touched by the queue's thread
+    std::vector<uint8_t> current;
+    int event_fd;
+    // epoll set over event_fd and the fd watch() was given, -1 without one
+    int watch_fd = -1, other_fd = -1;
+    bool vnet;
+    size_t max_len;
+
+public:
+    // Packets queued here / dropped because the queue's thread fell too far behind, written by the steering thread
+    uint64_t queued = 0, dropped = 0;
+
+    NetBacklog(bool vnet_, size_t max_len_) : vnet(vnet_), max_len(max_len_) {
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    ~NetBacklog(){
+        if (event_fd >= 0) {
+            close(event_fd);
+        }
+        if (watch_fd >= 0) {
+            close(watch_fd);
+        }
+    }
+
+    /*
+    The queue that steers reads the real backend as well as its own backlog, and has to
+    wake for either: wait_fd() becomes an epoll set that's readable while either fd is.
+    If we can't get one it's just fd, the backlog then waits for the end of the sleep
+    */
+    void watch(int fd){
+        other_fd = fd;
+        watch_fd = epoll_create1(EPOLL_CLOEXEC);
+        for (int f : {event_fd, fd}) {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = f;
+            if (watch_fd >= 0 && f >= 0 && epoll_ctl(watch_fd, EPOLL_CTL_ADD, f, &ev) < 0) {
+                close(watch_fd);
+                watch_fd = -1;
+            }
+        }
+    }
+
+    // What the queue's thread sleeps on
+    int wait_fd(){
+        return watch_fd >= 0 ? watch_fd : other_fd >= 0 ? other_fd : event_fd;
+    }
+
+    /*
+    Queue the first len bytes of buffer, which comes back as an empty one to receive the
+    next packet into. False (buffer left as it was) if the backlog is full
+    */
+    bool push(std::vector<uint8_t>& buffer, size_t len){
+        std::lock_guard<std::mutex> guard(lock);
+        if (packets.size() >= MAX_PACKETS) {
+            dropped++;
+            return false;
+        }
+        packets.push_back(Packet{std::move(buffer), len});
+        if (free_buffers.empty()) {
+            buffer = std::vector<uint8_t>();
+        } else {
+            buffer = std::move(free_buffers.back());
+            free_buffers.pop_back();
+        }
+        queued++;
+        if (packets.size() == 1) {
+            uint64_t one = 1;
+            ssize_t r = write(event_fd, &one, sizeof(one));
+            (void)r;
+        }
+        return true;
+    }
+
+    ssize_t next_packet() override {
+        std::lock_guard<std::mutex> guard(lock);
+        return packets.empty() ? -1 : (ssize_t)packets.front().len;
+    }
+
+    bool peeks() override {
+        return true;
+    }
+
+    ssize_t peek(uint8_t* head, size_t len) override {
+        std::lock_guard<std::mutex> guard(lock);
+        if (packets.empty()) {
+            return -1;
+        }
+        const Packet& p = packets.front();
+        memcpy(head, p.data.data(), std::min(len, p.len));
+        return p.len;
+    }
+
+    size_t max_packet() override {
+        return max_len;
+    }
+
+    bool vnet_hdr() override {
+        return vnet;
+    }
+
+    /*
+    Take the next packet out whole, to be queued somewhere else: it's swapped into
+    buffer, whose old storage stays here for reuse. Its length, -1 if there's none
+    */
+    ssize_t take(std::vector<uint8_t>& buffer){
+        std::lock_guard<std::mutex> guard(lock);
+        if (packets.empty()) {
+            return -1;
+        }
+        if (buffer.capacity()) {
+            free_buffers.push_back(std::move(buffer));
+        }
+        buffer = std::move(packets.front().data);
+        size_t len = packets.front().len;
+        packets.pop_front();
+        if (packets.empty()) {
+            uint64_t count;
+            ssize_t r = read(event_fd, &count, sizeof(count));
+            (void)r;
+        }
+        return len;
+    }
+
+    ssize_t receive(const struct iovec* iov, int iovcnt) override {
+        size_t len;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (packets.empty()) {
+                return -EAGAIN;
+            }
+            // The last packet's buffer goes back for the steering thread to reuse
+            if (current.capacity()) {
+                free_buffers.push_back(std::move(current));
+            }
+            current = std::move(packets.front().data);
+            len = packets.front().len;
+            packets.pop_front();
+            if (packets.empty()) {
+                uint64_t count;
+                ssize_t r = read(event_fd, &count, sizeof(count));
+                (void)r;
+            }
+        }
+        rx_copied += VirtioRequest::iov_from_buf(std::vector<struct iovec>(iov, iov + iovcnt), current.data(), len);
+        return len;
+    }
+
+    // Never sent to, tx goes straight to the real backend
+    int transmit(const struct iovec* iov, int iovcnt) override {
+        return -EOPNOTSUPP;
+    }
+
+    int fd() override {
+        return event_fd;
+    }
+};
@@ -9,12 +9,17 @@
 #include <sys/time.h>
 #include <sys/select.h>
 #include <signal.h>
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <climits>
+#include <deque>
 #include <cstdio>
 #include <getopt.h>
 #include <inttypes.h>
 #include <iostream>
+#include <memory>
 #include <queue>
 #include <signal.h>
 #include <slirp/libslirp.h>
@@ -25,6 +30,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <vector>
 #include <mutex> // Added for std::mutex
 extern "C" {
 #define class __class_compat // Rename 'class' to avoid C++ keyword conflict
@@ -40,94 +47,714 @@ extern "C" {
 #include "l2cpu.h"
 #include "virtiodevice.hpp"
 
-extern "C" {
-#include <slirp/libvdeslirp.h>
-}
+#include "netbackend.hpp"
+#include "netoffload.hpp"
+#include "netsteer.hpp"
+#include "packetbackend.hpp"
+#include "slirpbackend.hpp"
+#include "tapbackend.hpp"
 
 #define PACKET_SIZE 1514
 
 class VirtioNet : public VirtioDevice {
 public:
-    SlirpConfig slirpcfg;
-    struct vdeslirp *myslirp = nullptr;
-    int slirp_fd = -1;
-    uint8_t buffer[PACKET_SIZE];
-    bool header_processed;
+    // Most queue pairs --net-queues offers the guest
+    static constexpr uint16_t MAX_PAIRS = 4;
+    // Packets steer() takes off the backend in one go
+    static constexpr uint32_t STEER_BUDGET = 256;
+
+    std::shared_ptr<NetBackend> backend;
+
+    // Each written by its own queue's thread only
+    struct RxStats {
+        uint64_t packets = 0, bytes = 0, buffers = 0;
+        // Packets spread over several buffers / cut short because the buffer was too small (no MRG_RXBUF)
+        uint64_t merged = 0, truncated = 0;
+        uint64_t errors = 0;
+        // Segments GRO put together into bigger packets, and the packets they made
+        uint64_t coalesced = 0, gro_packets = 0;
+    };
+    struct TxStats {
+        uint64_t packets = 0, bytes = 0, errors = 0;
+    };
+
+    /*
+    One rx queue, only ever touched by the thread servicing it. Its packets come from
+    source: the backend itself with one queue pair, its backlog with more (see steer)
+    */
+    struct RxQueue {
+        NetBackend* source = nullptr;
+        // Length of the next packet for the guest (as far as the source can tell), -1 when we haven't seen one yet
+        ssize_t len = -1;
+        // Its headers, when the source can peek and GRO is on
+        uint8_t head[128];
+        // Header of the packet being received
+        struct virtio_net_hdr_mrg_rxbuf hdr;
+        /*
+        rx buffers taken off the ring but not filled yet, in order. Usually they're taken as
+        a packet needs them, but sources that can't tell how long a packet is before
+        reading it get room for the longest one and what it doesn't use waits here for the
+        next. The first one gets the header
+        */
+        std::deque<VirtioRequest*> spare;
+        std::vector<struct iovec> iov;
+        // Where the next byte of the packet being received goes: spare buffer buf, off bytes in (its header part first)
+        size_t buf = 0, off = 0;
+        // Bytes of it so far
+        size_t placed = 0;
+        // The packet GRO is holding on to, see gro_flush
+        struct {
+            bool open = false;
+            TcpSegment first;
+            // First segment's headers, fixed up and written over the guest's copy when it's handed over
+            uint8_t head[128];
+            uint32_t next_seq = 0;
+            uint16_t segments = 0;
+            bool psh = false;
+            uint8_t window[2];
+        } held;
+        // Headers of the segments after the first land here
+        uint8_t scratch[128];
+        RxStats stats;
+    };
+
+    struct TxQueue {
+        // Checksums and TSO for backends that only take plain frames
+        SoftOffload offload;
+        std::vector<struct iovec> iov;
+        TxStats stats;
+    };
+
+    /*
+    Queues come in rx/tx pairs, rx0 tx0 rx1 tx1..., then the control queue once the
+    guest takes VIRTIO_NET_F_CTRL_VQ. With VIRTIO_NET_F_MQ there are max_pairs pairs,
+    the guest turns on as many as it has harts for (VIRTIO_NET_CTRL_MQ), and packets
+    for it are spread over their rx queues by RSS, so each queue's interrupts and
+    stack work can go to a hart of its own
+    */
+    uint16_t max_pairs = 1;
+    std::vector<RxQueue> rx;
+    std::vector<TxQueue> tx;
+    int ctrl_queue = -1;
+
+    /*
+    Software GRO for sources that peek (slirp, the backlogs), once the guest takes TSO:
+    TCP segments of one flow that turn up in the same pass are received one after the
+    other into the guest's buffers, headers and all for the first and just the payload
+    for the rest, and handed over as one TSO frame with its checksum left partial, the
+    way the kernel hands GRO'd packets to a TAP device. One 64K frame instead of 44
+    saves the X280s more than the rest of rx put together
+    */
+    bool gro4 = false, gro6 = false;
 
-    VirtioNet(int ttdevice, int l2cpu_idx, std::atomic<bool>& exit_flag, std::mutex& interrupt_register_lock, int interrupt_number_, uint64_t mmio_region_offset_)
-        : VirtioDevice(ttdevice, l2cpu_idx, exit_flag, interrupt_register_lock, interrupt_number_, mmio_region_offset_) {
+    /*
+    Multiqueue rx: the first rx queue's thread reads every packet off the backend and
+    queues it on the backlog of the rx queue RSS picks for it. rss, active_pairs and
+    the steering stats are shared with the control queue's thread under rss_lock,
+    active_pairs is atomic as well so the rx queues can check it every pass
+    */
+    std::vector<std::unique_ptr<NetBacklog>> backlogs;
+    std::mutex rss_lock;
+    RssConfig rss;
+    std::atomic<uint16_t> active_pairs{1};
+    std::vector<uint8_t> steer_buffer, requeue_buffer;
+    struct SteerStats {
+        // requeued: packets moved off the backlog of a queue the guest turned off
+        uint64_t packets = 0, errors = 0, requeued = 0;
+    } steer_stats;
 
+    struct CtrlStats {
+        uint64_t commands = 0, rejected = 0;
+    } ctrl_stats;
+
+    VirtioNet(int ttdevice, int l2cpu_idx, std::atomic<bool>& exit_flag, InterruptDispatcher& interrupts_, int interrupt_number_, uint64_t mmio_region_offset_, std::shared_ptr<NetBackend> backend_, uint16_t pairs = 1)
+        : VirtioNet(VirtioTransport::from_l2cpu(ttdevice, l2cpu_idx, mmio_region_offset_), exit_flag, interrupts_, interrupt_number_, std::move(backend_), pairs) {}
+
+    VirtioNet(VirtioTransport transport_, std::atomic<bool>& exit_flag, InterruptDispatcher& interrupts_, int interrupt_number_, std::shared_ptr<NetBackend> backend_, uint16_t pairs = 1)
+        : VirtioDevice(std::move(transport_), exit_flag, interrupts_, interrupt_number_), backend(std::move(backend_)) {
+        max_pairs = std::min<uint16_t>(std::max<uint16_t>(pairs, 1), MAX_PAIRS);
         num_queues = 2;
-        device_features_list[0] = 1<<VIRTIO_NET_F_GUEST_CSUM;
+        /*
+        Checksums and TSO from the guest are done by the backend if it can, in software
+        here if not. TSO frames for the guest need a backend that makes them (TAP) or
+        one we can GRO for (slirp), UFO (IPv4 fragmentation) only goes to the kernel
+        */
+        device_features_list[0] = 1<<VIRTIO_NET_F_CSUM | 1<<VIRTIO_NET_F_GUEST_CSUM | 1<<VIRTIO_NET_F_MRG_RXBUF
+            | 1<<VIRTIO_NET_F_HOST_TSO4 | 1<<VIRTIO_NET_F_HOST_TSO6 | 1<<VIRTIO_NET_F_HOST_ECN;
+        if (backend->vnet_hdr()) {
+            device_features_list[0] |= 1<<VIRTIO_NET_F_HOST_UFO | 1<<VIRTIO_NET_F_GUEST_TSO4 | 1<<VIRTIO_NET_F_GUEST_TSO6
+                | 1<<VIRTIO_NET_F_GUEST_ECN;
+        } else if (backend->peeks()) {
+            device_features_list[0] |= 1<<VIRTIO_NET_F_GUEST_TSO4 | 1<<VIRTIO_NET_F_GUEST_TSO6;
+        }
         device_features_list[1] = 1<<(VIRTIO_F_VERSION_1-32);
-        
-        // Slirp setup
-        vdeslirp_init(&slirpcfg, VDE_INIT_DEFAULT);
-        myslirp = vdeslirp_open(&slirpcfg);
-        struct in_addr host, guest;
-        inet_aton("127.0.0.1", &host);
-        inet_aton("10.0.2.15", &guest);
-        vdeslirp_add_fwd(myslirp, 0, host, 2222 + l2cpu_idx + 4 * ttdevice, guest, 22);
-        slirp_fd = vdeslirp_fd(myslirp);
-        signal(SIGPIPE, SIG_IGN);
-
+        if (max_pairs > 1) {
+            device_features_list[0] |= 1<<VIRTIO_NET_F_CTRL_VQ | 1<<VIRTIO_NET_F_MQ;
+            device_features_list[1] |= 1<<(VIRTIO_NET_F_RSS-32);
+            num_queues = 2 * max_pairs + 1;
+        }
         *device_id = VIRTIO_ID_NET;
+        // VERSION_1 always has num_buffers in the header, mergeable buffers or not
         queue_header_size = sizeof(struct virtio_net_hdr_mrg_rxbuf);
-        header_processed = false;
-      }
-
-    void process_queue_start(int queue_idx, uint8_t* addr, uint64_t len) override {
-        header_processed = true;
-        if (queue_idx==0){
-            struct virtio_net_hdr_mrg_rxbuf* hdr = reinterpret_cast<struct virtio_net_hdr_mrg_rxbuf*>(addr);
-            hdr->hdr.flags = 0;
-            hdr->num_buffers = 1;
-            hdr->hdr.gso_type = 0;
-            hdr->hdr.gso_size = 0;
-          }
-      }
-
-    void process_queue_data(int queue_idx, uint8_t* addr, uint64_t len) override {
-        // Do nothing here
-    }
-
-    void process_queue_complete(int queue_idx, uint8_t* addr, uint64_t len) override {
-      /*
-      For the network device, we seem to always just get one descriptor of size 1514+sizeof(struct virtio_net_hdr_mrg_rxbuf)
-      So we process that in this function cause the last descriptor doesn't have the next flag set
-      */
-      if (!header_processed){
-        process_queue_start(queue_idx, addr, len);
-        addr += queue_header_size;
-      }
-      if (queue_idx==0){
-          ssize_t pktlen = vdeslirp_recv(myslirp, buffer, PACKET_SIZE);
-          if (pktlen > 0) {
-              memcpy(addr, buffer, pktlen);
-          }
-        } else if(queue_idx==1) {
-            memcpy(buffer, addr, len);
-            int ret = vdeslirp_send(myslirp, buffer, len);
-            if (ret < 0) {
-                printf("vdeslirp_send failed: %d\n", ret);
+
+        struct virtio_net_config *device_config = reinterpret_cast<struct virtio_net_config*>(mmio_base + VIRTIO_MMIO_CONFIG);
+        device_config->max_virtqueue_pairs = max_pairs;
+        device_config->rss_max_key_size = RssConfig::MAX_KEY;
+        device_config->rss_max_indirection_table_length = RssConfig::MAX_TABLE;
+        device_config->supported_hash_types = RssConfig::HASH_TYPES;
+    }
+
+    /*
+    --net slirp (the default), tap:<ifname> or packet:<ifname>. Null (after saying why)
+    if it can't be opened
+    */
+    static std::shared_ptr<NetBackend> open_backend(const std::string& spec, int ttdevice, int l2cpu_idx){
+        size_t colon = spec.find(':');
+        std::string kind = spec.substr(0, colon);
+        std::string ifname = colon == std::string::npos ? "" : spec.substr(colon + 1);
+        if (kind == "slirp" && ifname.empty()) {
+            return std::make_shared<SlirpBackend>(ttdevice, l2cpu_idx);
+        }
+        if (ifname.empty() || ifname.size() >= IFNAMSIZ) {
+            printf("--net %s: expected slirp, tap:<ifname> or packet:<ifname>\n", spec.c_str());
+            return nullptr;
+        }
+        if (kind == "tap") {
+            return TapBackend::open_device(ifname);
+        }
+        if (kind == "packet") {
+            return PacketBackend::open_device(ifname);
+        }
+        printf("--net %s: unknown backend %s\n", spec.c_str(), kind.c_str());
+        return nullptr;
+    }
+
+    // Tell the backend what the guest takes, whether to GRO for it, and how many queues it has
+    void negotiate() override {
+        VirtioDevice::negotiate();
+        bool csum = has_feature(VIRTIO_NET_F_GUEST_CSUM);
+        if (backend->vnet_hdr()) {
+            backend->set_offloads(csum, has_feature(VIRTIO_NET_F_GUEST_TSO4), has_feature(VIRTIO_NET_F_GUEST_TSO6),
+                has_feature(VIRTIO_NET_F_GUEST_ECN));
+        }
+        bool gro = !backend->vnet_hdr() && backend->peeks() && csum && has_feature(VIRTIO_NET_F_MRG_RXBUF);
+        gro4 = gro && has_feature(VIRTIO_NET_F_GUEST_TSO4);
+        gro6 = gro && has_feature(VIRTIO_NET_F_GUEST_TSO6);
+
+        // The device starts out on the first pair whatever it has, the guest turns the rest on
+        uint16_t pairs = has_feature(VIRTIO_NET_F_MQ) ? max_pairs : 1;
+        ctrl_queue = has_feature(VIRTIO_NET_F_CTRL_VQ) ? 2 * pairs : -1;
+        num_queues = 2 * pairs + (ctrl_queue >= 0);
+        rx.clear();
+        rx.resize(pairs);
+        tx.clear();
+        tx.resize(pairs);
+        backlogs.clear();
+        size_t prefix = backend->vnet_hdr() ? sizeof(struct virtio_net_hdr_mrg_rxbuf) : 0;
+        for (uint16_t i = 0; i < pairs && pairs > 1; i++) {
+            backlogs.push_back(std::make_unique<NetBacklog>(backend->vnet_hdr(), backend->max_packet() + prefix));
+        }
+        if (!backlogs.empty()) {
+            backlogs[0]->watch(backend->fd());
+        }
+        for (uint16_t i = 0; i < pairs; i++) {
+            rx[i].source = backlogs.empty() ? backend.get() : backlogs[i].get();
+        }
+        std::lock_guard<std::mutex> guard(rss_lock);
+        active_pairs = 1;
+        rss = RssConfig();
+    }
+
+protected:
+    size_t rx_space(RxQueue& q, size_t i){
+        return q.spare[i]->header_size() + q.spare[i]->writable_size();
+    }
+
+    // Room in the spare buffers from off bytes into buffer buf on, in just that one without mergeable
+    size_t rx_room(RxQueue& q, size_t buf, size_t off, bool mergeable){
+        size_t room = 0;
+        for (size_t i = buf; i < q.spare.size() && (mergeable || i == buf); i++) {
+            room += rx_space(q, i) - (i == buf ? off : 0);
+        }
+        return room;
+    }
+
+    // Add up to len bytes of the spare buffers from off bytes into buffer buf on to q.iov
+    void rx_iov_at(RxQueue& q, size_t buf, size_t off, size_t len){
+        for (size_t i = buf; i < q.spare.size() && len > 0; i++) {
+            for (std::vector<struct iovec>* v : {&q.spare[i]->header, &q.spare[i]->writable}) {
+                for (const struct iovec& io : *v) {
+                    if (off >= io.iov_len) {
+                        off -= io.iov_len;
+                        continue;
+                    }
+                    if (len == 0 || q.iov.size() == IOV_MAX) {
+                        return;
+                    }
+                    size_t take = std::min(io.iov_len - off, len);
+                    q.iov.push_back({static_cast<uint8_t*>(io.iov_base) + off, take});
+                    len -= take;
+                    off = 0;
+                }
+            }
+        }
+    }
+
+    // Move q.buf/q.off on past n more bytes of the packet
+    void rx_advance(RxQueue& q, size_t n){
+        q.placed += n;
+        while (n > 0) {
+            size_t left = rx_space(q, q.buf) - q.off;
+            if (left == 0) {
+                q.buf++;
+                q.off = 0;
+                continue;
+            }
+            size_t k = std::min(n, left);
+            q.off += k;
+            n -= k;
+        }
+    }
+
+    /*
+    Receive the next packet straight into the spare rx buffers. With
+    VIRTIO_NET_F_MRG_RXBUF a packet too big for one buffer carries on into the next
+    ones, which have no header of their own. Without it whatever doesn't fit is
+    dropped. False if the source had nothing after all
+    */
+    bool rx_receive(RxQueue& q, bool mergeable){
+        size_t first = q.spare[0]->header_size();
+        size_t room = rx_room(q, 0, first, mergeable);
+        // vnet_hdr sources fill in the header themselves
+        size_t prefix = q.source->vnet_hdr() ? sizeof(q.hdr) : 0;
+        q.iov.clear();
+        if (prefix) {
+            q.iov.push_back({&q.hdr, prefix});
+        }
+        rx_iov_at(q, 0, first, room);
+        ssize_t n = q.source->receive(q.iov.data(), q.iov.size());
+        q.len = -1;
+        if (n == -EAGAIN || n == -EWOULDBLOCK) {
+            return false;
+        }
+        if (n < (ssize_t)prefix) {
+            q.stats.errors++;
+            return false;
+        }
+        if (!prefix) {
+            memset(&q.hdr, 0, sizeof(q.hdr));
+        }
+        if (n - prefix > room) {
+            q.stats.truncated++;
+        }
+        q.buf = 0;
+        q.off = first;
+        q.placed = 0;
+        rx_advance(q, std::min(n - prefix, room));
+        return true;
+    }
+
+    /*
+    Hand the packet in spare buffers 0 to q.buf to the guest, on the used ring
+    together with num_buffers in the first one's header saying how many there are
+    */
+    void rx_complete(RxQueue& q){
+        size_t used = q.buf + 1;
+        q.hdr.num_buffers = used;
+        q.spare[0]->write_header(&q.hdr, sizeof(q.hdr));
+        if (used > 1) {
+            q.stats.merged++;
+        }
+        for (size_t i = 0; i < used; i++) {
+            VirtioRequest* r = q.spare.front();
+            complete_request(r, i == q.buf ? q.off : r->header_size() + r->writable_size());
+            q.spare.pop_front();
+        }
+        q.stats.packets++;
+        q.stats.bytes += q.placed;
+        q.buf = q.off = q.placed = 0;
+    }
+
+    // Whether seg (headers in q.head) carries on the held packet's flow, as the next full size segment or the last
+    bool gro_continues(RxQueue& q, const TcpSegment& seg){
+        const TcpSegment& first = q.held.first;
+        return seg.seq == q.held.next_seq && seg.payload <= first.payload && q.placed + seg.payload - first.h.l3 <= 65535
+            && seg.same_flow(q.head, first, q.held.head);
+    }
+
+    // Receive the payload of seg straight after the held packet's, false if the source had nothing after all
+    bool gro_append(RxQueue& q, const TcpSegment& seg){
+        q.iov.clear();
+        q.iov.push_back({q.scratch, seg.h.end});
+        rx_iov_at(q, q.buf, q.off, seg.payload);
+        ssize_t n = q.source->receive(q.iov.data(), q.iov.size());
+        q.len = -1;
+        if (n == -EAGAIN || n == -EWOULDBLOCK) {
+            return false;
+        }
+        if (n < (ssize_t)seg.h.end) {
+            q.stats.errors++;
+            return false;
+        }
+        size_t payload = std::min<size_t>(n - seg.h.end, seg.payload);
+        rx_advance(q, payload);
+        q.held.next_seq += payload;
+        q.held.segments++;
+        q.held.psh |= seg.psh;
+        memcpy(q.held.window, q.scratch + seg.h.l4 + 14, 2);
+        q.stats.coalesced++;
+        // A short segment or a push ends the run
+        if (payload < q.held.first.payload || seg.psh) {
+            gro_flush(q);
+        }
+        return true;
+    }
+
+    /*
+    Hand the held packet over. With more than one segment in it, its headers get the
+    total length, the last window and any PSH, and it goes as a TSO frame of first
+    segment sized pieces, TCP checksum left partial: the pseudo header sum in the
+    field, for the guest to take as good or finish if it forwards the packet
+    */
+    void gro_flush(RxQueue& q){
+        if (!q.held.open) {
+            return;
+        }
+        q.held.open = false;
+        if (q.held.segments > 1) {
+            const FrameHeaders& h = q.held.first.h;
+            uint8_t* p = q.held.head;
+            size_t l4_len = q.placed - h.l4;
+            h.set_ip_length(p, l4_len);
+            p[h.l4 + 13] |= q.held.psh ? 0x08 : 0;
+            memcpy(p + h.l4 + 14, q.held.window, 2);
+            Checksum c;
+            h.pseudo_header(c, p, l4_len);
+            uint16_t check = c.partial();
+            memcpy(p + h.l4 + 16, &check, 2);
+            q.spare[0]->scatter(p, h.end);
+            q.hdr.hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            q.hdr.hdr.gso_type = h.ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+            q.hdr.hdr.hdr_len = h.end;
+            q.hdr.hdr.gso_size = q.held.first.payload;
+            q.hdr.hdr.csum_start = h.l4;
+            q.hdr.hdr.csum_offset = 16;
+            q.stats.gro_packets++;
+        }
+        rx_complete(q);
+    }
+
+    /*
+    Hand the guest every packet there's room for in the spare rx buffers. True if
+    another one is waiting that needs more buffers than that
+    */
+    bool drain_rx(RxQueue& q){
+        bool mergeable = has_feature(VIRTIO_NET_F_MRG_RXBUF);
+        bool gro = gro4 || gro6;
+        while (true) {
+            if (q.len < 0) {
+                q.len = gro ? q.source->peek(q.head, sizeof(q.head)) : q.source->next_packet();
+                if (q.len < 0) {
+                    return false;
+                }
+            }
+            TcpSegment seg;
+            bool tcp = gro && seg.parse(q.head, std::min<size_t>(q.len, sizeof(q.head)), q.len) && (seg.h.ipv6 ? gro6 : gro4);
+            if (q.held.open) {
+                if (tcp && gro_continues(q, seg)) {
+                    if (rx_room(q, q.buf, q.off, true) < seg.payload) {
+                        return true;
+                    }
+                    if (!gro_append(q, seg)) {
+                        return false;
+                    }
+                    continue;
+                }
+                gro_flush(q);
+            }
+
+            if (q.spare.empty() || (mergeable && rx_room(q, 0, q.spare[0]->header_size(), true) < (size_t)q.len)) {
+                return true;
+            }
+            size_t len = q.len;
+            // Hold on to a TCP segment that more of its flow may follow
+            bool hold = tcp && !seg.psh && seg.h.end <= q.spare[0]->writable_size();
+            if (!rx_receive(q, mergeable)) {
+                return false;
+            }
+            if (hold && q.placed == len) {
+                q.held.open = true;
+                q.held.first = seg;
+                memcpy(q.held.head, q.head, seg.h.end);
+                memcpy(q.held.window, q.head + seg.h.l4 + 14, 2);
+                q.held.next_seq = seg.seq + seg.payload;
+                q.held.segments = 1;
+                q.held.psh = false;
+            } else {
+                rx_complete(q);
             }
         }
-        header_processed = false;
     }
 
-    inline bool queue_has_data(int queue_idx){
-      if(queue_idx==0){
-        // Check if slirp has data for us, if so return true
-        struct timeval tv;
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET(slirp_fd, &rfds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 0;
-        return select(slirp_fd + 1, &rfds, NULL, NULL, &tv) > 0;
+    /*
+    Take up to STEER_BUDGET packets off the backend, each into a host buffer, and queue
+    it on the backlog of the rx queue RSS picks for it. Runs on the first rx queue's
+    thread, which is the only one waiting on the backend. Returns the packets it took
+    */
+    uint32_t steer(){
+        std::lock_guard<std::mutex> guard(rss_lock);
+        size_t prefix = backend->vnet_hdr() ? sizeof(struct virtio_net_hdr_mrg_rxbuf) : 0;
+        uint32_t n = 0;
+        for (; n < STEER_BUDGET; n++) {
+            ssize_t next = backend->next_packet();
+            if (next < 0) {
+                break;
+            }
+            steer_buffer.resize(std::max<size_t>(next, backend->max_packet()) + prefix);
+            struct iovec v = {steer_buffer.data(), steer_buffer.size()};
+            ssize_t len = backend->receive(&v, 1);
+            if (len == -EAGAIN || len == -EWOULDBLOCK) {
+                break;
+            }
+            if (len < (ssize_t)prefix) {
+                steer_stats.errors++;
+                break;
+            }
+            len = std::min(len, (ssize_t)steer_buffer.size());
+            uint16_t queue = rss.queue(steer_buffer.data() + prefix, len - prefix);
+            backlogs[queue]->push(steer_buffer, len);
+            steer_stats.packets++;
+        }
+        return n;
+    }
 
-      } else {
+    /*
+    Packets left on the backlog of rx queue q after the guest turned it off (fewer pairs
+    from VQ_PAIRS_SET or RSS_CONFIG) are steered again onto the queues still on, or
+    they'd wait there for good. Runs on q's own thread, which may have peeked the first
+    of them or be holding a GRO packet, so both are done with first
+    */
+    uint32_t requeue(RxQueue& q, NetBacklog& stranded){
+        gro_flush(q);
+        q.len = -1;
+        std::lock_guard<std::mutex> guard(rss_lock);
+        size_t prefix = backend->vnet_hdr() ? sizeof(struct virtio_net_hdr_mrg_rxbuf) : 0;
+        uint32_t n = 0;
+        ssize_t len;
+        while ((len = stranded.take(requeue_buffer)) >= 0) {
+            uint16_t queue = rss.queue(requeue_buffer.data() + prefix, len - prefix);
+            backlogs[queue < active_pairs ? queue : 0]->push(requeue_buffer, len);
+            steer_stats.requeued++;
+            n++;
+        }
+        return n;
+    }
+
+    /*
+    A command on the control queue: struct virtio_net_ctrl_hdr and its data from the
+    guest, a virtio_net_ctrl_ack back. Only VIRTIO_NET_CTRL_MQ is offered, anything
+    else gets VIRTIO_NET_ERR
+    */
+    void control(VirtioRequest* r){
+        r->split(0, sizeof(virtio_net_ctrl_ack));
+        std::vector<uint8_t> cmd(r->readable_size());
+        VirtioRequest::iov_to_buf(r->readable, cmd.data(), cmd.size());
+        bool ok = cmd.size() >= sizeof(struct virtio_net_ctrl_hdr) && cmd[0] == VIRTIO_NET_CTRL_MQ
+            && control_mq(cmd[1], cmd.data() + 2, cmd.size() - 2);
+        ctrl_stats.commands++;
+        if (!ok) {
+            ctrl_stats.rejected++;
+        }
+        if (r->status) {
+            *r->status = ok ? VIRTIO_NET_OK : VIRTIO_NET_ERR;
+        }
+        complete_request(r, r->status ? sizeof(virtio_net_ctrl_ack) : 0);
+    }
+
+    /*
+    VQ_PAIRS_SET turns on that many pairs and spreads flows over them with the default
+    RSS setup, RSS_CONFIG (with VIRTIO_NET_F_RSS) gives its own. If we missed the driver
+    accepting RSS (fill_missed_features) its RSS_CONFIG is refused and rx stays on the first pair
+    */
+    bool control_mq(uint8_t cmd, const uint8_t* data, size_t len){
+        std::lock_guard<std::mutex> guard(rss_lock);
+        uint16_t pairs;
+        if (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET && len >= sizeof(pairs)) {
+            memcpy(&pairs, data, sizeof(pairs));
+            if (pairs < 1 || pairs > rx.size()) {
+                return false;
+            }
+            rss = RssConfig();
+            rss.spread(pairs);
+        } else if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG && has_feature(VIRTIO_NET_F_RSS)) {
+            RssConfig config = rss;
+            if (!config.configure(data, len, rx.size(), pairs)) {
+                return false;
+            }
+            rss = std::move(config);
+        } else {
+            return false;
+        }
+        active_pairs = pairs;
         return true;
-      }
+    }
+
+    bool is_ctrl(uint32_t queue_idx){
+        return (int)queue_idx == ctrl_queue;
+    }
+
+public:
+    void process_request(VirtioRequest* r) override {
+        if (is_ctrl(r->queue_idx)) {
+            control(r);
+        } else if (r->queue_idx % 2 == 0) {
+            // rx: queue_has_data has seen a packet that needs it
+            RxQueue& q = rx[r->queue_idx / 2];
+            q.spare.push_back(r);
+            q.stats.buffers++;
+        } else {
+            /*
+            tx: everything after the header is the packet, straight from the guest's buffers.
+            A frame in more pieces than the backend can take in one go is dropped, sending
+            the first IOV_MAX of them would put a cut off frame on the wire
+            */
+            TxQueue& q = tx[r->queue_idx / 2];
+            int ret;
+            if (backend->vnet_hdr()) {
+                q.iov = r->header;
+                q.iov.insert(q.iov.end(), r->readable.begin(), r->readable.end());
+                ret = q.iov.size() > IOV_MAX ? -EMSGSIZE : backend->transmit(q.iov.data(), q.iov.size());
+            } else {
+                struct virtio_net_hdr_mrg_rxbuf hdr = {};
+                r->read_header(&hdr, sizeof(hdr));
+                if ((hdr.hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) || hdr.hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+                    ret = q.offload.transmit(*backend, hdr.hdr, r->readable);
+                } else {
+                    ret = r->readable.size() > IOV_MAX ? -EMSGSIZE : backend->transmit(r->readable.data(), r->readable.size());
+                }
+            }
+            if (ret < 0) {
+                q.stats.errors++;
+            }
+            q.stats.packets++;
+            q.stats.bytes += r->readable_size();
+            complete_request(r, 0);
+        }
+    }
+
+    /*
+    Whatever the last rx buffers taken off the ring made room for. A packet GRO is
+    still holding goes now, at the end of the pass, like at the end of a NAPI poll.
+    The first rx queue steers what's come in for all of them first
+    */
+    uint32_t poll_completions(uint32_t queue_idx) override {
+        if (is_ctrl(queue_idx) || queue_idx % 2 != 0) {
+            return 0;
+        }
+        RxQueue& q = rx[queue_idx / 2];
+        if (queue_idx / 2 >= active_pairs && !backlogs.empty()) {
+            return requeue(q, *backlogs[queue_idx / 2]);
+        }
+        uint32_t steered = queue_idx == 0 && !backlogs.empty() ? steer() : 0;
+        uint64_t before = q.stats.packets;
+        if (!q.spare.empty()) {
+            drain_rx(q);
+        }
+        gro_flush(q);
+        return q.stats.packets - before + steered;
+    }
+
+    // Only rx has anything to wait for, tx and control are driven by the guest
+    int wait_fd(uint32_t queue_idx) override {
+        if (is_ctrl(queue_idx) || queue_idx % 2 != 0) {
+            return -1;
+        }
+        if (backlogs.empty()) {
+            return backend->fd();
+        }
+        // The first queue also gets packets requeued off the queues the guest turned off
+        return queue_idx == 0 ? backlogs[0]->wait_fd() : backlogs[queue_idx / 2]->fd();
+    }
+
+    /*
+    rx only takes a buffer off the ring when a packet needs it, so every packet already
+    waiting is drained into the guest's buffers in one pass, and they all go back with
+    one interrupt
+    */
+    bool queue_has_data(int queue_idx) override {
+        if (is_ctrl(queue_idx) || queue_idx % 2 != 0) {
+            return true;
+        }
+        return drain_rx(rx[queue_idx / 2]);
+    }
+
+    // Every rx / tx queue's stats added up
+    RxStats rx_totals(){
+        RxStats t;
+        for (RxQueue& q : rx) {
+            t.packets += q.stats.packets;
+            t.bytes += q.stats.bytes;
+            t.buffers += q.stats.buffers;
+            t.merged += q.stats.merged;
+            t.truncated += q.stats.truncated;
+            t.errors += q.stats.errors;
+            t.coalesced += q.stats.coalesced;
+            t.gro_packets += q.stats.gro_packets;
+        }
+        return t;
+    }
+
+    TxStats tx_totals(){
+        TxStats t;
+        for (TxQueue& q : tx) {
+            t.packets += q.stats.packets;
+            t.bytes += q.stats.bytes;
+            t.errors += q.stats.errors;
+        }
+        return t;
+    }
+
+    void report_traffic(const std::string& name){
+        RxStats r = rx_totals();
+        TxStats t = tx_totals();
+        uint64_t interrupts_raised = 0;
+        for (uint32_t i = 0; i < queues.size() && i < 2 * rx.size(); i += 2) {
+            interrupts_raised += queues[i].stats.interrupts_raised;
+        }
+        uint64_t rx_copied = backend->rx_copied;
+        for (std::unique_ptr<NetBacklog>& b : backlogs) {
+            rx_copied += b->rx_copied;
+        }
+        printf("%s: rx %lu packets %.1f MB in %lu buffers, %lu merged, %lu truncated, %lu errors, %.1f packets per interrupt, %.1f MB copied\n",
+            name.c_str(), r.packets, r.bytes / 1e6, r.buffers, r.merged, r.truncated, r.errors,
+            interrupts_raised ? (double)r.packets / interrupts_raised : 0.0, rx_copied / 1e6);
+        if (gro4 || gro6) {
+            printf("%s: rx GRO %lu segments into %lu packets\n", name.c_str(), r.coalesced + r.gro_packets, r.gro_packets);
+        }
+        if (!backlogs.empty()) {
+            printf("%s: rx %u of %zu queue pairs on, %lu packets steered (%lu errors, %lu requeued), per queue:", name.c_str(),
+                active_pairs.load(), rx.size(), steer_stats.packets, steer_stats.errors, steer_stats.requeued);
+            for (size_t i = 0; i < rx.size(); i++) {
+                printf(" %lu (%lu dropped)", rx[i].stats.packets, backlogs[i]->dropped);
+            }
+            printf("\n");
+        }
+        if (ctrl_queue >= 0) {
+            printf("%s: control queue %lu commands, %lu rejected\n", name.c_str(), ctrl_stats.commands, ctrl_stats.rejected);
+        }
+        printf("%s: tx %lu packets %.1f MB, %lu errors, %.1f MB copied\n", name.c_str(), t.packets, t.bytes / 1e6,
+            t.errors, backend->tx_copied / 1e6);
+        SoftOffload::Stats o;
+        for (TxQueue& q : tx) {
+            o.checksummed += q.offload.stats.checksummed;
+            o.segmented += q.offload.stats.segmented;
+            o.segments += q.offload.stats.segments;
+            o.dropped += q.offload.stats.dropped;
+        }
+        if (o.checksummed || o.segmented || o.dropped) {
+            printf("%s: tx offload %lu checksummed, %lu TSO frames into %lu segments, %lu dropped\n", name.c_str(),
+                o.checksummed, o.segmented, o.segments, o.dropped);
+        }
+        backend->report(name);
     }
 };
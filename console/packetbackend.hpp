@@ -0,0 +1,197 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "netbackend.hpp"
+#include "virtiorequest.hpp"
+
+/*
+The guest straight on a host NIC (--net packet:<ifname>) through an AF_PACKET socket,
+sharing the wire with the host like a macvlan would: it sees every frame on the NIC
+(which goes promiscuous) and sends its own with its own MAC. Needs CAP_NET_RAW.
+Traffic between the guest and the host itself doesn't work this way, the NIC
+doesn't loop frames back, use tap for that.
+
+Frames for the guest land in a PACKET_MMAP (TPACKET_V2) ring shared with the kernel,
+so there's no syscall per packet on rx, just a copy out of the ring into the guest's
+buffers. Frames from the guest go out with sendmsg straight from guest memory
+*/
+class PacketBackend : public NetBackend {
+public:
+    static constexpr uint32_t RING_FRAMES = 1024;
+
+private:
+    int sock = -1;
+    std::string name;
+    int ifindex = 0;
+    size_t mtu_packet = 1514;
+    uint8_t* ring = nullptr;
+    size_t ring_size = 0;
+    uint32_t frame_size = 0;
+    uint32_t rx_head = 0;
+
+    // Frames the kernel couldn't fit in the ring
+    uint64_t drops = 0;
+
+    PacketBackend() = default;
+
+    struct tpacket2_hdr* frame(uint32_t i){
+        return reinterpret_cast<struct tpacket2_hdr*>(ring + (size_t)i * frame_size);
+    }
+
+    // The frame at rx_head if the kernel has handed it to us
+    struct tpacket2_hdr* head_frame(){
+        struct tpacket2_hdr* f = frame(rx_head);
+        if (!(__atomic_load_n(&f->tp_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            return nullptr;
+        }
+        return f;
+    }
+
+public:
+    // Null (after saying why) if the socket or its ring can't be set up
+    static std::unique_ptr<PacketBackend> open_device(const std::string& ifname){
+        std::unique_ptr<PacketBackend> p(new PacketBackend());
+        p->name = ifname;
+        p->ifindex = if_nametoindex(ifname.c_str());
+        if (p->ifindex == 0) {
+            perror(("No network interface " + ifname).c_str());
+            return nullptr;
+        }
+        p->sock = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+        if (p->sock < 0) {
+            perror("Failed to open an AF_PACKET socket");
+            return nullptr;
+        }
+
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, ifname.c_str(), IFNAMSIZ - 1);
+        if (ioctl(p->sock, SIOCGIFMTU, &ifr) == 0) {
+            p->mtu_packet = ifr.ifr_mtu + 18;
+        }
+
+        int version = TPACKET_V2;
+        // Don't hand the guest back its own frames
+        int one = 1;
+        // Frames hold the tpacket header, padding for alignment and the packet
+        p->frame_size = 64;
+        while (p->frame_size < TPACKET2_HDRLEN + 16 + p->mtu_packet) {
+            p->frame_size *= 2;
+        }
+        struct tpacket_req req;
+        req.tp_block_size = std::max<uint32_t>(p->frame_size, getpagesize());
+        req.tp_frame_size = p->frame_size;
+        req.tp_block_nr = RING_FRAMES / (req.tp_block_size / p->frame_size);
+        req.tp_frame_nr = req.tp_block_nr * (req.tp_block_size / p->frame_size);
+        if (setsockopt(p->sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0
+            || setsockopt(p->sock, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one)) != 0
+            || setsockopt(p->sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+            perror("Failed to set up the AF_PACKET ring");
+            return nullptr;
+        }
+        p->ring_size = (size_t)req.tp_block_size * req.tp_block_nr;
+        p->ring = static_cast<uint8_t*>(mmap(nullptr, p->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, p->sock, 0));
+        if (p->ring == MAP_FAILED) {
+            p->ring = nullptr;
+            perror("Failed to map the AF_PACKET ring");
+            return nullptr;
+        }
+
+        struct sockaddr_ll addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sll_family = AF_PACKET;
+        addr.sll_protocol = htons(ETH_P_ALL);
+        addr.sll_ifindex = p->ifindex;
+        struct packet_mreq mreq;
+        memset(&mreq, 0, sizeof(mreq));
+        mreq.mr_ifindex = p->ifindex;
+        mreq.mr_type = PACKET_MR_PROMISC;
+        if (bind(p->sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0
+            || setsockopt(p->sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+            perror(("Failed to attach to " + ifname).c_str());
+            return nullptr;
+        }
+        return p;
+    }
+
+    ~PacketBackend(){
+        if (ring) {
+            munmap(ring, ring_size);
+        }
+        if (sock >= 0) {
+            close(sock);
+        }
+    }
+
+    ssize_t next_packet() override {
+        struct tpacket2_hdr* f = head_frame();
+        return f ? (ssize_t)f->tp_snaplen : -1;
+    }
+
+    size_t max_packet() override {
+        return mtu_packet;
+    }
+
+    ssize_t receive(const struct iovec* iov, int iovcnt) override {
+        struct tpacket2_hdr* f = head_frame();
+        if (!f) {
+            return -EAGAIN;
+        }
+        if (f->tp_status & TP_STATUS_LOSING) {
+            struct tpacket_stats stats;
+            socklen_t len = sizeof(stats);
+            if (getsockopt(sock, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == 0) {
+                drops += stats.tp_drops;
+            }
+        }
+        // Anything longer than a frame (GRO on the NIC, turn it off with ethtool -K) arrives cut short
+        ssize_t n = f->tp_len;
+        rx_copied += VirtioRequest::iov_from_buf(std::vector<struct iovec>(iov, iov + iovcnt),
+            reinterpret_cast<uint8_t*>(f) + f->tp_mac, f->tp_snaplen);
+        // Give the frame back to the kernel
+        __atomic_store_n(&f->tp_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        rx_head = (rx_head + 1) % (ring_size / frame_size);
+        return n;
+    }
+
+    int transmit(const struct iovec* iov, int iovcnt) override {
+        struct sockaddr_ll addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sll_family = AF_PACKET;
+        addr.sll_ifindex = ifindex;
+        struct msghdr msg = {};
+        msg.msg_name = &addr;
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = const_cast<struct iovec*>(iov);
+        msg.msg_iovlen = iovcnt;
+        return sendmsg(sock, &msg, 0) < 0 ? -errno : 0;
+    }
+
+    int fd() override {
+        return sock;
+    }
+
+    void report(const std::string& name_) override {
+        printf("%s: AF_PACKET on %s, %zu frame ring, %lu frames dropped by the kernel\n", name_.c_str(), name.c_str(),
+            ring_size / frame_size, drops);
+    }
+};
@@ -0,0 +1,197 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <sys/select.h>
+
+/*
+Tunables for Poller
+*/
+struct PollOptions {
+    // Keep busy polling for this long after the last pass that found work
+    uint32_t spin_us = 100;
+    // Once idle, sleeps start at min_sleep_us and double every empty pass up to max_sleep_us
+    uint32_t min_sleep_us = 1;
+    uint32_t max_sleep_us = 1000;
+};
+
+struct PollStats {
+    uint64_t passes = 0;
+    // Passes that found something to do
+    uint64_t busy_passes = 0;
+    uint64_t sleeps = 0;
+    uint64_t slept_ns = 0;
+    // Sleeps that left out the caller's fd because it was readable with nothing for us to do
+    uint64_t fd_skipped = 0;
+    /*
+    Work that turned up while we were asleep waited for up to the length of that sleep,
+    these track those sleeps as the worst case latency polling added
+    */
+    uint64_t woken_with_work = 0;
+    uint64_t wake_latency_ns_total = 0;
+    uint64_t wake_latency_ns_max = 0;
+    // Thread CPU time and wall time since the poller started
+    uint64_t cpu_ns = 0;
+    uint64_t wall_ns = 0;
+};
+
+/*
+Hybrid polling engine used by every thread that watches the BAR for the guest
+(virtio devices and the console).
+
+Nothing on the X280 side can interrupt the host, so someone has to poll. While
+there is traffic we busy poll so requests get picked up straight away. Once
+nothing has turned up for spin_us we back off into sleeps that double in length
+up to max_sleep_us, so an idle guest costs next to no host CPU.
+
+Callers that also wait on a host fd (stdin, the slirp socket) can pass it to
+wait() and get woken as soon as it becomes readable instead of at the end of
+the sleep. A readable fd the caller can't make progress on (packets for the
+guest with no rx buffers posted) would cut every sleep short and have us spin,
+so once a sleep ends on the fd and the pass after it finds nothing to do, the
+fd is left out of the sleeps until a pass does some work.
+
+Usage: call wait(did_work) once at the end of every poll pass.
+*/
+class Poller {
+    PollOptions options;
+    PollStats stats;
+    bool started = false, stopped = false;
+    uint64_t start_wall_ns = 0, start_cpu_ns = 0;
+    uint64_t stop_wall_ns = 0, stop_cpu_ns = 0;
+    uint64_t last_work_ns = 0;
+    uint32_t sleep_us = 1;
+    // Length of the sleep that ended right before the current pass, 0 if we didn't sleep
+    uint64_t last_sleep_ns = 0;
+    // The last sleep was cut short by the caller's fd
+    bool fd_woke = false;
+    // The fd is readable but the passes it woke found nothing to do, sleep without it
+    bool fd_stuck = false;
+
+    static uint64_t now_ns(clockid_t clock){
+        struct timespec ts;
+        clock_gettime(clock, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    static inline void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    // Returns whether fd woke us up
+    bool sleep(int fd){
+        struct timeval tv;
+        tv.tv_sec = sleep_us / 1000000;
+        tv.tv_usec = sleep_us % 1000000;
+        if (fd >= 0) {
+            fd_set rfds;
+            FD_ZERO(&rfds);
+            FD_SET(fd, &rfds);
+            return select(fd + 1, &rfds, NULL, NULL, &tv) > 0;
+        }
+        select(0, NULL, NULL, NULL, &tv);
+        return false;
+    }
+
+public:
+    Poller(const PollOptions& options_ = PollOptions()) : options(options_) {}
+
+    // Pick up new tunables, and start the clocks the first time. Must be called from the polling thread
+    void start(const PollOptions& options_){
+        options = options_;
+        if (!started) {
+            started = true;
+            start_wall_ns = now_ns(CLOCK_MONOTONIC);
+            start_cpu_ns = now_ns(CLOCK_THREAD_CPUTIME_ID);
+            last_work_ns = start_wall_ns;
+            sleep_us = options.min_sleep_us;
+        }
+    }
+
+    /*
+    End of a poll pass. If the pass did work we go straight into the next one,
+    otherwise we spin for a while and then sleep with exponential backoff.
+    fd, if given, cuts the sleep short as soon as it is readable (unless it's stuck, see above)
+    */
+    void wait(bool did_work, int fd = -1){
+        if (!started) {
+            start(options);
+        }
+        uint64_t now = now_ns(CLOCK_MONOTONIC);
+        stats.passes++;
+        if (did_work) {
+            stats.busy_passes++;
+            if (last_sleep_ns) {
+                stats.woken_with_work++;
+                stats.wake_latency_ns_total += last_sleep_ns;
+                stats.wake_latency_ns_max = std::max(stats.wake_latency_ns_max, last_sleep_ns);
+            }
+            last_work_ns = now;
+            sleep_us = options.min_sleep_us;
+            last_sleep_ns = 0;
+            fd_woke = fd_stuck = false;
+            return;
+        }
+        fd_stuck |= fd_woke;
+        fd_woke = false;
+
+        if (now - last_work_ns < options.spin_us * 1000ULL) {
+            last_sleep_ns = 0;
+            cpu_relax();
+            return;
+        }
+
+        if (fd >= 0 && fd_stuck) {
+            stats.fd_skipped++;
+            fd = -1;
+        }
+        fd_woke = sleep(fd);
+        last_sleep_ns = now_ns(CLOCK_MONOTONIC) - now;
+        stats.sleeps++;
+        stats.slept_ns += last_sleep_ns;
+        sleep_us = std::min(std::max(sleep_us * 2, 1u), options.max_sleep_us);
+    }
+
+    // Freeze the CPU and wall clocks so get_stats() can be called from other threads. Must be called from the polling thread
+    void stop(){
+        if (started && !stopped) {
+            stopped = true;
+            stop_wall_ns = now_ns(CLOCK_MONOTONIC);
+            stop_cpu_ns = now_ns(CLOCK_THREAD_CPUTIME_ID);
+        }
+    }
+
+    // Snapshot of the counters, with CPU and wall time up to now (or up to stop())
+    PollStats get_stats(){
+        PollStats s = stats;
+        if (started) {
+            s.wall_ns = (stopped ? stop_wall_ns : now_ns(CLOCK_MONOTONIC)) - start_wall_ns;
+            s.cpu_ns = (stopped ? stop_cpu_ns : now_ns(CLOCK_THREAD_CPUTIME_ID)) - start_cpu_ns;
+        }
+        return s;
+    }
+
+    // One line CPU time vs latency summary
+    void report(const char* name){
+        PollStats s = get_stats();
+        double wall = s.wall_ns / 1e9;
+        double cpu = s.cpu_ns / 1e9;
+        printf("%s: %.2fs cpu over %.2fs (%.1f%% of a core), %lu/%lu passes busy, "
+               "wake latency avg %.1fus max %.1fus over %lu wakeups\n",
+            name, cpu, wall, wall > 0 ? 100.0 * cpu / wall : 0.0, s.busy_passes, s.passes,
+            s.woken_with_work ? s.wake_latency_ns_total / 1e3 / s.woken_with_work : 0.0,
+            s.wake_latency_ns_max / 1e3, s.woken_with_work);
+        if (s.fd_skipped) {
+            printf("%s: %lu sleeps left out a readable fd with nothing to do\n", name, s.fd_skipped);
+        }
+    }
+};
@@ -0,0 +1,104 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+
+#include "blkbackend.hpp"
+
+/*
+Plain image behind a BlkBackend, with preads and pwrites. VirtioBlk has its own
+faster paths for raw disks, this is for when a raw image sits under another
+backend (the base of an overlay)
+*/
+class RawImage : public BlkBackend {
+    int fd = -1;
+    uint64_t image_size = 0;
+    bool writable = false;
+
+    RawImage() = default;
+
+public:
+    // Null (after saying why) if path can't be opened
+    static std::unique_ptr<RawImage> open_image(const std::string& path, bool writable){
+        std::unique_ptr<RawImage> image(new RawImage());
+        image->writable = writable;
+        image->fd = open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        struct stat sb;
+        if (image->fd < 0 || fstat(image->fd, &sb) != 0) {
+            perror(("Failed to open " + path).c_str());
+            return nullptr;
+        }
+        image->image_size = sb.st_size;
+        // A block device's st_size is 0
+        if (S_ISBLK(sb.st_mode) && ioctl(image->fd, BLKGETSIZE64, &image->image_size) != 0) {
+            perror(("Failed to get the size of " + path).c_str());
+            return nullptr;
+        }
+        return image;
+    }
+
+    ~RawImage(){
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    uint64_t size() override {
+        return image_size;
+    }
+
+    bool read_only() override {
+        return !writable;
+    }
+
+    ssize_t read(void* buf, size_t len, uint64_t offset) override {
+        uint8_t* p = static_cast<uint8_t*>(buf);
+        size_t n = offset < image_size ? std::min<uint64_t>(len, image_size - offset) : 0;
+        size_t done = 0;
+        while (done < n) {
+            ssize_t r = pread(fd, p + done, n - done, offset + done);
+            if (r < 0) {
+                return -errno;
+            }
+            if (r == 0) {
+                break;
+            }
+            done += r;
+        }
+        memset(p + done, 0, len - done);
+        return len;
+    }
+
+    ssize_t write(const void* buf, size_t len, uint64_t offset) override {
+        if (!writable) {
+            return -EROFS;
+        }
+        ssize_t r = pwrite(fd, buf, len, offset);
+        return r < 0 ? -errno : r;
+    }
+
+    int flush() override {
+        return fdatasync(fd) == 0 ? 0 : -errno;
+    }
+
+    int zero(uint64_t offset, uint64_t len, bool unmap) override {
+        if (!writable) {
+            return -EROFS;
+        }
+        int mode = FALLOC_FL_KEEP_SIZE | (unmap ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE);
+        return fallocate(fd, mode, offset, len) == 0 ? 0 : -errno;
+    }
+};
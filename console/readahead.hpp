@@ -0,0 +1,58 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+/*
+Spots a sequential stream of reads (each one starting where the last one ended) and
+says what to read ahead of it. Like the kernel's own readahead the window starts
+small and doubles, up to max_window, for as long as the stream keeps going, and the
+next window is asked for once the reader is half way into the current one, so the
+disk stays busy while the guest works through what's already there.
+
+Not thread safe, every virtqueue has its own
+*/
+class Readahead {
+    uint64_t min_window, max_window;
+    uint64_t window;
+    // Where the next read of the stream starts
+    uint64_t next = UINT64_MAX;
+    // End of what's been read ahead so far
+    uint64_t ahead = 0;
+
+public:
+    static constexpr uint64_t MIN_WINDOW = 128 * 1024;
+
+    uint64_t sequential = 0, hits = 0, windows = 0, bytes = 0;
+
+    explicit Readahead(uint64_t max_window_ = 2 * 1024 * 1024)
+        : min_window(std::min(MIN_WINDOW, max_window_)), max_window(max_window_), window(min_window) {}
+
+    // Record a read of [offset, offset+len), true with the range to read ahead in start/len if there is one
+    bool access(uint64_t offset, uint64_t len, uint64_t& ra_start, uint64_t& ra_len){
+        bool is_sequential = offset == next;
+        next = offset + len;
+        if (!is_sequential || max_window == 0) {
+            window = min_window;
+            ahead = 0;
+            return false;
+        }
+        sequential++;
+        if (next <= ahead) {
+            hits++;
+        }
+        if (ahead >= next + window / 2) {
+            return false;
+        }
+        ra_start = std::max(ahead, next);
+        ahead = next + window;
+        ra_len = ahead - ra_start;
+        window = std::min(window * 2, max_window);
+        windows++;
+        bytes += ra_len;
+        return true;
+    }
+};
@@ -0,0 +1,145 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <slirp/libslirp.h>
+
+extern "C" {
+#include <slirp/libvdeslirp.h>
+}
+
+#include "netbackend.hpp"
+#include "virtiorequest.hpp"
+
+/*
+The default backend: libvdeslirp's userspace TCP/IP stack, NATing the guest onto
+the host's network with no setup or privileges. The guest is 10.0.2.15 and its
+ssh is forwarded to 127.0.0.1:2222 + l2cpu + 4 * ttdevice.
+
+vdeslirp_fd is one end of a datagram socketpair with slirp's thread on the other,
+so packets go straight between it and guest memory with recvmsg/sendmsg. If it ever
+isn't a socket they're copied through rx_buffer/tx_buffer with vdeslirp_recv/send
+*/
+class SlirpBackend : public NetBackend {
+public:
+    static constexpr size_t MAX_PACKET = 1514;
+
+private:
+    SlirpConfig slirpcfg;
+    struct vdeslirp *myslirp = nullptr;
+    int slirp_fd = -1;
+    bool scatter_gather = true;
+    // Separate so rx and tx can run on their own threads
+    uint8_t rx_buffer[MAX_PACKET];
+    uint8_t tx_buffer[MAX_PACKET];
+    // Every tx queue shares tx_buffer
+    std::mutex tx_lock;
+    ssize_t rx_buffered = -1;
+
+public:
+    SlirpBackend(int ttdevice, int l2cpu_idx){
+        vdeslirp_init(&slirpcfg, VDE_INIT_DEFAULT);
+        myslirp = vdeslirp_open(&slirpcfg);
+        struct in_addr host, guest;
+        inet_aton("127.0.0.1", &host);
+        inet_aton("10.0.2.15", &guest);
+        vdeslirp_add_fwd(myslirp, 0, host, 2222 + l2cpu_idx + 4 * ttdevice, guest, 22);
+        slirp_fd = vdeslirp_fd(myslirp);
+        signal(SIGPIPE, SIG_IGN);
+
+        int type;
+        socklen_t type_len = sizeof(type);
+        scatter_gather = getsockopt(slirp_fd, SOL_SOCKET, SO_TYPE, &type, &type_len) == 0 && type == SOCK_DGRAM;
+    }
+
+    ~SlirpBackend(){
+        if (myslirp) {
+            vdeslirp_close(myslirp);
+        }
+    }
+
+    ssize_t next_packet() override {
+        if (scatter_gather) {
+            return recv(slirp_fd, nullptr, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+        }
+        if (rx_buffered < 0) {
+            struct timeval tv = {0, 0};
+            fd_set rfds;
+            FD_ZERO(&rfds);
+            FD_SET(slirp_fd, &rfds);
+            if (select(slirp_fd + 1, &rfds, NULL, NULL, &tv) > 0) {
+                rx_buffered = vdeslirp_recv(myslirp, rx_buffer, MAX_PACKET);
+            }
+        }
+        return rx_buffered;
+    }
+
+    bool peeks() override {
+        return true;
+    }
+
+    ssize_t peek(uint8_t* head, size_t len) override {
+        if (scatter_gather) {
+            return recv(slirp_fd, head, len, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+        }
+        ssize_t n = next_packet();
+        if (n > 0) {
+            memcpy(head, rx_buffer, std::min<size_t>(n, len));
+        }
+        return n;
+    }
+
+    size_t max_packet() override {
+        return MAX_PACKET;
+    }
+
+    ssize_t receive(const struct iovec* iov, int iovcnt) override {
+        if (scatter_gather) {
+            struct msghdr msg = {};
+            msg.msg_iov = const_cast<struct iovec*>(iov);
+            msg.msg_iovlen = iovcnt;
+            ssize_t n = recvmsg(slirp_fd, &msg, MSG_DONTWAIT | MSG_TRUNC);
+            return n < 0 ? -errno : n;
+        }
+        if (rx_buffered < 0) {
+            return -EAGAIN;
+        }
+        ssize_t n = rx_buffered;
+        rx_copied += VirtioRequest::iov_from_buf(std::vector<struct iovec>(iov, iov + iovcnt), rx_buffer, n);
+        rx_buffered = -1;
+        return n;
+    }
+
+    int transmit(const struct iovec* iov, int iovcnt) override {
+        ssize_t ret;
+        if (scatter_gather) {
+            struct msghdr msg = {};
+            msg.msg_iov = const_cast<struct iovec*>(iov);
+            msg.msg_iovlen = iovcnt;
+            ret = sendmsg(slirp_fd, &msg, 0);
+        } else {
+            std::lock_guard<std::mutex> guard(tx_lock);
+            size_t len = VirtioRequest::iov_to_buf(std::vector<struct iovec>(iov, iov + iovcnt), tx_buffer, MAX_PACKET);
+            tx_copied += len;
+            ret = vdeslirp_send(myslirp, tx_buffer, len);
+        }
+        return ret < 0 ? -errno : 0;
+    }
+
+    int fd() override {
+        return slirp_fd;
+    }
+};
@@ -0,0 +1,349 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+
+#include "blkbackend.hpp"
+
+/*
+RAID-0 disk over several images or block devices (--disk a.img,b.img,...), so a
+busy guest gets the bandwidth of several host drives instead of one. The disk is
+cut into chunk sized pieces dealt round robin to the members: chunk c lives on
+member c % n, at (c / n) * chunk.
+
+Whatever part of a request lands on one member is a single contiguous range of
+it, so a request turns into at most one preadv/pwritev per member. Those go out
+together, one on the caller's thread and the rest on a thread per member, and the
+request completes when the slowest one does. A request inside one chunk never
+leaves the caller's thread.
+
+The chunk size isn't stored anywhere, the same disk has to be opened with the
+same --blk-stripe-kb (and members in the same order) every time
+*/
+class StripeImage : public BlkBackend {
+public:
+    static constexpr char SEPARATOR = ',';
+
+private:
+    enum class Op { READ, WRITE, FLUSH, ZERO, UNMAP };
+
+    struct Batch {
+        std::mutex lock;
+        std::condition_variable done;
+        unsigned remaining = 0;
+        int result = 0;
+    };
+
+    // One member's part of a request: [offset, offset+len) of the member, scattered over iov
+    struct Piece {
+        Op op = Op::READ;
+        bool used = false;
+        uint64_t offset = 0, len = 0;
+        std::vector<struct iovec> iov;
+        Batch* batch = nullptr;
+    };
+
+    struct Member {
+        std::string path;
+        int fd = -1;
+        uint64_t size = 0;
+        std::mutex lock;
+        std::condition_variable cv;
+        std::deque<Piece*> queue;
+        bool stopping = false;
+        std::thread thread;
+        std::atomic<uint64_t> ios{0}, bytes{0};
+    };
+
+    std::vector<std::unique_ptr<Member>> members;
+    uint64_t chunk = 0;
+    uint64_t image_size = 0;
+
+    std::atomic<uint64_t> requests{0}, spread{0};
+
+    StripeImage() = default;
+
+    // preadv/pwritev all of iov at offset. Reads past the end of the member come back as zeroes
+    static int transfer(int fd, bool write, std::vector<struct iovec>& iov, uint64_t offset){
+        size_t first = 0;
+        while (first < iov.size()) {
+            int count = std::min<size_t>(iov.size() - first, IOV_MAX);
+            ssize_t r = write ? pwritev(fd, &iov[first], count, offset) : preadv(fd, &iov[first], count, offset);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+            if (r == 0) {
+                if (write) {
+                    return -EIO;
+                }
+                for (; first < iov.size(); first++) {
+                    memset(iov[first].iov_base, 0, iov[first].iov_len);
+                }
+                break;
+            }
+            offset += r;
+            while (r > 0) {
+                size_t n = std::min<size_t>(r, iov[first].iov_len);
+                iov[first].iov_base = static_cast<uint8_t*>(iov[first].iov_base) + n;
+                iov[first].iov_len -= n;
+                r -= n;
+                if (iov[first].iov_len == 0) {
+                    first++;
+                }
+            }
+        }
+        return 0;
+    }
+
+    static int perform(Member& member, Piece& piece){
+        member.ios.fetch_add(1, std::memory_order_relaxed);
+        member.bytes.fetch_add(piece.len, std::memory_order_relaxed);
+        switch (piece.op) {
+        case Op::READ:
+            return transfer(member.fd, false, piece.iov, piece.offset);
+        case Op::WRITE:
+            return transfer(member.fd, true, piece.iov, piece.offset);
+        case Op::FLUSH:
+            return fdatasync(member.fd) == 0 ? 0 : -errno;
+        case Op::ZERO:
+        case Op::UNMAP: {
+            int mode = FALLOC_FL_KEEP_SIZE | (piece.op == Op::UNMAP ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE);
+            return fallocate(member.fd, mode, piece.offset, piece.len) == 0 ? 0 : -errno;
+        }
+        }
+        return -EINVAL;
+    }
+
+    static void complete(Piece& piece, int result){
+        Batch& batch = *piece.batch;
+        std::lock_guard<std::mutex> guard(batch.lock);
+        if (result < 0 && batch.result == 0) {
+            batch.result = result;
+        }
+        if (--batch.remaining == 0) {
+            batch.done.notify_one();
+        }
+    }
+
+    void member_loop(Member& member){
+        std::unique_lock<std::mutex> guard(member.lock);
+        while (true) {
+            member.cv.wait(guard, [&]{ return member.stopping || !member.queue.empty(); });
+            if (member.stopping) {
+                return;
+            }
+            Piece* piece = member.queue.front();
+            member.queue.pop_front();
+            guard.unlock();
+            complete(*piece, perform(member, *piece));
+            guard.lock();
+        }
+    }
+
+    // Carve [offset, offset+len) of the disk into one piece per member, buf is where the data is (if any)
+    void split(Op op, uint64_t offset, uint64_t len, uint8_t* buf, std::vector<Piece>& pieces){
+        uint64_t row = chunk * members.size();
+        for (uint64_t pos = offset, end = offset + len; pos < end; ) {
+            uint64_t within = pos % chunk;
+            uint64_t n = std::min(chunk - within, end - pos);
+            Piece& piece = pieces[pos / chunk % members.size()];
+            if (!piece.used) {
+                piece.used = true;
+                piece.op = op;
+                piece.offset = pos / row * chunk + within;
+            }
+            piece.len += n;
+            if (buf) {
+                piece.iov.push_back({buf + (pos - offset), n});
+            }
+            pos += n;
+        }
+    }
+
+    // Run every used piece, the first one here and the rest on their members' threads. 0 or the first -errno
+    int run(std::vector<Piece>& pieces){
+        Batch batch;
+        Piece* mine = nullptr;
+        for (Piece& piece : pieces) {
+            if (piece.used) {
+                piece.batch = &batch;
+                batch.remaining++;
+                if (!mine) {
+                    mine = &piece;
+                }
+            }
+        }
+        requests.fetch_add(1, std::memory_order_relaxed);
+        if (batch.remaining > 1) {
+            spread.fetch_add(1, std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < pieces.size(); i++) {
+            if (pieces[i].used && &pieces[i] != mine) {
+                Member& member = *members[i];
+                {
+                    std::lock_guard<std::mutex> guard(member.lock);
+                    member.queue.push_back(&pieces[i]);
+                }
+                member.cv.notify_one();
+            }
+        }
+        if (mine) {
+            complete(*mine, perform(*members[mine - pieces.data()], *mine));
+        }
+        std::unique_lock<std::mutex> guard(batch.lock);
+        batch.done.wait(guard, [&]{ return batch.remaining == 0; });
+        return batch.result;
+    }
+
+public:
+    // Whether path is a list of members rather than one image
+    static bool probe(const std::string& path){
+        return path.find(SEPARATOR) != std::string::npos;
+    }
+
+    // Null (after saying why) if a member can't be opened or chunk_bytes isn't a multiple of 4K
+    static std::unique_ptr<StripeImage> open_image(const std::string& paths, uint64_t chunk_bytes){
+        if (chunk_bytes == 0 || chunk_bytes % 4096 != 0) {
+            printf("stripe chunk of %lu bytes isn't a multiple of 4K\n", chunk_bytes);
+            return nullptr;
+        }
+        std::unique_ptr<StripeImage> image(new StripeImage());
+        image->chunk = chunk_bytes;
+        size_t start = 0;
+        while (start <= paths.size()) {
+            size_t end = std::min(paths.find(SEPARATOR, start), paths.size());
+            auto member = std::make_unique<Member>();
+            member->path = paths.substr(start, end - start);
+            start = end + 1;
+            struct stat sb;
+            if (member->path.empty() || stat(member->path.c_str(), &sb) != 0) {
+                printf("Failed to open stripe member '%s'\n", member->path.c_str());
+                return nullptr;
+            }
+            bool block_device = S_ISBLK(sb.st_mode);
+            member->fd = open(member->path.c_str(), O_RDWR | O_CLOEXEC | (block_device ? O_EXCL : 0));
+            member->size = sb.st_size;
+            if (member->fd < 0 || (block_device && ioctl(member->fd, BLKGETSIZE64, &member->size) != 0)) {
+                perror(("Failed to open " + member->path).c_str());
+                if (member->fd >= 0) {
+                    close(member->fd);
+                }
+                return nullptr;
+            }
+            image->members.push_back(std::move(member));
+        }
+
+        // Every member gives the disk as many whole chunks as the smallest one has
+        uint64_t smallest = UINT64_MAX;
+        for (auto& member : image->members) {
+            smallest = std::min(smallest, member->size / chunk_bytes * chunk_bytes);
+        }
+        for (auto& member : image->members) {
+            if (member->size != smallest) {
+                printf("%s: only using the first %lu of its %lu bytes\n", member->path.c_str(), smallest, member->size);
+            }
+        }
+        image->image_size = smallest * image->members.size();
+
+        for (auto& member : image->members) {
+            member->thread = std::thread(&StripeImage::member_loop, image.get(), std::ref(*member));
+        }
+        return image;
+    }
+
+    ~StripeImage(){
+        for (auto& member : members) {
+            if (member->thread.joinable()) {
+                {
+                    std::lock_guard<std::mutex> guard(member->lock);
+                    member->stopping = true;
+                }
+                member->cv.notify_one();
+                member->thread.join();
+            }
+            close(member->fd);
+        }
+    }
+
+    uint64_t size() override {
+        return image_size;
+    }
+
+    ssize_t read(void* buf, size_t len, uint64_t offset) override {
+        uint8_t* p = static_cast<uint8_t*>(buf);
+        size_t n = offset < image_size ? std::min<uint64_t>(len, image_size - offset) : 0;
+        memset(p + n, 0, len - n);
+        if (n == 0) {
+            return len;
+        }
+        std::vector<Piece> pieces(members.size());
+        split(Op::READ, offset, n, p, pieces);
+        int r = run(pieces);
+        return r < 0 ? r : (ssize_t)len;
+    }
+
+    ssize_t write(const void* buf, size_t len, uint64_t offset) override {
+        if (offset > image_size || len > image_size - offset) {
+            return -ENOSPC;
+        }
+        std::vector<Piece> pieces(members.size());
+        split(Op::WRITE, offset, len, const_cast<uint8_t*>(static_cast<const uint8_t*>(buf)), pieces);
+        int r = run(pieces);
+        return r < 0 ? r : (ssize_t)len;
+    }
+
+    int flush() override {
+        std::vector<Piece> pieces(members.size());
+        for (Piece& piece : pieces) {
+            piece.used = true;
+            piece.op = Op::FLUSH;
+        }
+        return run(pieces);
+    }
+
+    int zero(uint64_t offset, uint64_t len, bool unmap) override {
+        if (offset > image_size || len > image_size - offset) {
+            return -ENOSPC;
+        }
+        std::vector<Piece> pieces(members.size());
+        split(unmap ? Op::UNMAP : Op::ZERO, offset, len, nullptr, pieces);
+        return run(pieces);
+    }
+
+    void report(const std::string& name) override {
+        uint64_t r = requests.load();
+        std::string per_member;
+        for (auto& member : members) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%s%lu/%.1f", per_member.empty() ? "" : " ", member->ios.load(), member->bytes.load() / 1e6);
+            per_member += buf;
+        }
+        printf("%s: %zu way stripe of %luK chunks, %lu requests, %.1f%% over several members, I/Os/MB per member %s\n",
+            name.c_str(), members.size(), chunk >> 10, r, r ? 100.0 * spread.load() / r : 0.0, per_member.c_str());
+    }
+};
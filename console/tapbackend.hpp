@@ -0,0 +1,138 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/if_tun.h>
+
+extern "C" {
+#define class __class_compat // Rename 'class' to avoid C++ keyword conflict
+#include <linux/virtio_net.h>
+#undef class
+}
+
+#include "netbackend.hpp"
+
+/*
+The guest on a TAP device (--net tap:<ifname>): its packets come out of <ifname> on
+the host and whatever the host routes or bridges to <ifname> goes to the guest, all
+at kernel speed. Set the interface up yourself, e.g. give it an address and NAT,
+or put it in a bridge with a NIC. Needs CAP_NET_ADMIN unless the device was made
+persistent for us (ip tuntap add <ifname> mode tap user <us>).
+
+A read on a TAP fd is one whole packet, readv/writev go straight to guest memory.
+There's no asking how long the next packet is, so next_packet() always says it
+might be as long as the interface's MTU allows, or 64K once the guest takes TSO.
+
+Packets have a virtio-net header in front (IFF_VNET_HDR), which the kernel fills in
+and acts on the same way the guest does: guest TSO frames and checksums left for us
+go into the host's stack as they are, and it hands over GRO'd super-frames with
+their checksum unfinished once set_offloads() says the guest takes them
+*/
+class TapBackend : public NetBackend {
+    int tap_fd = -1;
+    std::string name;
+    size_t mtu_packet = 1514;
+    // Largest packet we might be handed, 64K once the guest takes TSO
+    size_t rx_max = 1514;
+    unsigned offloads = 0;
+
+    TapBackend() = default;
+
+public:
+    // Null (after saying why) if the device can't be opened
+    static std::unique_ptr<TapBackend> open_device(const std::string& ifname){
+        std::unique_ptr<TapBackend> tap(new TapBackend());
+        tap->tap_fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (tap->tap_fd < 0) {
+            perror("Failed to open /dev/net/tun");
+            return nullptr;
+        }
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+        strncpy(ifr.ifr_name, ifname.c_str(), IFNAMSIZ - 1);
+        if (ioctl(tap->tap_fd, TUNSETIFF, &ifr) != 0) {
+            perror(("Failed to attach to TAP device " + ifname).c_str());
+            return nullptr;
+        }
+        tap->name = ifr.ifr_name;
+        int hdr_size = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        if (ioctl(tap->tap_fd, TUNSETVNETHDRSZ, &hdr_size) != 0) {
+            perror("Failed to set the TAP device's virtio-net header size");
+            return nullptr;
+        }
+
+        int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (sock >= 0) {
+            if (ioctl(sock, SIOCGIFMTU, &ifr) == 0) {
+                // Room for the ethernet header and a VLAN tag
+                tap->mtu_packet = ifr.ifr_mtu + 18;
+                tap->rx_max = tap->mtu_packet;
+            }
+            close(sock);
+        }
+        return tap;
+    }
+
+    ~TapBackend(){
+        if (tap_fd >= 0) {
+            close(tap_fd);
+        }
+    }
+
+    ssize_t next_packet() override {
+        return rx_max;
+    }
+
+    size_t max_packet() override {
+        return rx_max;
+    }
+
+    bool vnet_hdr() override {
+        return true;
+    }
+
+    void set_offloads(bool csum, bool tso4, bool tso6, bool ecn) override {
+        unsigned flags = 0;
+        if (csum) {
+            flags = TUN_F_CSUM | (tso4 ? TUN_F_TSO4 : 0) | (tso6 ? TUN_F_TSO6 : 0) | (ecn ? TUN_F_TSO_ECN : 0);
+        }
+        if (ioctl(tap_fd, TUNSETOFFLOAD, flags) != 0) {
+            perror(("Failed to set offloads on TAP device " + name).c_str());
+            flags = 0;
+        }
+        offloads = flags;
+        rx_max = (flags & (TUN_F_TSO4 | TUN_F_TSO6)) ? 65536 + 18 : mtu_packet;
+    }
+
+    ssize_t receive(const struct iovec* iov, int iovcnt) override {
+        ssize_t n = readv(tap_fd, iov, iovcnt);
+        return n < 0 ? -errno : n;
+    }
+
+    int transmit(const struct iovec* iov, int iovcnt) override {
+        return writev(tap_fd, iov, iovcnt) < 0 ? -errno : 0;
+    }
+
+    int fd() override {
+        return tap_fd;
+    }
+
+    void report(const std::string& name_) override {
+        printf("%s: TAP device %s, packets up to %zu bytes, offloads%s%s%s%s\n", name_.c_str(), name.c_str(), rx_max,
+            offloads & TUN_F_CSUM ? " csum" : " none", offloads & TUN_F_TSO4 ? " tso4" : "", offloads & TUN_F_TSO6 ? " tso6" : "",
+            offloads & TUN_F_TSO_ECN ? " ecn" : "");
+    }
+};
@@ -67,10 +67,25 @@ void TestMemoryWrapAround(){
     }
 }
 
+/*
+Checks that L2CPU::get hands out one context per L2CPU while it's held, and that
+everything on a card shares one open fd
+*/
+void TestSharedContext(){
+    std::shared_ptr<L2CPU> a = L2CPU::get(0), b = L2CPU::get(0), c = L2CPU::get(1);
+    assert(a == b);
+    assert(a != c);
+    assert(Card::get(0) == Card::get(0));
+    // Both go through the same card, and see the same memory
+    uint64_t starting_address = a->get_starting_address();
+    assert(a->read32(starting_address) == *reinterpret_cast<uint32_t*>(b->get_memory_ptr()));
+}
+
 int main(){
     TestL2CPU23SharedMemoryTile();
     TestL2CPUNocNodeID();
     TestMemoryPtr();
     TestMemoryWrapAround();
+    TestSharedContext();
     return 0;
 }
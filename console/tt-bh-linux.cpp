@@ -2,6 +2,8 @@
 // SPDX-License-Identifier: Apache-2.0
 
 #include <atomic>
+#include <cctype> // Added for isdigit
+#include <climits> // Added for INT_MAX
 #include <mutex> // Added for std::mutex
 #include <string> // Added for std::string
 #include <iostream> // Added for std::cout, std::cerr
@@ -13,18 +15,29 @@
 #include "network.hpp"
 
 std::atomic<bool> exit_thread_flag{false};
-std::mutex interrupt_register_lock; // Global mutex for MMIO access
+VirtioOptions virtio_options; // Tunables shared by all virtio devices
+// Interrupt coalescing per device type, see --irq-coalesce
+CoalesceOptions disk_coalesce, net_coalesce;
+BlkOptions blk_options; // Block backend for every disk, see --blk-engine
+int net_queues = 1; // Queue pairs offered to the guest's network device, see --net-queues
+BlkCache disk_cache = BlkCache::WRITEBACK, cloud_init_cache = BlkCache::WRITEBACK; // see --blk-cache
+bool poll_stats = false; // Print CPU time vs latency (and ring stats) for every polling thread when it stops
 
 void console_main(int ttdevice, int l2cpu){
     printf("Press Ctrl-A x to exit.\n\n");
+    Poller poller;
+    poller.start(virtio_options.poll);
     while (!exit_thread_flag) {
         try {
-            int r = uart_loop(ttdevice, l2cpu, exit_thread_flag);
+            int r = uart_loop(ttdevice, l2cpu, exit_thread_flag, poller);
             if (r == -EAGAIN) {
                 printf("Error (UART vanished) -- was the chip reset?  Retrying...\n");
                 std::this_thread::sleep_for(std::chrono::milliseconds(100));
             } else {
                 exit_thread_flag = true;
+                if (poll_stats) {
+                    poller.report("console");
+                }
                 return;
             }
         } catch (const std::exception& e) {
@@ -34,36 +47,281 @@ void console_main(int ttdevice, int l2cpu){
     }
 }
 
-void disk_main(int ttdevice, int l2cpu, std::mutex& interrupt_register_lock, int interrupt_number, uint64_t mmio_region_offset, const std::string& disk_image_path){
+void disk_main(int ttdevice, int l2cpu, InterruptDispatcher& interrupts, int interrupt_number, uint64_t mmio_region_offset, const std::string& disk_image_path, BlkCache cache){
+    BlkOptions blk = blk_options;
+    blk.cache = cache;
     while (!exit_thread_flag){
-        VirtioBlk device(ttdevice, l2cpu, exit_thread_flag, interrupt_register_lock, interrupt_number, mmio_region_offset, disk_image_path);
+        VirtioBlk device(ttdevice, l2cpu, exit_thread_flag, interrupts, interrupt_number, mmio_region_offset, disk_image_path, blk);
+        device.options = virtio_options;
+        device.options.coalesce = disk_coalesce;
+        // Every queue of a multi-queue disk gets its own worker, that's the point of having them
+        device.options.queue_workers |= blk_options.num_queues > 1;
         device.device_setup();
         device.device_loop();
+        if (poll_stats) {
+            device.report_polling("disk " + disk_image_path);
+            device.report(("disk " + disk_image_path).c_str());
+            device.report_io("disk " + disk_image_path);
+            device.report_backend("disk " + disk_image_path);
+        }
       std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 }
 
-void network_main(int ttdevice, int l2cpu, std::mutex& interrupt_register_lock, int interrupt_number, uint64_t mmio_region_offset){
+void network_main(int ttdevice, int l2cpu, InterruptDispatcher& interrupts, int interrupt_number, uint64_t mmio_region_offset, std::shared_ptr<NetBackend> backend){
     while (!exit_thread_flag){
-        VirtioNet device(ttdevice, l2cpu, exit_thread_flag, interrupt_register_lock, interrupt_number, mmio_region_offset);
+        VirtioNet device(ttdevice, l2cpu, exit_thread_flag, interrupts, interrupt_number, mmio_region_offset, backend, net_queues);
+        device.options = virtio_options;
+        device.options.coalesce = net_coalesce;
+        // Same as multi-queue disks, every queue pair gets its own workers
+        device.options.queue_workers |= net_queues > 1;
         device.device_setup();
         device.device_loop();
+        if (poll_stats) {
+            device.report_polling("network");
+            device.report("network");
+            device.report_traffic("network");
+        }
       std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
 }
 
+/*
+--blk-cache [disk=|cloud-init=]<writeback|writethrough|none>, no prefix sets both
+*/
+bool parse_cache(const std::string& arg){
+    std::string value = arg;
+    bool disk = true, cloud_init = true;
+    size_t eq = arg.find('=');
+    if (eq != std::string::npos) {
+        std::string name = arg.substr(0, eq);
+        value = arg.substr(eq + 1);
+        disk = name == "disk";
+        cloud_init = name == "cloud-init";
+        if (!disk && !cloud_init) {
+            return false;
+        }
+    }
+    BlkCache cache;
+    if (value == "writeback") {
+        cache = BlkCache::WRITEBACK;
+    } else if (value == "writethrough") {
+        cache = BlkCache::WRITETHROUGH;
+    } else if (value == "none") {
+        cache = BlkCache::NONE;
+    } else {
+        return false;
+    }
+    if (disk) {
+        disk_cache = cache;
+    }
+    if (cloud_init) {
+        cloud_init_cache = cache;
+    }
+    return true;
+}
+
+/*
+A number in an option: decimal digits only and nothing after them, from min to max.
+Better than an exception out of main, or a value truncated into the option's type
+*/
+bool to_number(const std::string& value, uint64_t min, uint64_t max, uint64_t& n){
+    try {
+        size_t used;
+        if (!value.empty() && isdigit((unsigned char)value[0])) {
+            n = std::stoull(value, &used);
+            return used == value.size() && n >= min && n <= max;
+        }
+    } catch (const std::exception&) {
+    }
+    return false;
+}
+
+// A number option's value, or it says what it takes and exits
+uint64_t parse_number(const char* name, const char* arg, uint64_t min, uint64_t max){
+    uint64_t n;
+    if (!to_number(arg, min, max, n)) {
+        std::cerr<<name<<" must be a number between "<<min<<" and "<<max<<"\n";
+        exit(1);
+    }
+    return n;
+}
+
+/*
+--irq-coalesce [disk=|net=]<usecs>[,<frames>], no prefix sets both
+*/
+bool parse_coalesce(const std::string& arg){
+    std::string value = arg;
+    bool disk = true, net = true;
+    size_t eq = arg.find('=');
+    if (eq != std::string::npos) {
+        std::string name = arg.substr(0, eq);
+        value = arg.substr(eq + 1);
+        disk = name == "disk";
+        net = name == "net";
+        if (!disk && !net) {
+            return false;
+        }
+    }
+    CoalesceOptions c;
+    size_t comma = value.find(',');
+    uint64_t usecs, frames = c.frames;
+    if (!to_number(value.substr(0, comma), 0, UINT32_MAX, usecs)
+        || (comma != std::string::npos && !to_number(value.substr(comma + 1), 1, UINT32_MAX, frames))) {
+        return false;
+    }
+    c.usecs = usecs;
+    c.frames = frames;
+    if (disk) {
+        disk_coalesce = c;
+    }
+    if (net) {
+        net_coalesce = c;
+    }
+    return true;
+}
+
+// --pin-cpus <cpu>[,<cpu>...]
+bool parse_cpus(const std::string& arg){
+    std::vector<int> cpus;
+    size_t start = 0;
+    while (start <= arg.size()) {
+        size_t comma = arg.find(',', start);
+        std::string cpu = arg.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        try {
+            size_t used;
+            int n = std::stoi(cpu, &used);
+            if (used != cpu.size() || n < 0 || n >= CPU_SETSIZE) {
+                return false;
+            }
+            cpus.push_back(n);
+        } catch (const std::exception&) {
+            return false;
+        }
+        if (comma == std::string::npos) {
+            break;
+        }
+        start = comma + 1;
+    }
+    virtio_options.worker_cpus = cpus;
+    return true;
+}
+
+/*
+--blk-geometry <key>=<bytes>[,...] with keys logical, physical, opt-io, seg-max (a count)
+and size-max. Sizes take a K or M suffix. Checked for sense, not against the queue size,
+VirtioBlk clamps seg-max to that
+*/
+bool parse_geometry(const std::string& arg){
+    BlkGeometry g = blk_options.geometry;
+    size_t start = 0;
+    while (start <= arg.size()) {
+        size_t comma = arg.find(',', start);
+        std::string item = arg.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) {
+            return false;
+        }
+        std::string key = item.substr(0, eq);
+        std::string value = item.substr(eq + 1);
+        uint64_t n;
+        try {
+            size_t used;
+            n = std::stoull(value, &used);
+            if (used + 1 == value.size() && (value[used] == 'K' || value[used] == 'k')) {
+                n <<= 10;
+            } else if (used + 1 == value.size() && (value[used] == 'M' || value[used] == 'm')) {
+                n <<= 20;
+            } else if (used != value.size()) {
+                return false;
+            }
+        } catch (const std::exception&) {
+            return false;
+        }
+        if (n > UINT32_MAX) {
+            return false;
+        }
+        if (key == "logical") {
+            g.logical_block_size = n;
+        } else if (key == "physical") {
+            g.physical_block_size = n;
+        } else if (key == "opt-io") {
+            g.opt_io_size = n;
+        } else if (key == "seg-max") {
+            g.seg_max = n;
+        } else if (key == "size-max") {
+            g.size_max = n;
+        } else {
+            return false;
+        }
+        if (comma == std::string::npos) {
+            break;
+        }
+        start = comma + 1;
+    }
+    auto power_of_2 = [](uint64_t v){ return v != 0 && (v & (v - 1)) == 0; };
+    if (!power_of_2(g.logical_block_size) || g.logical_block_size < 512 || g.logical_block_size > 4096) {
+        std::cerr<<"logical block size must be a power of 2 from 512 to 4096"<<"\n";
+        return false;
+    }
+    if (!power_of_2(g.physical_block_size) || g.physical_block_size < g.logical_block_size
+        || g.physical_block_size / g.logical_block_size > 1 << 15) {
+        std::cerr<<"physical block size must be a power of 2 multiple of the logical one"<<"\n";
+        return false;
+    }
+    if (g.opt_io_size % g.logical_block_size != 0) {
+        std::cerr<<"opt-io must be a multiple of the logical block size"<<"\n";
+        return false;
+    }
+    if (g.seg_max < 1) {
+        std::cerr<<"seg-max must be at least 1"<<"\n";
+        return false;
+    }
+    // Linux won't go below a page per segment
+    if (g.size_max != 0 && g.size_max < 4096) {
+        std::cerr<<"size-max must be 0 (no limit) or at least 4K"<<"\n";
+        return false;
+    }
+    blk_options.geometry = g;
+    return true;
+}
+
 int main(int argc, char **argv){
     int l2cpu=0;
     std::string disk_image_path = "rootfs.ext4";
     std::string cloud_init_path = "";
+    std::string disk_base_path = "";
     int ttdevice = 0;
+    std::string net_backend = "slirp";
+    int batch_budget = virtio_options.batch_budget;
 
-    const char* const short_opts = "t:l:d:c:h";
+    const char* const short_opts = "t:l:d:B:c:b:s:m:pSi:wP:e:q:Q:C:z:Z:r:M:G:k:n:N:h";
     const option long_opts[] = {
             {"ttdevice", required_argument, nullptr, 't'},
             {"l2cpu", required_argument, nullptr, 'l'},
             {"disk", required_argument, nullptr, 'd'},
+            {"disk-base", required_argument, nullptr, 'B'},
             {"cloud-init", required_argument, nullptr, 'c'},
+            {"batch-budget", required_argument, nullptr, 'b'},
+            {"poll-spin-us", required_argument, nullptr, 's'},
+            {"poll-max-sleep-us", required_argument, nullptr, 'm'},
+            {"poll-stats", no_argument, nullptr, 'p'},
+            {"no-ring-snapshot", no_argument, nullptr, 'S'},
+            {"irq-coalesce", required_argument, nullptr, 'i'},
+            {"queue-workers", no_argument, nullptr, 'w'},
+            {"pin-cpus", required_argument, nullptr, 'P'},
+            {"blk-engine", required_argument, nullptr, 'e'},
+            {"blk-queue-depth", required_argument, nullptr, 'q'},
+            {"blk-queues", required_argument, nullptr, 'Q'},
+            {"blk-cache", required_argument, nullptr, 'C'},
+            {"zstd-cache-mb", required_argument, nullptr, 'z'},
+            {"zstd-workers", required_argument, nullptr, 'Z'},
+            {"blk-readahead-kb", required_argument, nullptr, 'r'},
+            {"blk-stripe-kb", required_argument, nullptr, 'k'},
+            {"blk-max-merge-kb", required_argument, nullptr, 'M'},
+            {"blk-geometry", required_argument, nullptr, 'G'},
+            {"net", required_argument, nullptr, 'n'},
+            {"net-queues", required_argument, nullptr, 'N'},
             {"help", no_argument, nullptr, 'h'},
             {nullptr, no_argument, nullptr, 0}
     };
@@ -78,43 +336,195 @@ int main(int argc, char **argv){
         switch (opt)
         {
         case 't':
-            ttdevice = std::stoi(optarg);
+            ttdevice = parse_number("ttdevice", optarg, 0, INT_MAX);
             break;
         case 'l':
-            l2cpu = std::stoi(optarg);
+            l2cpu = parse_number("l2cpu", optarg, 0, 3);
             break;
         case 'd': // Handle disk image option
             disk_image_path = optarg;
             break;
+        case 'B':
+            disk_base_path = optarg;
+            break;
         case 'c': // Handle cloud init option
             cloud_init_path = optarg;
             break;
+        case 'b':
+            batch_budget = parse_number("batch-budget", optarg, 1, 16384);
+            break;
+        case 's':
+            virtio_options.poll.spin_us = parse_number("poll-spin-us", optarg, 0, UINT32_MAX);
+            break;
+        case 'm':
+            virtio_options.poll.max_sleep_us = parse_number("poll-max-sleep-us", optarg, virtio_options.poll.min_sleep_us, UINT32_MAX);
+            break;
+        case 'p':
+            poll_stats = true;
+            break;
+        case 'S':
+            virtio_options.ring_snapshot = false;
+            break;
+        case 'i':
+            if (!parse_coalesce(optarg)) {
+                std::cerr<<"irq-coalesce takes [disk=|net=]<usecs>[,<frames>] with frames at least 1"<<"\n";
+                exit(1);
+            }
+            break;
+        case 'w':
+            virtio_options.queue_workers = true;
+            break;
+        case 'P':
+            if (!parse_cpus(optarg)) {
+                std::cerr<<"pin-cpus takes a comma separated list of cpu numbers"<<"\n";
+                exit(1);
+            }
+            break;
+        case 'e':
+            if (std::string(optarg) == "mmap") {
+                blk_options.engine = BlkEngine::MMAP;
+            } else if (std::string(optarg) == "pread") {
+                blk_options.engine = BlkEngine::PREAD;
+            } else if (std::string(optarg) == "io_uring") {
+                blk_options.engine = BlkEngine::IO_URING;
+            } else {
+                std::cerr<<"blk-engine must be mmap, pread or io_uring"<<"\n";
+                exit(1);
+            }
+            break;
+        case 'q':
+            blk_options.queue_depth = parse_number("blk-queue-depth", optarg, 1, 4096);
+            break;
+        case 'Q':
+            blk_options.num_queues = parse_number("blk-queues", optarg, 1, 16);
+            break;
+        case 'C':
+            if (!parse_cache(optarg)) {
+                std::cerr<<"blk-cache takes [disk=|cloud-init=]<writeback|writethrough|none>"<<"\n";
+                exit(1);
+            }
+            break;
+        case 'z':
+            blk_options.zstd.cache_bytes = parse_number("zstd-cache-mb", optarg, 0, UINT64_MAX >> 20) << 20;
+            break;
+        case 'Z':
+            blk_options.zstd.workers = parse_number("zstd-workers", optarg, 0, 64);
+            break;
+        case 'k':
+            blk_options.stripe_kb = parse_number("blk-stripe-kb", optarg, 4, UINT32_MAX >> 10);
+            if (blk_options.stripe_kb % 4 != 0) {
+                std::cerr<<"blk-stripe-kb must be a multiple of 4\n";
+                exit(1);
+            }
+            break;
+        case 'r':
+            blk_options.readahead_kb = parse_number("blk-readahead-kb", optarg, 0, UINT32_MAX);
+            break;
+        case 'M':
+            blk_options.max_merge_kb = parse_number("blk-max-merge-kb", optarg, 0, UINT32_MAX);
+            break;
+        case 'G':
+            if (!parse_geometry(optarg)) {
+                std::cerr<<"blk-geometry takes <key>=<bytes>[,...] with keys logical, physical, opt-io, seg-max and size-max"<<"\n";
+                exit(1);
+            }
+            break;
+        case 'n':
+            net_backend = optarg;
+            break;
+        case 'N':
+            net_queues = parse_number("net-queues", optarg, 1, VirtioNet::MAX_PAIRS);
+            break;
         case 'h': // -h or --help
         case '?': // Unrecognized option
         default:
             std::cout <<
             "--l2cpu <l>:         L2CPU to attach to\n"
-            "--disk <path>:       Path to the disk image (default: rootfs.ext4)\n"
+            "--disk <path>:       Path to the disk image (default: rootfs.ext4). With several comma separated\n"
+            "                     images or block devices, the disk is striped across them (RAID-0)\n"
+            "--disk-base <path>:  Make --disk a copy-on-write overlay of this image if it doesn't exist yet,\n"
+            "                     so several L2CPUs can boot off one read-only rootfs (raw or seekable zstd)\n"
             "--cloud-init <path>:   Path to the cloud-init image (optional)\n"
+            "--batch-budget <n>:  Max descriptor chains handled per virtqueue per poll pass (default: 256)\n"
+            "--poll-spin-us <us>: Busy poll for this long after the last activity before sleeping (default: 100)\n"
+            "--poll-max-sleep-us <us>: Longest idle sleep between polls, sleeps double up to this (default: 1000)\n"
+            "--poll-stats:        Print CPU time, polling latency, ring and interrupt stats per device when it stops\n"
+            "--no-ring-snapshot:  Read virtqueues field by field instead of copying them over in bulk\n"
+            "--irq-coalesce [disk=|net=]<us>[,<frames>]: Hold interrupts back for up to <us> or until <frames>\n"
+            "                     requests completed, like ethtool rx-usecs/rx-frames (default: 0,1)\n"
+            "--queue-workers:     Give every virtqueue of a device its own thread, so network rx and tx get one each.\n"
+            "                     Always on for disks with --blk-queues > 1 and for --net-queues > 1\n"
+            "--pin-cpus <c,c,...>: Pin queue worker threads to these cpus, round robin\n"
+            "--blk-engine <mmap|pread|io_uring>: Copy through an mmap of the image on the device thread (default),\n"
+            "                     pread/pwrite it on the device thread, or read/write it asynchronously with io_uring.\n"
+            "                     --disk can also be a block device (e.g. an NVMe partition), which never gets mmap'd,\n"
+            "                     use --blk-cache none to keep it out of the page cache\n"
+            "--blk-queue-depth <n>: Most requests in flight per disk with io_uring (default: 128)\n"
+            "--blk-queues <n>:    Virtqueues per disk (VIRTIO_BLK_F_MQ), each with its own worker thread (default: 1)\n"
+            "--blk-cache [disk=|cloud-init=]<mode>: writeback (default) syncs on guest flushes only,\n"
+            "                     writethrough syncs every write, none uses O_DIRECT\n"
+            "--blk-stripe-kb <n>: Chunk size of a striped --disk, each member holds every nth chunk. Must stay\n"
+            "                     the same for the life of the disk (default: 512)\n"
+            "--blk-readahead-kb <n>: Read up to this far ahead of sequential reads, into the page cache (default: 2048, 0: off).\n"
+            "                     Raw images and block devices only, and not with --blk-cache none\n"
+            "--blk-max-merge-kb <n>: Merge adjacent reads/writes into I/Os of up to this (default: 1024, 0: off).\n"
+            "                     Only with --blk-engine io_uring on a raw image or block device, and not with --blk-cache none\n"
+            "--blk-geometry <key>=<n>[,...]: What the guest is told about the disk, sizes take K/M:\n"
+            "                     logical=512 physical=4096 (block sizes), opt-io=1M (preferred I/O size),\n"
+            "                     seg-max=254 (data segments per request), size-max=0 (bytes per segment, 0: no limit)\n"
+            "--net <slirp|tap:<if>|packet:<if>>: Where the guest's network goes: slirp's userspace NAT with ssh\n"
+            "                     on 127.0.0.1:2222+ (default), TAP device <if> (created if it doesn't exist, set it up\n"
+            "                     yourself), or straight onto host NIC <if> through an AF_PACKET ring\n"
+            "--net-queues <n>:    rx/tx queue pairs for the network (VIRTIO_NET_F_MQ), packets for the guest are\n"
+            "                     spread over them by flow (RSS), each queue gets its own worker thread (default: 1)\n"
+            "--zstd-cache-mb <n>: Memory for decompressed frames of a seekable zstd disk image (default: 256)\n"
+            "--zstd-workers <n>:  Threads decompressing zstd frames (default: one per cpu, up to 8)\n"
             "--help:              Show help\n";
             exit(1);
         }
     }
 
-    if (l2cpu < 0 || l2cpu > 3){
-        std::cerr<<"l2cpu must be one of 0,1,2,3"<<"\n";
-        exit(1);
+    virtio_options.batch_budget = batch_budget;
+
+    if (!disk_base_path.empty() && access(disk_image_path.c_str(), F_OK) != 0){
+        int r = CowImage::create(disk_image_path, disk_base_path);
+        if (r != 0){
+            std::cerr<<"Failed to create overlay "<<disk_image_path<<" of "<<disk_base_path<<": "<<strerror(-r)<<"\n";
+            exit(1);
+        }
+        std::cout<<"Created "<<disk_image_path<<" as an overlay of "<<disk_base_path<<"\n";
     }
 
 
+  /*
+  Open the card and map the L2CPU's memory once, every thread below borrows this.
+  Holding on to it here means devices reconnecting after a guest reboot don't have
+  to set it all up again
+  */
+  std::shared_ptr<L2CPU> l2cpu_context = L2CPU::get(l2cpu, ttdevice);
+
+  // Same for the network backend, a TAP device or slirp's forwarded ports stay put across reboots
+  std::shared_ptr<NetBackend> net = VirtioNet::open_backend(net_backend, ttdevice, l2cpu);
+  if (!net) {
+    exit(1);
+  }
+
+  // One dispatcher raises the interrupts of every device on the L2CPU
+  std::unique_ptr<InterruptDispatcher> interrupts = InterruptDispatcher::for_l2cpu(ttdevice, l2cpu);
+
   std::vector<std::thread> threads;
   threads.emplace_back(console_main, ttdevice,  l2cpu);
-  threads.emplace_back(disk_main, ttdevice, l2cpu, std::ref(interrupt_register_lock), 33, 2ULL*1024*1024, disk_image_path);
-  threads.emplace_back(network_main, ttdevice, l2cpu, std::ref(interrupt_register_lock), 32, 4ULL*1024*1024);
+  threads.emplace_back([&]{ interrupts->run(exit_thread_flag, virtio_options.poll); });
+  threads.emplace_back(disk_main, ttdevice, l2cpu, std::ref(*interrupts), 33, 2ULL*1024*1024, disk_image_path, disk_cache);
+  threads.emplace_back(network_main, ttdevice, l2cpu, std::ref(*interrupts), 32, 4ULL*1024*1024, net);
   if (!cloud_init_path.empty()) {
-    threads.emplace_back(disk_main, ttdevice, l2cpu, std::ref(interrupt_register_lock), 31, 6ULL*1024*1024, cloud_init_path);
+    threads.emplace_back(disk_main, ttdevice, l2cpu, std::ref(*interrupts), 31, 6ULL*1024*1024, cloud_init_path, cloud_init_cache);
   }
   for (auto& thread: threads){
     thread.join();
   }
+  if (poll_stats) {
+    interrupts->poller.report("interrupts");
+    interrupts->report();
+  }
 }
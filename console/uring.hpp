@@ -0,0 +1,188 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+Just enough io_uring for the block device, straight on top of the syscalls so we
+don't need liburing.
+
+One thread owns the ring: it grabs SQEs with get_sqe(), hands them to the kernel with
+submit() (once per poll pass, so a whole batch costs one syscall) and picks up
+completions with reap(). Completions also bump an eventfd, which the poller can sleep
+on to wake up as soon as an I/O finishes
+*/
+class IoUring {
+    int ring_fd = -1;
+    int event_fd = -1;
+
+    // Shared with the kernel
+    void* sq_ptr = MAP_FAILED;
+    void* cq_ptr = MAP_FAILED;
+    size_t sq_len = 0, cq_len = 0, sqes_len = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes = reinterpret_cast<struct io_uring_sqe*>(MAP_FAILED);
+    struct io_uring_cqe* cqes;
+    unsigned sq_entries = 0;
+
+    // SQEs handed out by get_sqe, the kernel only sees them once sq_tail catches up
+    unsigned local_tail = 0;
+    // The last reap took completions, the eventfd may still count some of them
+    bool drain_pending = false;
+
+    static int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+public:
+    IoUring() = default;
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Returns 0 or -errno (e.g. -ENOSYS/-EPERM where io_uring is unavailable)
+    int setup(unsigned entries){
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (ring_fd < 0) {
+            return -errno;
+        }
+        sq_entries = p.sq_entries;
+
+        sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        }
+        sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            return -errno;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) {
+                return -errno;
+            }
+        }
+        sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = reinterpret_cast<struct io_uring_sqe*>(mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) {
+            return -errno;
+        }
+
+        uint8_t* sq = static_cast<uint8_t*>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        uint8_t* cq = static_cast<uint8_t*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+        local_tail = *sq_tail;
+
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd < 0 || syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+            return -errno;
+        }
+        return 0;
+    }
+
+    ~IoUring(){
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_len);
+        }
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+            munmap(cq_ptr, cq_len);
+        }
+        if (sq_ptr != MAP_FAILED) {
+            munmap(sq_ptr, sq_len);
+        }
+        if (event_fd >= 0) {
+            close(event_fd);
+        }
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+    }
+
+    // Readable while completions are waiting to be reaped
+    int get_event_fd(){
+        return event_fd;
+    }
+
+    // Next free SQE, zeroed, or null if the submission queue is full
+    struct io_uring_sqe* get_sqe(){
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (local_tail - head >= sq_entries) {
+            return nullptr;
+        }
+        unsigned idx = local_tail & *sq_mask;
+        struct io_uring_sqe* sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[idx] = idx;
+        local_tail++;
+        return sqe;
+    }
+
+    // Hand every SQE we got since the last submit to the kernel in one go
+    int submit(){
+        unsigned to_submit = local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (to_submit == 0) {
+            return 0;
+        }
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        int r = enter(ring_fd, to_submit, 0, 0);
+        return r < 0 ? -errno : r;
+    }
+
+    // Submit whatever is queued and block until at least min_complete completions are there
+    int wait(unsigned min_complete){
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        int r = enter(ring_fd, to_submit, min_complete, IORING_ENTER_GETEVENTS);
+        return r < 0 ? -errno : r;
+    }
+
+    /*
+    Calls f(cqe) for every completion that's come in, returns how many there were.
+    The eventfd is only read when there's something to reap, an idle pass costs no
+    syscall. It's drained before the tail is read, so a completion after that leaves
+    it readable; one that came in between the two gets reaped now but leaves a count
+    behind, which the next pass drains
+    */
+    template <typename F>
+    unsigned reap(F f){
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail && !drain_pending) {
+            return 0;
+        }
+        uint64_t count;
+        ssize_t r = read(event_fd, &count, sizeof(count));
+        (void)r;
+        tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+        for (; head != tail; head++, n++) {
+            f(cqes[head & *cq_mask]);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        drain_pending = n > 0;
+        return n;
+    }
+};
@@ -1,13 +1,117 @@
 #pragma once
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <vector>
-#include <mutex> // Added for std::mutex
+#include <memory>
+#include <string>
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
 #include "l2cpu.h"
+#include "guestmem.hpp"
+#include "interrupts.hpp"
+#include "poller.hpp"
+#include "virtiorequest.hpp"
+
+extern "C" {
+#define class __class_compat // Rename 'class' to avoid C++ keyword conflict
+
+#include <linux/virtio_ring.h>
+#include <linux/virtio_mmio.h>
+#include <linux/virtio_config.h>
+
+#ifdef class
+#undef class // Undefine our temporary macro if it was defined
+#endif
+}
+
+/*
+Tunables shared by every virtio device thread, filled in from the command line
+*/
+struct VirtioOptions {
+    // Max number of descriptor chains consumed from one virtqueue per poll pass
+    // 1 gives the old one-chain-per-pass behaviour
+    uint16_t batch_budget = 256;
+    // Pull avail entries and descriptors into host memory with wide reads instead of
+    // reading the rings field by field (each field is a PCIe round trip)
+    bool ring_snapshot = true;
+    // How the device thread polls the rings
+    PollOptions poll;
+    // How long/how many completions an interrupt can be held back for
+    CoalesceOptions coalesce;
+    // Service every virtqueue from its own thread instead of walking them all from device_loop's
+    bool queue_workers = false;
+    // With queue_workers, pin the worker for queue i to worker_cpus[i % size] (empty: don't pin)
+    std::vector<int> worker_cpus;
+};
+
+/*
+Per queue counters, only ever written by the thread servicing the queue.
+VirtioDevice::stats adds them up for the whole device
+*/
+struct VirtioStats {
+    // Descriptor chains put on the used ring
+    uint64_t chains = 0;
+    // Times we asked the InterruptDispatcher for an interrupt (it may coalesce several into one)
+    uint64_t interrupts_raised = 0;
+    // Batches where the driver told us (used_event/VRING_AVAIL_F_NO_INTERRUPT) it didn't want an interrupt
+    uint64_t interrupts_suppressed = 0;
+    /*
+    Reads of L2CPU memory for ring bookkeeping (payload not included), i.e. PCIe round trips:
+    one per field loaded, one per 64 byte line for bulk copies
+    */
+    uint64_t ring_reads = 0;
+    // Polls that found nothing new on a queue, a single read each (not in ring_reads)
+    uint64_t empty_polls = 0;
+
+    VirtioStats& operator+=(const VirtioStats& o){
+        chains += o.chains;
+        interrupts_raised += o.interrupts_raised;
+        interrupts_suppressed += o.interrupts_suppressed;
+        ring_reads += o.ring_reads;
+        empty_polls += o.empty_polls;
+        return *this;
+    }
+};
+
+/*
+Everything a VirtioDevice needs to reach the guest: the L2CPU's DRAM and the
+device's virtio-mmio reg region. Interrupts go through the InterruptDispatcher.
+
+On hardware these all live behind TLB windows owned by an L2CPU, benchmarks
+point them at plain host memory instead (l2cpu is null in that case)
+*/
+struct VirtioTransport {
+    int ttdevice = 0;
+    int l2cpu_idx = 0;
+    std::shared_ptr<L2CPU> l2cpu;
+    std::shared_ptr<TlbWindow2M> window;
+
+    // Starting address of L2CPU's DRAM and a ptr to it
+    uint64_t starting_address = 0;
+    uint8_t* memory = nullptr;
+    uint8_t* mmio_base = nullptr;
+
+    static VirtioTransport from_l2cpu(int ttdevice, int l2cpu_idx, uint64_t mmio_region_offset){
+        VirtioTransport t;
+        t.ttdevice = ttdevice;
+        t.l2cpu_idx = l2cpu_idx;
+        t.l2cpu = L2CPU::get(l2cpu_idx, ttdevice);
+        t.starting_address = t.l2cpu->get_starting_address();
+        t.memory = t.l2cpu->get_memory_ptr();
+
+        uint64_t address = t.starting_address + t.l2cpu->get_memory_size() - mmio_region_offset;
+        t.window = t.l2cpu->get_persistent_2M_tlb_window(address);
+        t.mmio_base = reinterpret_cast<uint8_t*>(t.window->get_window());
+        return t;
+    }
+};
 
 /*
 Virtual Base Class that implements most of the device-agnostic functionality needed
@@ -17,29 +121,26 @@ class VirtioDevice {
 protected:
     int ttdevice;
     int l2cpu_idx;
-    L2CPU l2cpu;
+    // Keeps the L2CPU and the TLB windows below alive
+    VirtioTransport transport;
     // Starting address of L2CPU's DRAM
     uint64_t starting_address;
 
     // Ptr to starting address of L2CPU's DRAM
     // This ptr is used to interact with the virtqueues
     uint8_t* memory;
-    
-    std::shared_ptr<TlbWindow2M> window, interrupt_address_window; // MMIO window as a class member
 
     // Ptr to virtio-mmio device's reg region
     // None of the virtqueues/actual data transfer happens here
     // Only used for config/negotiation
     uint8_t* mmio_base;
-    uint64_t mmio_region_offset;
 
     // Interrupt Number specified in device tree for virtio-mmio device
     int interrupt_number;
-    // Ptr to L2CPU's special interrupt register
-    uint32_t* interrupt_register;
-    // We need to read and write back the interrupt register while setting/clearing interrupts
-    // And since we have multiple threads in parallel doing this, we need a lock for this
-    std::mutex& interrupt_register_lock;
+    // Raises interrupts on the L2CPU's PLIC for us, shared with the other devices
+    InterruptDispatcher& interrupts;
+    // Our mailbox in interrupts
+    int interrupt_source = -1;
     
     std::atomic<bool>& exit_thread_flag;
 
@@ -48,10 +149,11 @@ protected:
     // Most use 1, some like network may use many
     // can be overridden by derived class
     uint32_t num_queues = 1; 
-     // Size of header in descriptor table, 
-     // essentially sort of a "number of bytes to skip" number
-     // can be overridden by derived class
+    // Layout of a request on the device's queues, used to split chains into header/payload/status
+    // Bytes of device specific header at the start of every chain (virtio_blk_outhdr, virtio_net_hdr...)
     uint64_t queue_header_size = 0;
+    // Bytes of status at the very end of every chain (virtio-blk's status byte)
+    uint64_t queue_status_size = 0;
     // Max size of virtqueue, probably should make this as large as possible, 16384 maybe?
     uint16_t queue_size = 16384;
 
@@ -64,6 +166,7 @@ protected:
     uint32_t *driver_features; // VIRTIO_MMIO_DRIVER_FEATURES
     uint32_t *driver_features_sel; // VIRTIO_MMIO_DRIVER_FEATURES_SEL
     uint32_t *queue_num_max; // VIRTIO_MMIO_QUEUE_NUM_MAX
+    uint32_t *queue_num; // VIRTIO_MMIO_QUEUE_NUM
     uint32_t *queue_ready; // VIRTIO_MMIO_QUEUE_READY
     uint32_t *queue_notify; // VIRTIO_MMIO_QUEUE_NOTIFY
     uint32_t *interrupt_status; // VIRTIO_MMIO_INTERRUPT_STATUS
@@ -82,39 +185,118 @@ protected:
     uint32_t device_features_list[2] = {0, 0}; // Default, set in subclass constructor or setup
     uint32_t driver_features_list[2] = {0, 0}; // Default, set in subclass constructor or setup
 
+    // VIRTIO_RING_F_EVENT_IDX was negotiated, used_event/avail_event replace the ring flags
+    bool event_idx = false;
+    // VIRTIO_F_RING_PACKED was negotiated, the queues are packed rings instead of split ones
+    bool packed = false;
+
     // Virtqueue addresses that the driver provides the device
     std::vector<uint64_t> descriptor_table_address;
     std::vector<uint64_t> available_ring_address;
     std::vector<uint64_t> used_ring_address;
+    // Entries in each virtqueue, the driver may pick fewer than the queue_size we offer
+    std::vector<uint16_t> queue_nums;
     // Pointers to the virtqueues in L2CPU memory
     std::vector<struct vring_desc*> desc;
     std::vector<struct vring_avail*> avail;
     std::vector<struct vring_used*> used;
 
+    /*
+    With packed rings the descriptor table address points at the one descriptor ring,
+    the avail address at the driver's event suppression struct and the used address at ours
+    */
+    std::vector<struct vring_packed_desc*> packed_desc;
+    std::vector<struct vring_packed_desc_event*> driver_event;
+    std::vector<struct vring_packed_desc_event*> device_event;
+
+    // Our position in each packed ring, both wrap counters start at 1
+    struct PackedQueueState {
+        uint16_t avail_idx = 0;
+        bool avail_wrap = true;
+        uint16_t used_idx = 0;
+        bool used_wrap = true;
+    };
+    std::vector<PackedQueueState> packed_state;
 
-public:
-    VirtioDevice(int ttdevice_, int l2cpu_idx_, std::atomic<bool>& exit_flag, std::mutex& lock, int interrupt_number_, uint64_t mmio_region_offset_)
-        : ttdevice(ttdevice_),
-          l2cpu_idx(l2cpu_idx_),
-          l2cpu(l2cpu_idx_, ttdevice_),
-          mmio_region_offset(mmio_region_offset_),
-          interrupt_number(interrupt_number_),
-          interrupt_register_lock(lock),
-          exit_thread_flag(exit_flag) {
+    // A used descriptor we have yet to write back to a packed ring
+    struct PackedUsed {
+        uint16_t pos;
+        uint16_t id;
+        uint32_t len;
+        bool wrap;
+    };
 
-        starting_address = l2cpu.get_starting_address();
+    static constexpr uint16_t DESCS_PER_LINE = GUEST_LINE / sizeof(struct vring_desc);
+    // Packed descriptors pulled in per bulk read
+    static constexpr uint16_t PACKED_WINDOW = 16;
 
-        uint64_t address = starting_address + l2cpu.get_memory_size() - mmio_region_offset;
-        window = l2cpu.get_persistent_2M_tlb_window(address);
-        mmio_base = reinterpret_cast<uint8_t*>(window->get_window());
+    /*
+    Host copies of each queue's ring state (see options.ring_snapshot)
+    */
+    struct RingCache {
+        // Avail ring entries pulled this pass
+        std::vector<uint16_t> heads;
+        // Descriptor table, fetched a line at a time. A line is valid while its line_epoch
+        // matches epoch, which moves on every pass: descriptors only change while we don't own them
+        std::vector<struct vring_desc> descs;
+        std::vector<uint32_t> line_epoch;
+        uint32_t epoch = 1;
+        // We're the only one writing used->idx, no need to read it back
+        uint16_t used_idx = 0;
+        // Used entries being published, written to the ring in one go
+        std::vector<struct vring_used_elem> used_elems;
+        // Packed: available descriptors starting at window_start, all on lap window_wrap
+        std::vector<struct vring_packed_desc> window;
+        uint16_t window_start = 0;
+        uint16_t window_count = 0;
+        bool window_wrap = true;
+    };
+
+    /*
+    Everything that belongs to one virtqueue. Only ever touched by the thread servicing
+    that queue, so queues can be handed to workers of their own (options.queue_workers).
+    Aligned so neighbouring queues' counters don't share a cache line
+    */
+    struct alignas(64) QueueContext {
+        // Split rings: how far into the avail ring we've got
+        uint16_t processed = 0;
+        RingCache ring;
+        // Every request we ever allocated, and the ones not currently handed out to the device
+        std::vector<std::unique_ptr<VirtioRequest>> requests;
+        std::vector<VirtioRequest*> free_requests;
+        // Requests the device has finished with, waiting to go on the used ring
+        std::vector<VirtioRequest*> completed;
+        // Host copy of the indirect descriptor table currently being walked
+        std::vector<uint8_t> indirect_table;
+        std::vector<PackedUsed> packed_used;
+        VirtioStats stats;
+        // Only used with queue_workers, device_loop uses poller
+        Poller poller;
+    };
+    std::vector<QueueContext> queues;
+    bool workers_running = false;
+
+
+public:
+    VirtioOptions options;
+    // Totals over all queues, up to date once device_loop returns (or after collect_stats())
+    VirtioStats stats;
+    Poller poller;
 
-        memory = l2cpu.get_memory_ptr();
+    VirtioDevice(int ttdevice_, int l2cpu_idx_, std::atomic<bool>& exit_flag, InterruptDispatcher& interrupts_, int interrupt_number_, uint64_t mmio_region_offset_)
+        : VirtioDevice(VirtioTransport::from_l2cpu(ttdevice_, l2cpu_idx_, mmio_region_offset_), exit_flag, interrupts_, interrupt_number_) {}
 
-        // TODO: Check if (interrupt_number-5) is in valid 
-        // range, and adjust which register to use accordingly
-        uint64_t interrupt_address = 0x2FF10000 + 0x404;
-        interrupt_address_window = l2cpu.get_persistent_2M_tlb_window(interrupt_address);
-        interrupt_register = reinterpret_cast<uint32_t*>(interrupt_address_window->get_window());
+    VirtioDevice(VirtioTransport transport_, std::atomic<bool>& exit_flag, InterruptDispatcher& interrupts_, int interrupt_number_)
+        : ttdevice(transport_.ttdevice),
+          l2cpu_idx(transport_.l2cpu_idx),
+          transport(std::move(transport_)),
+          interrupt_number(interrupt_number_),
+          interrupts(interrupts_),
+          exit_thread_flag(exit_flag) {
+
+        starting_address = transport.starting_address;
+        memory = transport.memory;
+        mmio_base = transport.mmio_base;
 
         // 0->0x100 for generic virtio-mmio config, 0x100 onwards for device specific config
         // Should probably check if 0x100 is enough for device specific config
@@ -127,6 +309,7 @@ public:
         driver_features = reinterpret_cast<uint32_t *>(mmio_base + VIRTIO_MMIO_DRIVER_FEATURES);
         driver_features_sel = reinterpret_cast<uint32_t *>(mmio_base + VIRTIO_MMIO_DRIVER_FEATURES_SEL);
         queue_num_max = reinterpret_cast<uint32_t *>(mmio_base + VIRTIO_MMIO_QUEUE_NUM_MAX);
+        queue_num = reinterpret_cast<uint32_t *>(mmio_base + VIRTIO_MMIO_QUEUE_NUM);
         queue_ready = reinterpret_cast<uint32_t *>(mmio_base + VIRTIO_MMIO_QUEUE_READY);
         queue_notify = reinterpret_cast<uint32_t *>(mmio_base + VIRTIO_MMIO_QUEUE_NOTIFY);
         interrupt_status = reinterpret_cast<uint32_t *>(mmio_base + VIRTIO_MMIO_INTERRUPT_STATUS);
@@ -149,21 +332,22 @@ public:
     }
 
     /*
-    Each queue in a device needs to implement these functions on how to actually send/recv data from the virtqueue
-    Sometimes we just get one descriptor that we need to fill in with data, the size of this descriptor is normally
-    header size + amount of data to fill. The logic for these kind of queues can be implemented using process_queue_start alone
-
-    Sometimes we need to fill in data across multiple desciptors, the first descriptor is of header size, and the next n descriptors
-    have the actual data filled in. The header gets processed by process_queue_start, the next n descriptors get processed by
-    process_queue_data
+    Each device implements this to actually send/recv data over its virtqueues.
+    req holds one whole descriptor chain, already split into header, payload and
+    status according to queue_header_size/queue_status_size.
 
-    Sometimes the last descriptor is just of size 1 byte, normally used to store the status value of the read or write
-    That can be done using process_queue_complete
+    The device must call complete_request(req, len) once it's done with it. That can
+    happen before process_request returns, or later (from the device thread) for
+    backends that complete asynchronously, see poll_completions
     */
-    virtual void process_queue_start(int queue_idx, uint8_t* addr, uint64_t len) = 0;
-    virtual void process_queue_data(int queue_idx, uint8_t* addr, uint64_t len) = 0;
-    virtual void process_queue_complete(int queue_idx, uint8_t* addr, uint64_t len) = 0;
-    
+    virtual void process_request(VirtioRequest* req) = 0;
+
+    // Called once per poll pass for each queue, devices with requests in flight on queue_idx
+    // complete whatever finished here. Returns the number of requests completed
+    virtual uint32_t poll_completions(uint32_t queue_idx){
+        return 0;
+    }
+
     // Each queue in a device can implement a custom "do I have data/should I process the queue method"
     // For most devices/queues this isn't needed because we want to feed data into/read data from
     // the queue as long as the tail of the queue is lagging behind the head
@@ -171,6 +355,12 @@ public:
     // so this is useful in cases like that
     virtual bool queue_has_data(int queue_idx) = 0;
 
+    // Host fd that, when readable, means queue_idx has work for us (e.g. packets from slirp)
+    // Lets the poller wake up early instead of sleeping out its full backoff
+    virtual int wait_fd(uint32_t queue_idx){
+        return -1;
+    }
+
     inline void ack_interrupt(){
         /*
         What we're supposed to do is this:
@@ -197,23 +387,17 @@ public:
         }
     }
 
-    inline void set_interrupt(){
+    inline void set_interrupt(uint32_t queue_idx, uint32_t completions){
         /*
-        Set required bit in interrupt_register to 1 if we need to trigger an interrupt
+        Flag the used ring in interrupt_status and have the dispatcher raise our interrupt
+        on the plic, it decides when based on options.coalesce.
+        Several queue workers can get here at once, the dispatcher's post is lock free
+        and they all set the same bit in interrupt_status
         */
+        queues[queue_idx].stats.interrupts_raised++;
         uint32_t interrupt_status_val = *interrupt_status;
-        if (true){
-            *interrupt_status = VIRTIO_MMIO_INT_VRING | interrupt_status_val;
-            std::lock_guard<std::mutex> guard(interrupt_register_lock);
-            /*
-            FIXME: setting multiple interrupts on the plic seems to be buggy
-            so we just set our interrupt instead
-            */
-            // *interrupt_register = *interrupt_register | (1 << (interrupt_number - 5));
-            *interrupt_register = (1 << (interrupt_number - 5));
-            __sync_synchronize();
-            *interrupt_register = 0;
-        }
+        *interrupt_status = VIRTIO_MMIO_INT_VRING | interrupt_status_val;
+        interrupts.post(interrupt_source, completions);
     }
 
     void device_setup(){
@@ -221,34 +405,43 @@ public:
         TODO: Draw a state transition diagram here maybe?
         */
         uint32_t prev_sel_generation = 0, curr_sel_generation=0;
+        // The guest may take a long time to get here (or never boot), don't spin on the BAR meanwhile
+        poller.start(options.poll);
         while (!exit_thread_flag) {
             if (*status & VIRTIO_CONFIG_S_DRIVER) {
                 break;
             }
+            poller.wait(false);
         }
+        offer_ring_features();
+
         // uint32_t curr_device_features_sel=0;
         while (!exit_thread_flag) {
             curr_sel_generation = *sel_generation;
-            if (curr_sel_generation != prev_sel_generation){
+            bool changed = curr_sel_generation != prev_sel_generation;
+            if (changed){
                 *device_features = device_features_list[*device_features_sel];
-                *driver_features = driver_features_list[*driver_features_sel];
+                // Note down whatever the driver has accepted so far, and echo it back
+                driver_features_list[*driver_features_sel & 1] = *driver_features;
+                *driver_features = driver_features_list[*driver_features_sel & 1];
                 *sel_generation = curr_sel_generation + 1;
                 prev_sel_generation = curr_sel_generation + 1;
             }
-            // TODO: read driver_features and do negotiation?
 
             if (*status & VIRTIO_CONFIG_S_FEATURES_OK) {
+                driver_features_list[*driver_features_sel & 1] = *driver_features;
+                fill_missed_features();
                 break;
             }
+            poller.wait(changed);
         }
+        negotiate();
 
-        // Resize vectors for queue pointers
-        desc.resize(num_queues, nullptr);
-        avail.resize(num_queues, nullptr);
-        used.resize(num_queues, nullptr);
+        // Resize vectors for queue addresses
         descriptor_table_address.resize(num_queues, 0);
         available_ring_address.resize(num_queues, 0);
         used_ring_address.resize(num_queues, 0);
+        queue_nums.resize(num_queues, queue_size);
 
         /*
         Stage where we get virtqueue addresses from driver
@@ -258,14 +451,15 @@ public:
         while (!exit_thread_flag) {
             curr_sel_generation = *sel_generation;
             *queue_ready = 0;
-            if (curr_sel_generation != prev_sel_generation){
+            bool changed = curr_sel_generation != prev_sel_generation;
+            if (changed){
                 uint32_t queue_select_val = *queue_select;
                 // uint32_t queue_ready_val = *queue_ready;
 
                 descriptor_table_address[queue_select_val] = ((uint64_t)(*queue_desc_high) << 32) | (*queue_desc_low);
                 available_ring_address[queue_select_val] = ((uint64_t)(*queue_avail_high) << 32) | (*queue_avail_low);
                 used_ring_address[queue_select_val] = ((uint64_t)(*queue_used_high) << 32) | (*queue_used_low);
-
+                queue_nums[queue_select_val] = ring_entries(queue_select_val, *queue_num);
 
                 *sel_generation = curr_sel_generation + 1;
                 prev_sel_generation = curr_sel_generation + 1;
@@ -273,26 +467,685 @@ public:
                 if (queue_select_val == (num_queues - 1))
                     break;
             }
-            usleep(1);
+            poller.wait(changed);
+        }
+        map_queues();
+        while (!exit_thread_flag){
+            if (*status & VIRTIO_CONFIG_S_DRIVER_OK) {
+                break;
+            }
+            poller.wait(false);
+        }
+    }
+
+    /*
+    The features the driver accepted only show up in the driver_features register
+    while it is being written, so we may have missed the high word. Every valid driver
+    accepts VIRTIO_F_VERSION_1, if that is missing the word is filled in with the ring
+    features we offered (which the Linux virtio core keeps whatever the driver says)
+    and nothing else. Refusing FEATURES_OK instead would leave the device dead, Linux
+    doesn't probe a device again after it fails. Devices that offered more up there
+    run without it, see VirtioNet's VIRTIO_NET_F_RSS
+    */
+    void fill_missed_features(){
+        uint32_t ring_bits = 1<<(VIRTIO_F_VERSION_1-32) | 1<<(VIRTIO_F_RING_PACKED-32);
+        if (driver_features_list[1] & (1<<(VIRTIO_F_VERSION_1-32))) {
+            return;
+        }
+        if (device_features_list[1] & ~ring_bits) {
+            printf("Didn't catch the high feature word the driver accepted, assuming only the ring features\n");
+        }
+        driver_features_list[1] = device_features_list[1] & ring_bits;
+    }
+
+    // Whether a feature bit was both offered by us and accepted by the driver
+    bool has_feature(uint32_t bit){
+        uint32_t word = bit / 32;
+        uint32_t mask = 1u << (bit % 32);
+        return device_features_list[word] & driver_features_list[word] & mask;
+    }
+
+    // Size of queue_idx as the driver set it (VIRTIO_MMIO_QUEUE_NUM), queue_size if it makes no sense
+    uint16_t ring_entries(uint32_t queue_idx, uint32_t num){
+        if (num == 0 || num > queue_size || (!packed && (num & (num - 1)))) {
+            printf("Queue %u has a bad size %u, assuming %u\n", queue_idx, num, queue_size);
+            return queue_size;
+        }
+        return num;
+    }
+
+    // Ring features are implemented in this class, so every device offers them
+    void offer_ring_features(){
+        device_features_list[0] |= 1<<VIRTIO_RING_F_EVENT_IDX;
+        device_features_list[0] |= 1<<VIRTIO_RING_F_INDIRECT_DESC;
+        device_features_list[1] |= 1<<(VIRTIO_F_RING_PACKED-32);
+    }
+
+    // Latch the ring features negotiated with the driver, devices add their own
+    virtual void negotiate(){
+        event_idx = has_feature(VIRTIO_RING_F_EVENT_IDX);
+        packed = has_feature(VIRTIO_F_RING_PACKED);
+    }
+
+    // used_event sits right after the avail ring, avail_event right after the used ring
+    inline volatile uint16_t* used_event_ptr(uint32_t queue_idx){
+        return reinterpret_cast<volatile uint16_t*>(reinterpret_cast<uint8_t*>(avail[queue_idx]->ring) + sizeof(uint16_t) * queue_nums[queue_idx]);
+    }
+
+    inline volatile uint16_t* avail_event_ptr(uint32_t queue_idx){
+        return reinterpret_cast<volatile uint16_t*>(reinterpret_cast<uint8_t*>(used[queue_idx]->ring) + sizeof(struct vring_used_elem) * queue_nums[queue_idx]);
+    }
+
+    /*
+    With VIRTIO_RING_F_EVENT_IDX the driver puts the used idx it next wants an interrupt
+    at right after the avail ring (used_event), otherwise it can only turn interrupts
+    off entirely with VRING_AVAIL_F_NO_INTERRUPT
+    */
+    inline bool should_interrupt(uint32_t queue_idx, uint16_t old_used_idx, uint16_t new_used_idx){
+        struct vring_avail *avail_q = avail[queue_idx];
+        if (event_idx) {
+            uint16_t used_event = guest_load(queue_idx, used_event_ptr(queue_idx));
+            return vring_need_event(used_event, new_used_idx, old_used_idx);
+        }
+        return !(guest_load(queue_idx, &avail_q->flags) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    // Turn the virtqueue addresses the driver gave us into pointers into L2CPU memory
+    void map_queues(){
+        desc.resize(num_queues, nullptr);
+        avail.resize(num_queues, nullptr);
+        used.resize(num_queues, nullptr);
+        packed_desc.resize(num_queues, nullptr);
+        driver_event.resize(num_queues, nullptr);
+        device_event.resize(num_queues, nullptr);
+        packed_state.assign(num_queues, PackedQueueState());
+        queues.clear();
+        queues.resize(num_queues);
+        for (QueueContext& q : queues) {
+            q.ring.descs.resize(queue_size);
+            q.ring.line_epoch.assign(queue_size / DESCS_PER_LINE, 0);
+            q.ring.window.resize(PACKED_WINDOW);
         }
         for (uint32_t i = 0; i < num_queues; i++) {
             desc[i] = (struct vring_desc*) (memory + (descriptor_table_address[i] - starting_address));
             avail[i] = (struct vring_avail*) (memory + (available_ring_address[i] - starting_address));
             used[i] = (struct vring_used*) (memory + (used_ring_address[i] - starting_address));
+            packed_desc[i] = (struct vring_packed_desc*) desc[i];
+            driver_event[i] = (struct vring_packed_desc_event*) avail[i];
+            device_event[i] = (struct vring_packed_desc_event*) used[i];
+            if (packed) {
+                /*
+                We poll the rings, so available buffer notifications are never looked at.
+                Tell the driver not to bother sending them
+                */
+                device_event[i]->off_wrap = 0;
+                device_event[i]->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+            }
         }
-        while (!exit_thread_flag){
-            if (*status & VIRTIO_CONFIG_S_DRIVER_OK) {
+    }
+
+    /*
+    Ring access layer. Every read of ring state in L2CPU memory goes through these,
+    so it gets counted in the queue's stats.ring_reads
+    */
+    template <typename T>
+    inline T guest_load(uint32_t queue_idx, const volatile T* p){
+        queues[queue_idx].stats.ring_reads++;
+        return *p;
+    }
+
+    inline void guest_copy(uint32_t queue_idx, void* dst, const void* src, size_t n){
+        queues[queue_idx].stats.ring_reads += guest_lines(src, n);
+        copy_from_guest(dst, src, n);
+    }
+
+    /*
+    Descriptor idx of a split queue. With ring_snapshot the 64 byte line holding it is
+    copied over in one read and the other descriptors in it come for free, chains are
+    mostly handed out in runs of consecutive descriptors
+    */
+    inline struct vring_desc load_desc(uint32_t queue_idx, uint16_t idx){
+        idx %= queue_nums[queue_idx];
+        struct vring_desc *d = &desc[queue_idx][idx];
+        if (!options.ring_snapshot) {
+            struct vring_desc r;
+            r.addr = guest_load(queue_idx, &d->addr);
+            r.len = guest_load(queue_idx, &d->len);
+            r.flags = guest_load(queue_idx, &d->flags);
+            r.next = (r.flags & VRING_DESC_F_NEXT) ? guest_load(queue_idx, &d->next) : 0;
+            return r;
+        }
+        RingCache& c = queues[queue_idx].ring;
+        uint32_t line = idx / DESCS_PER_LINE;
+        if (c.line_epoch[line] != c.epoch) {
+            guest_copy(queue_idx, &c.descs[line * DESCS_PER_LINE], &desc[queue_idx][line * DESCS_PER_LINE], GUEST_LINE);
+            c.line_epoch[line] = c.epoch;
+        }
+        return c.descs[idx];
+    }
+
+    // Forget the cached descriptor lines, the driver may have reused them since we last looked
+    inline void invalidate_descs(uint32_t queue_idx){
+        RingCache& c = queues[queue_idx].ring;
+        if (++c.epoch == 0) {
+            std::fill(c.line_epoch.begin(), c.line_epoch.end(), 0);
+            c.epoch = 1;
+        }
+    }
+
+    /*
+    Copy the available packed descriptors starting at idx (on lap wrap) into the window.
+    The flags are read as part of the bulk copy, so the rest of a descriptor could be
+    older than its flags: the descriptors found available get read a second time after
+    a barrier to be sure we have what the driver wrote before flipping them
+    */
+    void fill_packed_window(uint32_t queue_idx, uint16_t idx, bool wrap){
+        RingCache& c = queues[queue_idx].ring;
+        struct vring_packed_desc *ring = packed_desc[queue_idx];
+        uint16_t n = std::min<uint16_t>(PACKED_WINDOW, queue_nums[queue_idx] - idx);
+        guest_copy(queue_idx, c.window.data(), &ring[idx], n * sizeof(struct vring_packed_desc));
+        uint16_t k = 0;
+        while (k < n && packed_desc_available(c.window[k].flags, wrap)) {
+            k++;
+        }
+        if (k > 0) {
+            __sync_synchronize();
+            guest_copy(queue_idx, c.window.data(), &ring[idx], k * sizeof(struct vring_packed_desc));
+        }
+        c.window_start = idx;
+        c.window_count = k;
+        c.window_wrap = wrap;
+    }
+
+    // Packed descriptor idx if it is available on lap wrap
+    inline bool load_packed(uint32_t queue_idx, uint16_t idx, bool wrap, struct vring_packed_desc& out){
+        struct vring_packed_desc *d = &packed_desc[queue_idx][idx];
+        if (!options.ring_snapshot) {
+            uint16_t flags = guest_load(queue_idx, &d->flags);
+            if (!packed_desc_available(flags, wrap)) {
+                return false;
+            }
+            // Don't read the rest of the descriptor before we've seen it is available
+            __sync_synchronize();
+            out.addr = guest_load(queue_idx, &d->addr);
+            out.len = guest_load(queue_idx, &d->len);
+            out.id = guest_load(queue_idx, &d->id);
+            out.flags = flags;
+            return true;
+        }
+        RingCache& c = queues[queue_idx].ring;
+        if (c.window_wrap != wrap || idx < c.window_start || idx >= c.window_start + c.window_count) {
+            fill_packed_window(queue_idx, idx, wrap);
+        }
+        if (idx - c.window_start >= c.window_count) {
+            return false;
+        }
+        out = c.window[idx - c.window_start];
+        return true;
+    }
+
+    // Hand out a request for a chain on queue_idx, reusing finished ones
+    VirtioRequest* get_request(uint32_t queue_idx){
+        QueueContext& q = queues[queue_idx];
+        if (q.free_requests.empty()) {
+            q.requests.push_back(std::make_unique<VirtioRequest>());
+            q.free_requests.push_back(q.requests.back().get());
+        }
+        VirtioRequest* req = q.free_requests.back();
+        q.free_requests.pop_back();
+        req->reset(queue_idx);
+        return req;
+    }
+
+    /*
+    The device is done with req, len is the number of bytes it wrote into the chain's
+    writable buffers (header and status included). The request is put on the used ring
+    at the end of the current poll pass, along with everything else that completed.
+    Must be called from the thread servicing req's queue
+    */
+    void complete_request(VirtioRequest* req, uint32_t len){
+        req->len = len;
+        queues[req->queue_idx].completed.push_back(req);
+    }
+
+    inline void add_desc(VirtioRequest* req, uint64_t a, uint32_t l, uint16_t flags){
+        req->add_buffer(memory + (a - starting_address), l, flags & VRING_DESC_F_WRITE);
+    }
+
+    /*
+    Add the chain held in an indirect descriptor table at guest address a, len bytes long.
+    The table is pulled into host memory with one bulk copy so walking it doesn't cost a
+    round trip per descriptor. Split rings chain table entries through next starting at
+    entry 0, packed rings use every entry in order
+    */
+    void read_indirect(VirtioRequest* req, uint64_t a, uint64_t l, bool packed_table){
+        size_t entry_size = packed_table ? sizeof(struct vring_packed_desc) : sizeof(struct vring_desc);
+        size_t num_entries = std::min<size_t>(l / entry_size, queue_nums[req->queue_idx]);
+        if (num_entries == 0) {
+            printf("Ignoring empty indirect descriptor table on queue %u\n", req->queue_idx);
+            return;
+        }
+        std::vector<uint8_t>& indirect_table = queues[req->queue_idx].indirect_table;
+        indirect_table.resize(num_entries * entry_size);
+        guest_copy(req->queue_idx, indirect_table.data(), memory + (a - starting_address), indirect_table.size());
+
+        if (packed_table) {
+            struct vring_packed_desc *table = reinterpret_cast<struct vring_packed_desc*>(indirect_table.data());
+            for (size_t i = 0; i < num_entries; i++) {
+                add_desc(req, table[i].addr, table[i].len, table[i].flags);
+            }
+            return;
+        }
+
+        struct vring_desc *table = reinterpret_cast<struct vring_desc*>(indirect_table.data());
+        uint16_t idx = 0;
+        // Bound the walk by the table size so a bad next can't loop us forever
+        for (size_t n = 0; n < num_entries; n++) {
+            add_desc(req, table[idx].addr, table[idx].len, table[idx].flags);
+            if (!(table[idx].flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            idx = table[idx].next % num_entries;
+        }
+    }
+
+    /*
+    Collect the descriptor chain starting at desc_idx into req
+    */
+    void read_chain(VirtioRequest* req, uint16_t desc_idx){
+        /*
+        Sometimes the chain is just one entry in the desc_q
+        Sometimes the entries have a next flag set
+        (desc_q[desc_idx].flags & VRING_DESC_F_NEXT)
+        which means that we need to follow them
+        till we encounter an entry without that flag.
+        Bounded by the ring size in case the driver hands us a loop
+        */
+        for (uint32_t n = 0; n < queue_nums[req->queue_idx]; n++) {
+            struct vring_desc d = load_desc(req->queue_idx, desc_idx);
+            if (d.flags & VRING_DESC_F_INDIRECT) {
+                // An indirect descriptor is the whole chain, it can't have a next
+                read_indirect(req, d.addr, d.len, false);
+                break;
+            }
+            add_desc(req, d.addr, d.len, d.flags);
+            if (!(d.flags & VRING_DESC_F_NEXT)) {
                 break;
             }
+            desc_idx = d.next;
+        }
+        req->split(queue_header_size, queue_status_size);
+    }
+
+    /*
+    Pull every descriptor chain the driver has made available on queue_idx, up to
+    options.batch_budget of them, and hand them to process_request.
+    With ring_snapshot the new span of the avail ring is copied over in one go,
+    and descriptors a line at a time.
+    Returns the number of chains pulled
+    */
+    uint16_t process_split_queue(uint32_t queue_idx){
+        struct vring_avail *avail_q = avail[queue_idx];
+        uint16_t& processed = queues[queue_idx].processed;
+        uint16_t size = queue_nums[queue_idx];
+
+        __sync_synchronize();
+        /*
+        processed represents the tail of the queue (our point of view)
+        avail_idx represents the head of the queue (driver's point of view)
+        */
+        uint16_t avail_idx = *(volatile uint16_t*)&avail_q->idx;
+        if (processed == avail_idx) {
+            queues[queue_idx].stats.empty_polls++;
+            return 0;
+        }
+        queues[queue_idx].stats.ring_reads++;
+        // Make sure we don't read ring entries before the idx that covers them
+        __sync_synchronize();
+
+        uint16_t n = std::min<uint16_t>(avail_idx - processed, options.batch_budget);
+        RingCache& c = queues[queue_idx].ring;
+        if (options.ring_snapshot) {
+            invalidate_descs(queue_idx);
+            // In two goes if the span wraps around the end of the ring
+            c.heads.resize(n);
+            uint16_t start = processed % size;
+            uint16_t first = std::min<uint16_t>(n, size - start);
+            guest_copy(queue_idx, c.heads.data(), &avail_q->ring[start], first * sizeof(uint16_t));
+            if (first < n) {
+                guest_copy(queue_idx, c.heads.data() + first, &avail_q->ring[0], (n - first) * sizeof(uint16_t));
+            }
+        }
+
+        uint16_t count = 0;
+        while (count < n && queue_has_data(queue_idx)) {
+            /*
+            avail_q stores a list of descriptors for us to process
+            We pick a desc_idx to process from the avail queue
+            */
+            uint16_t desc_idx = options.ring_snapshot ? c.heads[count] : guest_load(queue_idx, &avail_q->ring[processed % size]);
+            VirtioRequest* req = get_request(queue_idx);
+            req->id = desc_idx;
+            read_chain(req, desc_idx);
+            processed += 1;
+            count += 1;
+            process_request(req);
+        }
+
+        if (count > 0 && event_idx) {
+            /*
+            Tell the driver we've seen everything up to processed (avail_event lives
+            right after the used ring), so it only kicks us for requests beyond that
+            */
+            *avail_event_ptr(queue_idx) = processed;
+        }
+        return count;
+    }
+
+    /*
+    Put every completed request of queue_idx on the used ring, published with a
+    single used->idx update and followed by one interrupt for the whole batch.
+    The used entries are put together in host memory and written out as one burst.
+    Returns the number of requests returned to the driver
+    */
+    uint16_t publish_split_queue(uint32_t queue_idx){
+        QueueContext& q = queues[queue_idx];
+        std::vector<VirtioRequest*>& done = q.completed;
+        if (done.empty()) {
+            return 0;
+        }
+        struct vring_used *used_q = used[queue_idx];
+        RingCache& c = q.ring;
+        uint16_t used_idx = options.ring_snapshot ? c.used_idx : guest_load(queue_idx, &used_q->idx);
+        uint16_t count = done.size();
+        /*
+        Fill in the used queue entries to inform the driver
+        that we've processed the chains starting at id in the descriptor queue
+        */
+        c.used_elems.resize(count);
+        for (uint16_t i = 0; i < count; i++) {
+            c.used_elems[i].id = done[i]->id;
+            c.used_elems[i].len = done[i]->len;
+        }
+        uint16_t size = queue_nums[queue_idx];
+        uint16_t start = used_idx % size;
+        uint16_t first = std::min<uint16_t>(count, size - start);
+        memcpy(&used_q->ring[start], c.used_elems.data(), first * sizeof(struct vring_used_elem));
+        if (first < count) {
+            memcpy(&used_q->ring[0], c.used_elems.data() + first, (count - first) * sizeof(struct vring_used_elem));
         }
+
+        // Publish the whole batch at once
+        __sync_synchronize();
+        used_q->idx = used_idx + count;
+        c.used_idx = used_idx + count;
+        q.stats.chains += count;
+        // used->idx has to be visible before we look at used_event
+        __sync_synchronize();
+        // Then set interrupt on plic, unless the driver doesn't want one yet
+        if (should_interrupt(queue_idx, used_idx, used_idx + count)) {
+            set_interrupt(queue_idx, count);
+        } else {
+            q.stats.interrupts_suppressed++;
+        }
+        q.free_requests.insert(q.free_requests.end(), done.begin(), done.end());
+        done.clear();
+        return count;
+    }
+
+    // A packed descriptor is available when its AVAIL bit matches our wrap counter and its USED bit doesn't
+    static inline bool packed_desc_available(uint16_t flags, bool wrap){
+        bool avail_bit = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+        bool used_bit = flags & (1 << VRING_PACKED_DESC_F_USED);
+        return avail_bit == wrap && used_bit != wrap;
+    }
+
+    static inline void packed_advance(uint16_t& idx, bool& wrap, uint16_t n, uint16_t size){
+        idx += n;
+        if (idx >= size) {
+            idx -= size;
+            wrap = !wrap;
+        }
+    }
+
+    /*
+    Packed ring counterpart of should_interrupt. The driver's event suppression struct
+    either turns used buffer notifications on or off, or (with EVENT_IDX) asks for one
+    once we write past a given descriptor. new_used_idx/wrap is our ring position after
+    the batch, old_used_idx is that minus the number of descriptors the batch used
+    */
+    inline bool should_interrupt_packed(uint32_t queue_idx, uint16_t old_used_idx, uint16_t new_used_idx, bool wrap){
+        struct vring_packed_desc_event *event = driver_event[queue_idx];
+        uint16_t flags = guest_load(queue_idx, &event->flags);
+        if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+            return false;
+        }
+        if (flags != VRING_PACKED_EVENT_FLAG_DESC || !event_idx) {
+            return true;
+        }
+        uint16_t off_wrap = guest_load(queue_idx, &event->off_wrap);
+        uint16_t off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+        // Same trick the Linux driver uses for kicks: an event offset from the other lap counts as negative
+        if ((bool)(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != wrap) {
+            off -= queue_nums[queue_idx];
+        }
+        return vring_need_event(off, new_used_idx, old_used_idx);
+    }
+
+    /*
+    Same as process_split_queue but for a packed ring, where chains are runs of
+    consecutive descriptors
+    */
+    uint16_t process_packed_queue(uint32_t queue_idx){
+        PackedQueueState& state = packed_state[queue_idx];
+        uint16_t size = queue_nums[queue_idx];
+        // Whatever we have in the window is from an earlier pass
+        queues[queue_idx].ring.window_count = 0;
+
+        // Look at the next descriptor's flags alone first, so polling an empty ring stays a single read
+        uint16_t flags = *(volatile uint16_t*)&packed_desc[queue_idx][state.avail_idx].flags;
+        if (!packed_desc_available(flags, state.avail_wrap)) {
+            queues[queue_idx].stats.empty_polls++;
+            return 0;
+        }
+        queues[queue_idx].stats.ring_reads++;
+
+        struct vring_packed_desc d;
+        uint16_t count = 0;
+        while (count < options.batch_budget && queue_has_data(queue_idx)) {
+            if (!load_packed(queue_idx, state.avail_idx, state.avail_wrap, d)) {
+                break;
+            }
+
+            VirtioRequest* req = get_request(queue_idx);
+            uint16_t idx = state.avail_idx;
+            bool wrap = state.avail_wrap;
+            uint16_t chain_len = 0;
+            while (chain_len < size) {
+                bool has_next = d.flags & VRING_DESC_F_NEXT;
+                if (d.flags & VRING_DESC_F_INDIRECT) {
+                    // Takes up a single ring slot whatever the size of the table
+                    read_indirect(req, d.addr, d.len, true);
+                    has_next = false;
+                } else {
+                    add_desc(req, d.addr, d.len, d.flags);
+                }
+                chain_len++;
+                if (!has_next) {
+                    // The buffer id lives in the last descriptor of the chain
+                    req->id = d.id;
+                    break;
+                }
+                packed_advance(idx, wrap, 1, size);
+                // The driver makes the rest of a chain available before its head
+                if (!load_packed(queue_idx, idx, wrap, d)) {
+                    printf("Packed chain on queue %u runs into a descriptor that isn't available\n", queue_idx);
+                    break;
+                }
+            }
+            packed_advance(state.avail_idx, state.avail_wrap, chain_len, size);
+            req->ring_slots = chain_len;
+            req->split(queue_header_size, queue_status_size);
+            count++;
+            process_request(req);
+        }
+        return count;
+    }
+
+    /*
+    Return completed requests to a packed ring. Each one is returned by overwriting the
+    descriptor at our used position with its buffer id and used length, then skipping
+    over as many descriptors as its chain took up. Every used descriptor but the first
+    is written first, the first one's flags go last so the driver sees the whole batch at once
+    */
+    uint16_t publish_packed_queue(uint32_t queue_idx){
+        QueueContext& q = queues[queue_idx];
+        std::vector<VirtioRequest*>& done = q.completed;
+        if (done.empty()) {
+            return 0;
+        }
+        struct vring_packed_desc *ring = packed_desc[queue_idx];
+        PackedQueueState& state = packed_state[queue_idx];
+
+        uint16_t descs_used = 0;
+        std::vector<PackedUsed>& packed_used = q.packed_used;
+        packed_used.clear();
+        for (VirtioRequest* req : done) {
+            packed_used.push_back(PackedUsed{state.used_idx, req->id, req->len, state.used_wrap});
+            packed_advance(state.used_idx, state.used_wrap, req->ring_slots, queue_nums[queue_idx]);
+            descs_used += req->ring_slots;
+        }
+
+        for (PackedUsed& u : packed_used) {
+            ring[u.pos].id = u.id;
+            ring[u.pos].len = u.len;
+        }
+        __sync_synchronize();
+        for (size_t i = 1; i < packed_used.size(); i++) {
+            PackedUsed& u = packed_used[i];
+            ring[u.pos].flags = u.wrap ? (1 << VRING_PACKED_DESC_F_AVAIL) | (1 << VRING_PACKED_DESC_F_USED) : 0;
+        }
+        __sync_synchronize();
+        PackedUsed& first = packed_used[0];
+        ring[first.pos].flags = first.wrap ? (1 << VRING_PACKED_DESC_F_AVAIL) | (1 << VRING_PACKED_DESC_F_USED) : 0;
+
+        uint16_t count = packed_used.size();
+        q.stats.chains += count;
+        // The used descriptors have to be visible before we look at the driver's event suppression
+        __sync_synchronize();
+        if (should_interrupt_packed(queue_idx, (uint16_t)(state.used_idx - descs_used), state.used_idx, state.used_wrap)) {
+            set_interrupt(queue_idx, count);
+        } else {
+            q.stats.interrupts_suppressed++;
+        }
+        q.free_requests.insert(q.free_requests.end(), done.begin(), done.end());
+        done.clear();
+        return count;
+    }
+
+    // Add the per queue counters up into stats
+    void collect_stats(){
+        stats = VirtioStats();
+        for (QueueContext& q : queues) {
+            stats += q.stats;
+        }
+    }
+
+    // One line summary of stats
+    void report(const char* name){
+        collect_stats();
+        printf("%s: %lu requests, %lu interrupts (%lu suppressed), %.2f ring reads per request, %lu empty polls\n",
+            name, stats.chains, stats.interrupts_raised, stats.interrupts_suppressed,
+            stats.chains ? (double)stats.ring_reads / stats.chains : 0.0, stats.empty_polls);
+    }
+
+    // CPU time vs latency of the device thread, or of every queue worker if they were used
+    void report_polling(const std::string& name){
+        if (!workers_running) {
+            poller.report(name.c_str());
+            return;
+        }
+        for (uint32_t i = 0; i < queues.size(); i++) {
+            queues[i].poller.report((name + " queue " + std::to_string(i)).c_str());
+        }
+    }
+
+    inline bool device_alive(){
+        return *magic_value == ('v' | 'i' << 8 | 'r' << 16 | 't' << 24);
+    }
+
+    /*
+    One poll pass over queue_idx: pull new requests off it, reap asynchronous completions
+    and give back whatever finished as one batch. Returns whether there was anything to do
+    */
+    bool service_queue(uint32_t queue_idx){
+        uint16_t count = packed ? process_packed_queue(queue_idx) : process_split_queue(queue_idx);
+        uint32_t reaped = poll_completions(queue_idx);
+        if (packed) {
+            publish_packed_queue(queue_idx);
+        } else {
+            publish_split_queue(queue_idx);
+        }
+        return count > 0 || reaped > 0;
+    }
+
+    // Thread body for options.queue_workers, stop tells the other workers when the guest goes away
+    void queue_worker(uint32_t queue_idx, std::atomic<bool>& stop){
+        if (!options.worker_cpus.empty()) {
+            int cpu = options.worker_cpus[queue_idx % options.worker_cpus.size()];
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            if (r != 0) {
+                printf("Failed to pin queue %u worker to cpu %d: %s\n", queue_idx, cpu, strerror(r));
+            }
+        }
+        Poller& queue_poller = queues[queue_idx].poller;
+        queue_poller.start(options.poll);
+        while (!exit_thread_flag && !stop) {
+            if (!device_alive()) {
+                stop = true;
+                break;
+            }
+            bool did_work = service_queue(queue_idx);
+            queue_poller.wait(did_work, wait_fd(queue_idx));
+        }
+        queue_poller.stop();
     }
 
     void device_loop(){
-        std::vector<uint16_t> processed(num_queues, 0);
+        interrupt_source = interrupts.add_source(interrupt_number, options.coalesce);
+        if (interrupt_source < 0) {
+            printf("No interrupt mailbox left for interrupt %d\n", interrupt_number);
+            return;
+        }
 
+        if (options.queue_workers && num_queues > 1) {
+            // Every queue gets a thread, with its own cursor, request pool and poller
+            workers_running = true;
+            std::atomic<bool> stop{false};
+            std::vector<std::thread> workers;
+            for (uint32_t queue_idx = 0; queue_idx < num_queues; queue_idx++) {
+                workers.emplace_back(&VirtioDevice::queue_worker, this, queue_idx, std::ref(stop));
+            }
+            for (std::thread& worker : workers) {
+                worker.join();
+            }
+            collect_stats();
+            return;
+        }
+
+        // All queues share our poller, any queue's fd can wake it up
+        int fd = -1;
+        for (uint32_t queue_idx = 0; queue_idx < num_queues && fd < 0; queue_idx++) {
+            fd = wait_fd(queue_idx);
+        }
+
+        poller.start(options.poll);
         while (!exit_thread_flag) {
-            if (*magic_value != ('v' | 'i' << 8 | 'r' << 16 | 't' << 24)) {
-                return;
+            if (!device_alive()) {
+                break;
             }
 
             // uint32_t queue_notify_val = *queue_notify;
@@ -300,84 +1153,16 @@ public:
             ack_interrupt();
 
             // Process each virtqueue
+            bool did_work = false;
             for(uint32_t queue_idx=0; queue_idx<num_queues; queue_idx++){
-                struct vring_desc *desc_q = desc[queue_idx];
-                struct vring_avail *avail_q = avail[queue_idx];
-                struct vring_used *used_q = used[queue_idx];
-                
-                // if (queue_notify_val == i) {
-                    __sync_synchronize();
-                    bool should_i_set_interrupt=false;
-                    uint16_t avail_idx = avail_q->idx;
-                    /*
-                    processed[i] represents the tail of the queue (our point of view)
-                    avail_idx represents the head of the queue (driver's point of view)
-                    */
-                    if (processed[queue_idx] != avail_idx && queue_has_data(queue_idx)) {
-                        should_i_set_interrupt=true;
-                        /*
-                        avail_q stores a list of descriptors for us to process
-                        We pick a desc_idx to process from the avail queue
-                        */
-                        uint16_t desc_idx = avail_q->ring[processed[queue_idx] % queue_size];
-                        uint16_t desc_idx_first = desc_idx;
-                        
-                        /*
-                        desc_idx points to an index of desc_q
-                        We either read or write data to that index in the descriptor queue
-                        */
-                        uint64_t num_bytes_written = 0;
-                        uint64_t l = desc_q[desc_idx % queue_size].len;
-                        uint64_t a = desc_q[desc_idx % queue_size].addr;
-                        uint8_t *addr = memory + (a - starting_address);;
-                        
-                        /*
-                        Sometimes we just process one entry in the desc_q
-                        Sometimes the entries have a next flag set 
-                        (desc_q[desc_idx].flags & VRING_DESC_F_NEXT)
-                        which means that we need to process multiple entries
-                        till we encounter an entry without that flag
-                        */
-                        while (true) {
-                            l = desc_q[desc_idx % queue_size].len;
-                            a = desc_q[desc_idx % queue_size].addr;
-                            addr = memory + (a - starting_address);
-                            
-                            if ((desc_q[desc_idx % queue_size].flags & VRING_DESC_F_NEXT)) {
-                                if (num_bytes_written < queue_header_size) {
-                                    process_queue_start(queue_idx, addr, l);
-                                } else {
-                                    process_queue_data(queue_idx, addr, l);
-                                }
-                                num_bytes_written += l;
-                                desc_idx = desc_q[desc_idx % queue_size].next;
-                            } else {
-                                process_queue_complete(queue_idx, addr, l);
-                                num_bytes_written += l;
-                                break;
-                            }
-                        }
-                        
-                        /*
-                        We then update the used queue to inform the driver
-                        that we've processed desc_idx_first in the descriptor queue
-                        */
-                        uint16_t used_idx = used_q->idx;
-                        used_q->ring[used_idx % queue_size].id = desc_idx_first;
-                        used_q->ring[used_idx % queue_size].len = num_bytes_written; // Is this the right value? Should it be device dependent
-                        __sync_synchronize();
-                        used_q->idx = used_idx + 1;
-
-                        processed[queue_idx] += 1;
-                    }
-                    if (should_i_set_interrupt){
-                        // Set interrupt on plic if we processed at least 1 descriptor
-                        set_interrupt();
-                    }
-                // }
+                if (service_queue(queue_idx)) {
+                    did_work = true;
+                }
             }
-            usleep(1);
+            poller.wait(did_work, fd);
         }
+        poller.stop();
+        collect_stats();
     }
     virtual ~VirtioDevice() = default;
 
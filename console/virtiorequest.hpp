@@ -0,0 +1,155 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <sys/uio.h>
+
+// One guest buffer of a descriptor chain, already translated to a host pointer
+struct VirtioBuffer {
+    uint8_t* addr;
+    uint32_t len;
+    // VRING_DESC_F_WRITE: the device writes this buffer, otherwise it only reads it
+    bool writable;
+};
+
+/*
+A descriptor chain pulled off a virtqueue, handed to the device in one piece.
+
+The chain is cut up according to the queue's layout: the first header bytes
+(virtio_blk_outhdr, virtio_net_hdr...) go in header, a trailing status byte
+(virtio-blk) is pointed to by status, and whatever is left in between ends up
+in readable (driver -> device) or writable (device -> driver) as iovecs, ready
+to be passed to preadv/pwritev. The header can be split over several buffers,
+read_header/write_header take care of that.
+
+The device finishes a request with VirtioDevice::complete_request, either
+straight away from process_request or later on (asynchronous backends). Until
+then the request, and the guest buffers it points at, belong to the device
+*/
+struct VirtioRequest {
+    uint32_t queue_idx = 0;
+    // Goes back to the driver on the used ring: head descriptor index (split) or buffer id (packed)
+    uint16_t id = 0;
+    // Descriptors the chain took up in a packed ring
+    uint16_t ring_slots = 0;
+    // Bytes written into the chain's writable buffers, filled in by complete_request
+    uint32_t len = 0;
+
+    // The whole chain in order
+    std::vector<VirtioBuffer> buffers;
+
+    std::vector<struct iovec> header;
+    std::vector<struct iovec> readable;
+    std::vector<struct iovec> writable;
+    uint8_t* status = nullptr;
+
+    // Free for the device to hang its own state off while the request is in flight
+    void* device_data = nullptr;
+
+    void reset(uint32_t queue_idx_){
+        queue_idx = queue_idx_;
+        id = 0;
+        ring_slots = 0;
+        len = 0;
+        device_data = nullptr;
+        buffers.clear();
+    }
+
+    inline void add_buffer(uint8_t* addr, uint32_t len_, bool writable_){
+        buffers.push_back(VirtioBuffer{addr, len_, writable_});
+    }
+
+    /*
+    Cut the chain into header, payload and status. The status has to sit at the end
+    of the last buffer and be writable, otherwise status is left null and those bytes
+    count as payload
+    */
+    void split(size_t header_bytes, size_t status_bytes){
+        header.clear();
+        readable.clear();
+        writable.clear();
+        status = nullptr;
+
+        size_t total = 0;
+        for (VirtioBuffer& b : buffers) {
+            total += b.len;
+        }
+        size_t status_start = total;
+        if (status_bytes && !buffers.empty()) {
+            VirtioBuffer& last = buffers.back();
+            if (last.writable && last.len >= status_bytes) {
+                status = last.addr + last.len - status_bytes;
+                status_start = total - status_bytes;
+            }
+        }
+        size_t header_end = std::min(header_bytes, status_start);
+
+        size_t pos = 0;
+        for (VirtioBuffer& b : buffers) {
+            size_t begin = pos;
+            size_t start = pos;
+            size_t end = pos + b.len;
+            pos = end;
+            if (start < header_end) {
+                size_t n = std::min(end, header_end) - start;
+                header.push_back({b.addr, n});
+                start += n;
+            }
+            end = std::min(end, status_start);
+            if (start < end) {
+                struct iovec v = {b.addr + (start - begin), end - start};
+                (b.writable ? writable : readable).push_back(v);
+            }
+        }
+    }
+
+    static size_t iov_size(const std::vector<struct iovec>& iov){
+        size_t n = 0;
+        for (const struct iovec& v : iov) {
+            n += v.iov_len;
+        }
+        return n;
+    }
+
+    // Copy out of / into an iovec list, returns the number of bytes copied
+    static size_t iov_to_buf(const std::vector<struct iovec>& iov, void* dst, size_t n){
+        size_t done = 0;
+        for (const struct iovec& v : iov) {
+            if (done == n) {
+                break;
+            }
+            size_t chunk = std::min(v.iov_len, n - done);
+            memcpy(static_cast<uint8_t*>(dst) + done, v.iov_base, chunk);
+            done += chunk;
+        }
+        return done;
+    }
+
+    static size_t iov_from_buf(const std::vector<struct iovec>& iov, const void* src, size_t n){
+        size_t done = 0;
+        for (const struct iovec& v : iov) {
+            if (done == n) {
+                break;
+            }
+            size_t chunk = std::min(v.iov_len, n - done);
+            memcpy(v.iov_base, static_cast<const uint8_t*>(src) + done, chunk);
+            done += chunk;
+        }
+        return done;
+    }
+
+    size_t header_size() const { return iov_size(header); }
+    size_t readable_size() const { return iov_size(readable); }
+    size_t writable_size() const { return iov_size(writable); }
+
+    size_t read_header(void* dst, size_t n) const { return iov_to_buf(header, dst, n); }
+    size_t write_header(const void* src, size_t n) { return iov_from_buf(header, src, n); }
+    // Payload the driver gave us / payload going back to the driver
+    size_t gather(void* dst, size_t n) const { return iov_to_buf(readable, dst, n); }
+    size_t scatter(const void* src, size_t n) { return iov_from_buf(writable, src, n); }
+};
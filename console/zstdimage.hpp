@@ -0,0 +1,366 @@
+// SPDX-FileCopyrightText: © 2025 Tenstorrent AI ULC
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zstd.h>
+
+#include "blkbackend.hpp"
+
+struct ZstdOptions {
+    // Most decompressed data kept around, shared by all queues of the disk
+    uint64_t cache_bytes = 256ULL << 20;
+    // Threads decompressing frames, 0 picks one per host cpu (up to 8)
+    unsigned workers = 0;
+    // Frames decompressed ahead of a sequential reader
+    unsigned readahead = 4;
+};
+
+/*
+Read-only disk from a seekable zstd image, in zstd's seekable format (what
+contrib/seekable_format's seekable_compression or t2sz write): the image is cut into
+frames that decompress on their own, and a skippable frame at the end lists the
+compressed and decompressed size of each. Put a CowImage over it (--disk-base) for a
+disk the guest can write to.
+
+Frames are decompressed into an LRU cache with a memory budget. A read queues every
+frame it needs that isn't cached on a pool of workers, plus the next few when the
+reads look sequential, and decompresses whatever is still queued itself rather than
+waiting, so big and sequential reads use several cores.
+
+Seek table, all little endian:
+    u32 0x184D2A5E, u32 size of the rest
+    per frame: u32 compressed size, u32 decompressed size, [u32 checksum]
+    u32 number of frames, u8 descriptor (0x80: checksums present), u32 0x8F92EAB1
+*/
+class ZstdImage : public BlkBackend {
+public:
+    static constexpr uint32_t SKIPPABLE_MAGIC = 0x184D2A5E;
+    static constexpr uint32_t SEEKABLE_MAGIC = 0x8F92EAB1;
+    static constexpr size_t FOOTER_SIZE = 9;
+    // Anything bigger is more likely a corrupt table than a real frame
+    static constexpr uint32_t MAX_FRAME_SIZE = 64 << 20;
+
+private:
+    int fd = -1;
+    ZstdOptions options;
+    // num_frames + 1 entries, frame f is [offsets[f], offsets[f + 1]) of each
+    std::vector<uint64_t> compressed_offsets, offsets;
+
+    enum class State { QUEUED, LOADING, READY };
+    struct Frame {
+        State state = State::QUEUED;
+        int error = 0;
+        bool from_readahead = false;
+        std::shared_ptr<const std::vector<uint8_t>> data;
+        // In lru once READY
+        std::list<uint64_t>::iterator lru_pos;
+    };
+
+    std::mutex lock;
+    std::condition_variable work_cv, ready_cv;
+    std::unordered_map<uint64_t, Frame> frames;
+    // Most recently used at the front, only READY frames
+    std::list<uint64_t> lru;
+    uint64_t cached_bytes = 0;
+    std::deque<uint64_t> work;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+    // Where the last read ended, to spot sequential ones
+    uint64_t last_end = UINT64_MAX;
+
+    std::atomic<uint64_t> hits{0}, misses{0}, readahead_frames{0}, readahead_hits{0}, evictions{0};
+
+    ZstdImage() = default;
+
+    uint64_t frame_of(uint64_t offset){
+        return std::upper_bound(offsets.begin(), offsets.end(), offset) - offsets.begin() - 1;
+    }
+
+    // Decompress frame f into a new buffer, 0 or -errno
+    int decompress(uint64_t f, std::shared_ptr<const std::vector<uint8_t>>& out){
+        struct DCtxDeleter {
+            void operator()(ZSTD_DCtx* ctx){ ZSTD_freeDCtx(ctx); }
+        };
+        thread_local std::unique_ptr<ZSTD_DCtx, DCtxDeleter> dctx(ZSTD_createDCtx());
+        thread_local std::vector<uint8_t> compressed;
+        compressed.resize(compressed_offsets[f + 1] - compressed_offsets[f]);
+        if (pread(fd, compressed.data(), compressed.size(), compressed_offsets[f]) != (ssize_t)compressed.size()) {
+            return -EIO;
+        }
+        auto data = std::make_shared<std::vector<uint8_t>>(offsets[f + 1] - offsets[f]);
+        size_t r = ZSTD_decompressDCtx(dctx.get(), data->data(), data->size(), compressed.data(), compressed.size());
+        if (ZSTD_isError(r) || r != data->size()) {
+            return -EIO;
+        }
+        out = std::move(data);
+        return 0;
+    }
+
+    // With lock held, frame f was QUEUED and is now decompressed (or failed), lock is dropped meanwhile
+    void load(std::unique_lock<std::mutex>& guard, uint64_t f){
+        frames[f].state = State::LOADING;
+        guard.unlock();
+        std::shared_ptr<const std::vector<uint8_t>> data;
+        int error = decompress(f, data);
+        guard.lock();
+        Frame& frame = frames[f];
+        frame.state = State::READY;
+        frame.error = error;
+        frame.data = std::move(data);
+        if (frame.data) {
+            cached_bytes += frame.data->size();
+        }
+        lru.push_front(f);
+        frame.lru_pos = lru.begin();
+        evict();
+        ready_cv.notify_all();
+    }
+
+    // With lock held, drop least recently used frames until we're back under budget
+    void evict(){
+        while (cached_bytes > options.cache_bytes && lru.size() > 1) {
+            uint64_t f = lru.back();
+            lru.pop_back();
+            Frame& frame = frames[f];
+            if (frame.data) {
+                cached_bytes -= frame.data->size();
+            }
+            frames.erase(f);
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // With lock held, make sure frame f is cached or on its way
+    void want(uint64_t f, bool readahead){
+        auto it = frames.find(f);
+        if (it != frames.end()) {
+            if (!readahead) {
+                hits.fetch_add(1, std::memory_order_relaxed);
+                if (it->second.from_readahead) {
+                    readahead_hits.fetch_add(1, std::memory_order_relaxed);
+                    it->second.from_readahead = false;
+                }
+            }
+            return;
+        }
+        Frame& frame = frames[f];
+        frame.from_readahead = readahead;
+        (readahead ? readahead_frames : misses).fetch_add(1, std::memory_order_relaxed);
+        work.push_back(f);
+    }
+
+    void worker_loop(){
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            work_cv.wait(guard, [&]{ return stopping || !work.empty(); });
+            if (stopping) {
+                return;
+            }
+            uint64_t f = work.front();
+            work.pop_front();
+            // Whoever asked for it may have got to it first
+            auto it = frames.find(f);
+            if (it != frames.end() && it->second.state == State::QUEUED) {
+                load(guard, f);
+            }
+        }
+    }
+
+public:
+    // Whether path ends with a seekable zstd seek table
+    static bool probe(const std::string& path){
+        int f = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (f < 0) {
+            return false;
+        }
+        struct stat sb;
+        uint8_t footer[FOOTER_SIZE];
+        uint32_t magic = 0;
+        if (fstat(f, &sb) == 0 && sb.st_size >= (off_t)FOOTER_SIZE
+            && pread(f, footer, sizeof(footer), sb.st_size - FOOTER_SIZE) == sizeof(footer)) {
+            memcpy(&magic, footer + 5, sizeof(magic));
+        }
+        close(f);
+        return magic == SEEKABLE_MAGIC;
+    }
+
+    // Open the image at path and read its seek table, null (after saying why) if that fails
+    static std::unique_ptr<ZstdImage> open_image(const std::string& path, const ZstdOptions& options = ZstdOptions()){
+        std::unique_ptr<ZstdImage> image(new ZstdImage());
+        image->options = options;
+        image->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat sb;
+        uint8_t footer[FOOTER_SIZE];
+        if (image->fd < 0 || fstat(image->fd, &sb) != 0 || sb.st_size < (off_t)FOOTER_SIZE
+            || pread(image->fd, footer, sizeof(footer), sb.st_size - FOOTER_SIZE) != sizeof(footer)) {
+            perror(("Failed to read " + path).c_str());
+            return nullptr;
+        }
+        uint32_t num_frames, magic;
+        memcpy(&num_frames, footer, sizeof(num_frames));
+        uint8_t descriptor = footer[4];
+        memcpy(&magic, footer + 5, sizeof(magic));
+        size_t entry_size = descriptor & 0x80 ? 12 : 8;
+        uint64_t table_size = (uint64_t)num_frames * entry_size + FOOTER_SIZE;
+        if (magic != SEEKABLE_MAGIC || (descriptor & 0x7c) || table_size + 8 > (uint64_t)sb.st_size) {
+            printf("%s: not a seekable zstd image\n", path.c_str());
+            return nullptr;
+        }
+        std::vector<uint8_t> table(table_size + 8);
+        if (pread(image->fd, table.data(), table.size(), sb.st_size - table.size()) != (ssize_t)table.size()) {
+            perror(("Failed to read seek table of " + path).c_str());
+            return nullptr;
+        }
+        uint32_t skippable_magic, frame_size;
+        memcpy(&skippable_magic, table.data(), sizeof(skippable_magic));
+        memcpy(&frame_size, table.data() + 4, sizeof(frame_size));
+        if (skippable_magic != SKIPPABLE_MAGIC || frame_size != table_size) {
+            printf("%s: bad seek table\n", path.c_str());
+            return nullptr;
+        }
+        image->compressed_offsets.push_back(0);
+        image->offsets.push_back(0);
+        for (uint32_t f = 0; f < num_frames; f++) {
+            uint32_t compressed, decompressed;
+            memcpy(&compressed, table.data() + 8 + f * entry_size, sizeof(compressed));
+            memcpy(&decompressed, table.data() + 8 + f * entry_size + 4, sizeof(decompressed));
+            if (decompressed > MAX_FRAME_SIZE) {
+                printf("%s: frame %u is %u bytes, bigger than we handle\n", path.c_str(), f, decompressed);
+                return nullptr;
+            }
+            image->compressed_offsets.push_back(image->compressed_offsets.back() + compressed);
+            image->offsets.push_back(image->offsets.back() + decompressed);
+        }
+        if (image->compressed_offsets.back() > (uint64_t)sb.st_size - table.size()) {
+            printf("%s: seek table runs past the frames\n", path.c_str());
+            return nullptr;
+        }
+
+        unsigned workers = options.workers;
+        if (workers == 0) {
+            workers = std::min(std::max(std::thread::hardware_concurrency(), 1U), 8U);
+        }
+        for (unsigned i = 0; i < workers; i++) {
+            image->workers.emplace_back(&ZstdImage::worker_loop, image.get());
+        }
+        return image;
+    }
+
+    ~ZstdImage(){
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        for (std::thread& t : workers) {
+            t.join();
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    uint64_t size() override {
+        return offsets.back();
+    }
+
+    bool read_only() override {
+        return true;
+    }
+
+    ssize_t read(void* buf, size_t len, uint64_t offset) override {
+        uint8_t* p = static_cast<uint8_t*>(buf);
+        uint64_t end = std::min<uint64_t>(offset + len, size());
+        if (offset >= end) {
+            memset(p, 0, len);
+            return len;
+        }
+        memset(p + (end - offset), 0, len - (end - offset));
+        uint64_t first = frame_of(offset), last = frame_of(end - 1);
+
+        std::vector<std::shared_ptr<const std::vector<uint8_t>>> data;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            for (uint64_t f = first; f <= last; f++) {
+                want(f, false);
+            }
+            if (offset == last_end) {
+                for (uint64_t f = last + 1; f <= last + options.readahead && f + 1 < offsets.size(); f++) {
+                    want(f, true);
+                }
+            }
+            last_end = end;
+            if (!work.empty()) {
+                work_cv.notify_all();
+            }
+            for (uint64_t f = first; f <= last; f++) {
+                while (true) {
+                    auto it = frames.find(f);
+                    if (it == frames.end() || it->second.state == State::QUEUED) {
+                        // Do the work ourselves if no worker has picked it up yet (or it got evicted meanwhile)
+                        load(guard, f);
+                    } else if (it->second.state == State::LOADING) {
+                        ready_cv.wait(guard);
+                    } else {
+                        break;
+                    }
+                }
+                Frame& frame = frames[f];
+                if (frame.error) {
+                    int error = frame.error;
+                    // Let the next read try again
+                    lru.erase(frame.lru_pos);
+                    frames.erase(f);
+                    return error;
+                }
+                lru.splice(lru.begin(), lru, frame.lru_pos);
+                data.push_back(frame.data);
+            }
+        }
+        // The frames can be evicted from here on, we hold our own references
+        for (uint64_t f = first; f <= last; f++) {
+            uint64_t from = std::max(offset, offsets[f]), to = std::min(end, offsets[f + 1]);
+            memcpy(p + (from - offset), data[f - first]->data() + (from - offsets[f]), to - from);
+        }
+        return len;
+    }
+
+    ssize_t write(const void* buf, size_t len, uint64_t offset) override {
+        return -EROFS;
+    }
+
+    int flush() override {
+        return 0;
+    }
+
+    int zero(uint64_t offset, uint64_t len, bool unmap) override {
+        return -EROFS;
+    }
+
+    void report(const std::string& name) override {
+        uint64_t h = hits.load(), m = misses.load();
+        std::lock_guard<std::mutex> guard(lock);
+        printf("%s: %zu zstd frames, %.1f%% cache hits (%lu of them read ahead), %lu read ahead, %lu evicted, %.1f MB cached\n",
+            name.c_str(), offsets.size() - 1, h + m ? 100.0 * h / (h + m) : 0.0, readahead_hits.load(),
+            readahead_frames.load(), evictions.load(), cached_bytes / 1e6);
+    }
+};